@@ -0,0 +1,99 @@
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "CRC32C.hpp"
+
+namespace ns_persistent {
+
+  // reflected polynomial of CRC-32C
+  #define CRC32C_POLY (0x82f63b78U)
+
+  // the lookup table is computed at compile time.
+  struct Crc32cTable {
+    uint32_t t[256];
+    constexpr Crc32cTable():t() {
+      for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+          c = (c & 1) ? ((c >> 1) ^ CRC32C_POLY) : (c >> 1);
+        }
+        t[i] = c;
+      }
+    }
+  };
+
+  static constexpr Crc32cTable crc32cTable;
+
+  static uint32_t crc32cTableKernel(uint32_t crc, const void * buf, size_t len) {
+    const uint8_t * p = (const uint8_t *)buf;
+    crc = ~crc;
+    while (len--) {
+      crc = crc32cTable.t[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+  }
+
+#if defined(__x86_64__)
+  // The crc32 instruction computes the same reflected CRC-32C, 8 bytes at a
+  // time.
+  __attribute__((target("sse4.2")))
+  static uint32_t crc32cSse42(uint32_t crc, const void * buf, size_t len) {
+    const uint8_t * p = (const uint8_t *)buf;
+    uint64_t c = ~crc;
+    while (len > 0 && ((uint64_t)p & 7) != 0) {
+      c = _mm_crc32_u8((uint32_t)c,*p++);
+      len--;
+    }
+    while (len >= 8) {
+      uint64_t v;
+      memcpy(&v,p,8);
+      c = _mm_crc32_u64(c,v);
+      p += 8;
+      len -= 8;
+    }
+    while (len--) {
+      c = _mm_crc32_u8((uint32_t)c,*p++);
+    }
+    return ~(uint32_t)c;
+  }
+#endif
+
+  static const char * crc32cKernel = "table";
+
+  typedef uint32_t (*Crc32cFunc)(uint32_t, const void *, size_t);
+
+  static Crc32cFunc pickCrc32c() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+      crc32cKernel = "sse4.2";
+      return crc32cSse42;
+    }
+#endif
+    return crc32cTableKernel;
+  }
+
+  // The first call picks the implementation, like keyMaskLE4.
+  static uint32_t crc32cResolve(uint32_t crc, const void * buf, size_t len);
+
+  static Crc32cFunc crc32cFunc = crc32cResolve;
+
+  static uint32_t crc32cResolve(uint32_t crc, const void * buf, size_t len) {
+    Crc32cFunc func = pickCrc32c();
+    __atomic_store_n(&crc32cFunc,func,__ATOMIC_RELAXED);
+    return func(crc,buf,len);
+  }
+
+  uint32_t crc32c(uint32_t crc, const void * buf, size_t len)
+  noexcept(true) {
+    return __atomic_load_n(&crc32cFunc,__ATOMIC_RELAXED)(crc,buf,len);
+  }
+
+  const char * getCrc32cKernel() noexcept(true) {
+    if (__atomic_load_n(&crc32cFunc,__ATOMIC_RELAXED) == crc32cResolve) {
+      __atomic_store_n(&crc32cFunc,pickCrc32c(),__ATOMIC_RELAXED);
+    }
+    return crc32cKernel;
+  }
+}
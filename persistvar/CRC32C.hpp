@@ -0,0 +1,22 @@
+#ifndef CRC32C_HPP
+#define CRC32C_HPP
+#include <sys/types.h>
+#include <inttypes.h>
+
+namespace ns_persistent {
+
+  // CRC-32C (Castagnoli) checksum of a buffer.
+  // @param crc - the checksum of the preceding bytes, 0 for a new checksum.
+  //        This allows to checksum a record piece by piece.
+  // @param buf - the data
+  // @param len - length of the data
+  // @return the checksum
+  // The instruction is picked for the CPU when the library is loaded: the
+  // SSE4.2 crc32 instruction, or a lookup table.
+  uint32_t crc32c(uint32_t crc, const void * buf, size_t len) noexcept(true);
+
+  // @return the name of the implementation in use: "sse4.2" or "table".
+  const char * getCrc32cKernel() noexcept(true);
+}
+
+#endif//CRC32C_HPP
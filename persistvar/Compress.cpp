@@ -0,0 +1,177 @@
+#include <string.h>
+#include "Compress.hpp"
+
+namespace ns_persistent {
+
+  // An LZ4 block is a list of sequences. A sequence is a token, whose high
+  // nibble is the literal length and low nibble the match length - 4, then
+  // the extension bytes of the literal length, the literals, the 2-byte
+  // offset of the match and the extension bytes of the match length. The
+  // last sequence has only literals.
+  #define LZ4_MIN_MATCH       (4)
+  // the last match starts at least 12 bytes before the end, and the last 5
+  // bytes are literals.
+  #define LZ4_MF_LIMIT        (12)
+  #define LZ4_LAST_LITERALS   (5)
+  #define LZ4_MAX_OFFSET      (65535)
+  #define LZ4_HASH_BITS       (12)
+
+  static inline uint32_t read32(const uint8_t * p) {
+    uint32_t v;
+    memcpy(&v,p,4);
+    return v;
+  }
+
+  static inline uint32_t hash32(uint32_t v) {
+    return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+  }
+
+  // write the extension bytes of a length
+  static inline uint8_t * writeLength(uint8_t * op, uint64_t len) {
+    while (len >= 255) {
+      *op++ = 255;
+      len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+  }
+
+  static inline uint8_t * writeLiterals(uint8_t * op, const uint8_t * lit, uint64_t len,
+    uint8_t * token) {
+    if (len >= 15) {
+      *token = 15 << 4;
+      op = writeLength(op,len - 15);
+    } else {
+      *token = (uint8_t)(len << 4);
+    }
+    memcpy(op,lit,len);
+    return op + len;
+  }
+
+  uint64_t lz4Compress(const void * src, uint64_t size, void * dst)
+  noexcept(true) {
+    const uint8_t * const base = (const uint8_t *)src;
+    const uint8_t * const end = base + size;
+    const uint8_t * ip = base;
+    const uint8_t * anchor = base;
+    uint8_t * op = (uint8_t *)dst;
+    // the last position of each hashed 4-byte sequence
+    uint32_t table[1 << LZ4_HASH_BITS];
+
+    if (size > LZ4_MF_LIMIT) {
+      const uint8_t * const mflimit = end - LZ4_MF_LIMIT;
+      memset(table,0,sizeof(table));
+      ip ++;
+      while (ip < mflimit) {
+        const uint32_t seq = read32(ip);
+        const uint32_t h = hash32(seq);
+        const uint8_t * ref = base + table[h];
+        table[h] = (uint32_t)(ip - base);
+        if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || read32(ref) != seq) {
+          ip ++;
+          continue;
+        }
+        // extend the match backward over the literals and forward.
+        while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+          ip --;
+          ref --;
+        }
+        const uint8_t * const matchLimit = end - LZ4_LAST_LITERALS;
+        const uint8_t * mp = ip + LZ4_MIN_MATCH;
+        const uint8_t * rp = ref + LZ4_MIN_MATCH;
+        while (mp < matchLimit && *mp == *rp) {
+          mp ++;
+          rp ++;
+        }
+        // emit the sequence
+        uint8_t * token = op++;
+        op = writeLiterals(op,anchor,(uint64_t)(ip - anchor),token);
+        const uint16_t offset = (uint16_t)(ip - ref);
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        const uint64_t mlen = (uint64_t)(mp - ip) - LZ4_MIN_MATCH;
+        if (mlen >= 15) {
+          *token |= 15;
+          op = writeLength(op,mlen - 15);
+        } else {
+          *token |= (uint8_t)mlen;
+        }
+        ip = mp;
+        anchor = ip;
+      }
+    }
+    // the last literals
+    uint8_t * token = op++;
+    op = writeLiterals(op,anchor,(uint64_t)(end - anchor),token);
+    return (uint64_t)(op - (uint8_t *)dst);
+  }
+
+  bool lz4Decompress(const void * src, uint64_t size, void * dst, uint64_t dsize)
+  noexcept(true) {
+    const uint8_t * ip = (const uint8_t *)src;
+    const uint8_t * const iend = ip + size;
+    uint8_t * op = (uint8_t *)dst;
+    uint8_t * const oend = op + dsize;
+
+    while (ip < iend) {
+      const uint8_t token = *ip++;
+      // literals
+      uint64_t len = token >> 4;
+      if (len == 15) {
+        uint8_t b;
+        do {
+          if (ip >= iend) {
+            return false;
+          }
+          b = *ip++;
+          len += b;
+        } while (b == 255);
+      }
+      if (len > (uint64_t)(iend - ip) || len > (uint64_t)(oend - op)) {
+        return false;
+      }
+      memcpy(op,ip,len);
+      ip += len;
+      op += len;
+      if (ip == iend) {
+        // the last sequence
+        break;
+      }
+      // match
+      if (iend - ip < 2) {
+        return false;
+      }
+      const uint64_t offset = ip[0] | ((uint64_t)ip[1] << 8);
+      ip += 2;
+      if (offset == 0 || offset > (uint64_t)(op - (uint8_t *)dst)) {
+        return false;
+      }
+      len = token & 15;
+      if (len == 15) {
+        uint8_t b;
+        do {
+          if (ip >= iend) {
+            return false;
+          }
+          b = *ip++;
+          len += b;
+        } while (b == 255);
+      }
+      len += LZ4_MIN_MATCH;
+      if (len > (uint64_t)(oend - op)) {
+        return false;
+      }
+      // the match may overlap the output: copy byte by byte.
+      const uint8_t * ref = op - offset;
+      if (offset >= len) {
+        memcpy(op,ref,len);
+        op += len;
+      } else {
+        while (len--) {
+          *op++ = *ref++;
+        }
+      }
+    }
+    return op == oend;
+  }
+}
@@ -0,0 +1,30 @@
+#ifndef COMPRESS_HPP
+#define COMPRESS_HPP
+#include <sys/types.h>
+#include <inttypes.h>
+
+namespace ns_persistent {
+
+  // the maximum size of the compressed data of size bytes
+  #define LZ4_COMPRESS_BOUND(size) ((size) + (size)/255 + 16)
+
+  // Compress a buffer in the LZ4 block format.
+  // @param src - the data
+  // @param size - length of the data
+  // @param dst - the buffer for the compressed data, which has at least
+  //        LZ4_COMPRESS_BOUND(size) bytes
+  // @return the length of the compressed data
+  uint64_t lz4Compress(const void * src, uint64_t size, void * dst) noexcept(true);
+
+  // Decompress a buffer in the LZ4 block format.
+  // @param src - the compressed data
+  // @param size - length of the compressed data
+  // @param dst - the buffer for the data
+  // @param dsize - length of the data
+  // @return true if the data is decompressed to exactly dsize bytes, false if
+  //         the compressed data is corrupted.
+  bool lz4Decompress(const void * src, uint64_t size, void * dst, uint64_t dsize)
+    noexcept(true);
+}
+
+#endif//COMPRESS_HPP
@@ -0,0 +1,70 @@
+#ifndef DELTA_SUPPORT_HPP
+#define DELTA_SUPPORT_HPP
+#include <sys/types.h>
+#include <inttypes.h>
+#include <type_traits>
+#include <utility>
+
+namespace ns_persistent {
+
+  // A type supports the delta mode of Persistent<T> with these members:
+  //   // size of the changes since the last delta
+  //   std::size_t delta_size();
+  //   // write the changes since the last delta to buf, or drop them if buf is
+  //   // nullptr, and start tracking the changes for the next delta.
+  //   void delta_since(char * buf);
+  //   // apply a delta written by delta_since() to the object.
+  //   void apply_delta(char const * const buf);
+  template <typename T, typename = void>
+  struct has_delta_support : std::false_type {};
+
+  template <typename T>
+  struct has_delta_support<T, decltype(
+    (void)std::declval<T&>().delta_size(),
+    (void)std::declval<T&>().delta_since((char *)nullptr),
+    (void)std::declval<T&>().apply_delta((char const *)nullptr))> : std::true_type {};
+
+  // calls to the delta members, which compile for all types. They are only
+  // called for the types with delta support.
+  template <typename T, bool supported = has_delta_support<T>::value>
+  struct DeltaOps {
+    static std::size_t size(T & obj) {
+      return obj.delta_size();
+    }
+    static void since(T & obj, char * buf) {
+      obj.delta_since(buf);
+    }
+    static void apply(T & obj, char const * const buf) {
+      obj.apply_delta(buf);
+    }
+  };
+
+  template <typename T>
+  struct DeltaOps<T,false> {
+    static std::size_t size(T &) {
+      return 0;
+    }
+    static void since(T &, char *) {
+    }
+    static void apply(T &, char const * const) {
+    }
+  };
+
+  // In delta mode, the data of a version in the log starts with a header
+  // telling if it is a full checkpoint or a delta on the previous version.
+  #define DELTA_KIND_CHECKPOINT (0)
+  #define DELTA_KIND_DELTA      (1)
+  typedef struct delta_header {
+    uint64_t kind;
+  } DeltaHeader;
+  #define DELTA_HEADER_SIZE     (sizeof(DeltaHeader))
+  #define DELTA_HEADER(pdat)    ((const DeltaHeader *)(pdat))
+  #define DELTA_PAYLOAD(pdat)   ((char const *)(pdat) + DELTA_HEADER_SIZE)
+
+  // the entry formats of the log of Persistent<T>, see
+  // PersistLog::getEntryFormat()
+  #define ENTRY_FORMAT_PLAIN    (0)
+  #define ENTRY_FORMAT_DELTA    (1)
+}
+
+#endif//DELTA_SUPPORT_HPP
@@ -0,0 +1,303 @@
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <algorithm>
+#include "util.hpp"
+#include "PersistException.hpp"
+#include "DirectWriter.hpp"
+
+namespace ns_persistent {
+
+  // the completions are polled this many times before waiting in the kernel
+  #define DIRECT_WRITER_SPIN    (4096)
+
+  static inline int ioUringSetup(uint32_t entries, struct io_uring_params * p) {
+    return (int)syscall(__NR_io_uring_setup,entries,p);
+  }
+
+  static inline int ioUringEnter(int fd, uint32_t toSubmit, uint32_t minComplete,
+    uint32_t flags) {
+    return (int)syscall(__NR_io_uring_enter,fd,toSubmit,minComplete,flags,NULL,0);
+  }
+
+  DirectWriter::DirectWriter(const uint32_t & depth) noexcept(true):
+    m_iRingFd(-1),
+    m_iDepth(depth),
+    m_pSqRing(MAP_FAILED),
+    m_iSqRingSize(0),
+    m_pCqRing(MAP_FAILED),
+    m_iCqRingSize(0),
+    m_pSqes(MAP_FAILED),
+    m_iSqesSize(0) {
+    if (!setupRing()) {
+      dbg_info("io_uring is not available, falling back to pwritev.");
+    }
+  }
+
+  DirectWriter::~DirectWriter() noexcept(true) {
+    closeRing();
+  }
+
+  void DirectWriter::closeRing() noexcept(true) {
+    if (this->m_pSqes != MAP_FAILED) {
+      munmap(this->m_pSqes,this->m_iSqesSize);
+    }
+    if (this->m_pCqRing != MAP_FAILED && this->m_pCqRing != this->m_pSqRing) {
+      munmap(this->m_pCqRing,this->m_iCqRingSize);
+    }
+    if (this->m_pSqRing != MAP_FAILED) {
+      munmap(this->m_pSqRing,this->m_iSqRingSize);
+    }
+    if (this->m_iRingFd != -1) {
+      close(this->m_iRingFd);
+    }
+    this->m_pSqes = this->m_pCqRing = this->m_pSqRing = MAP_FAILED;
+    this->m_iRingFd = -1;
+  }
+
+  bool DirectWriter::setupRing() noexcept(true) {
+    struct io_uring_params p;
+    memset(&p,0,sizeof(p));
+    int fd = ioUringSetup(this->m_iDepth,&p);
+    if (fd < 0) {
+      return false;
+    }
+    this->m_iSqRingSize = p.sq_off.array + p.sq_entries*sizeof(uint32_t);
+    this->m_iCqRingSize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      this->m_iSqRingSize = this->m_iCqRingSize =
+        MAX(this->m_iSqRingSize,this->m_iCqRingSize);
+    }
+    this->m_pSqRing = mmap(NULL,this->m_iSqRingSize,PROT_READ|PROT_WRITE,
+      MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+    if (this->m_pSqRing == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      this->m_pCqRing = this->m_pSqRing;
+    } else {
+      this->m_pCqRing = mmap(NULL,this->m_iCqRingSize,PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+    }
+    this->m_iSqesSize = p.sq_entries*sizeof(struct io_uring_sqe);
+    if (this->m_pCqRing != MAP_FAILED) {
+      this->m_pSqes = mmap(NULL,this->m_iSqesSize,PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+    }
+    if (this->m_pCqRing == MAP_FAILED || this->m_pSqes == MAP_FAILED) {
+      if (this->m_pCqRing != MAP_FAILED && this->m_pCqRing != this->m_pSqRing) {
+        munmap(this->m_pCqRing,this->m_iCqRingSize);
+      }
+      munmap(this->m_pSqRing,this->m_iSqRingSize);
+      this->m_pSqRing = this->m_pCqRing = MAP_FAILED;
+      close(fd);
+      return false;
+    }
+    uint8_t * sq = (uint8_t *)this->m_pSqRing;
+    uint8_t * cq = (uint8_t *)this->m_pCqRing;
+    this->m_pSqHead = (uint32_t *)(sq + p.sq_off.head);
+    this->m_pSqTail = (uint32_t *)(sq + p.sq_off.tail);
+    this->m_iSqMask = *(uint32_t *)(sq + p.sq_off.ring_mask);
+    this->m_pSqArray = (uint32_t *)(sq + p.sq_off.array);
+    this->m_pCqHead = (uint32_t *)(cq + p.cq_off.head);
+    this->m_pCqTail = (uint32_t *)(cq + p.cq_off.tail);
+    this->m_iCqMask = *(uint32_t *)(cq + p.cq_off.ring_mask);
+    this->m_pCqes = (void *)(cq + p.cq_off.cqes);
+    this->m_iDepth = p.sq_entries;
+    this->m_iRingFd = fd;
+    return true;
+  }
+
+  void DirectWriter::write(const int & fd, const void * buf, const uint64_t & len,
+    const uint64_t & ofst) noexcept(true) {
+    this->m_writes.push_back(Request{fd,{(void *)buf,(size_t)len},ofst});
+  }
+
+  void DirectWriter::sync(const int & fd) noexcept(true) {
+    if (std::find(this->m_syncs.begin(),this->m_syncs.end(),fd) == this->m_syncs.end()) {
+      this->m_syncs.push_back(fd);
+    }
+  }
+
+  void DirectWriter::wait() noexcept(false) {
+    try {
+      bool bSync = (this->m_iRingFd == -1);
+      if (!bSync) {
+        try {
+          // the writes go in batches of the ring depth, and the
+          // synchronizations after all of them.
+          for (std::size_t i = 0; i < this->m_writes.size(); i += this->m_iDepth) {
+            submitRing(true,i,MIN(i + this->m_iDepth,this->m_writes.size()));
+          }
+          if (!this->m_syncs.empty()) {
+            submitRing(false,0,this->m_syncs.size());
+          }
+        } catch (...) {
+          if (this->m_iRingFd != -1) {
+            throw;
+          }
+          // the io_uring is closed with requests in it. The batch is written
+          // again, which rewrites the same data.
+          dbg_warn("io_uring failed, falling back to pwritev.");
+          bSync = true;
+        }
+      }
+      if (bSync) {
+        submitSync();
+      }
+    } catch (...) {
+      this->m_writes.clear();
+      this->m_syncs.clear();
+      throw;
+    }
+    this->m_writes.clear();
+    this->m_syncs.clear();
+  }
+
+  void DirectWriter::submitRing(const bool & writes, const std::size_t & from,
+    const std::size_t & to) noexcept(false) {
+    struct io_uring_sqe * sqes = (struct io_uring_sqe *)this->m_pSqes;
+    struct io_uring_cqe * cqes = (struct io_uring_cqe *)this->m_pCqes;
+    // STEP 1: fill the submission queue
+    uint32_t tail = *this->m_pSqTail;
+    for (std::size_t i = from; i < to; i++) {
+      const uint32_t slot = tail & this->m_iSqMask;
+      struct io_uring_sqe * sqe = &sqes[slot];
+      memset(sqe,0,sizeof(*sqe));
+      if (writes) {
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = this->m_writes[i].fd;
+        sqe->addr = (uint64_t)&this->m_writes[i].iov;
+        sqe->len = 1;
+        sqe->off = this->m_writes[i].ofst;
+      } else {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = this->m_syncs[i];
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+      }
+      sqe->user_data = (uint64_t)i;
+      this->m_pSqArray[slot] = slot;
+      tail ++;
+    }
+    __atomic_store_n(this->m_pSqTail,tail,__ATOMIC_RELEASE);
+    // STEP 2: submit
+    uint32_t toSubmit = (uint32_t)(to - from);
+    while (toSubmit > 0) {
+      int ret = ioUringEnter(this->m_iRingFd,toSubmit,0,0);
+      if (ret < 0) {
+        if (errno == EINTR || errno == EAGAIN) {
+          continue;
+        }
+        // the requests queued or in flight would be mixed up with the next
+        // batch.
+        const int err = errno;
+        closeRing();
+        throw PERSIST_EXP_WRITE_FILE(err);
+      }
+      toSubmit -= (uint32_t)ret;
+    }
+    // STEP 3: poll for the completions, and wait in the kernel if they do
+    // not come soon.
+    int err = 0;
+    std::vector<std::size_t> shortWrites;
+    uint32_t pending = (uint32_t)(to - from);
+    uint32_t spin = 0;
+    while (pending > 0) {
+      uint32_t head = *this->m_pCqHead;
+      const uint32_t ctail = __atomic_load_n(this->m_pCqTail,__ATOMIC_ACQUIRE);
+      if (head == ctail) {
+        if (++spin < DIRECT_WRITER_SPIN) {
+          continue;
+        }
+        if (ioUringEnter(this->m_iRingFd,0,pending,IORING_ENTER_GETEVENTS) < 0 &&
+            errno != EINTR) {
+          // the pending completions would come in the next batch.
+          const int err = errno;
+          closeRing();
+          throw PERSIST_EXP_WRITE_FILE(err);
+        }
+        continue;
+      }
+      for (; head != ctail; head++, pending--) {
+        const struct io_uring_cqe * cqe = &cqes[head & this->m_iCqMask];
+        if (cqe->res < 0) {
+          err = -cqe->res;
+        } else if (writes && (uint64_t)cqe->res < this->m_writes[cqe->user_data].iov.iov_len) {
+          this->m_writes[cqe->user_data].iov.iov_base =
+            (uint8_t *)this->m_writes[cqe->user_data].iov.iov_base + cqe->res;
+          this->m_writes[cqe->user_data].iov.iov_len -= cqe->res;
+          this->m_writes[cqe->user_data].ofst += cqe->res;
+          shortWrites.push_back(cqe->user_data);
+        }
+      }
+      __atomic_store_n(this->m_pCqHead,head,__ATOMIC_RELEASE);
+    }
+    if (err != 0) {
+      throw PERSIST_EXP_WRITE_FILE(err);
+    }
+    // finish the short writes in place.
+    for (auto i : shortWrites) {
+      const Request & req = this->m_writes[i];
+      uint64_t done = 0;
+      while (done < req.iov.iov_len) {
+        ssize_t ret = pwrite(req.fd,(uint8_t *)req.iov.iov_base + done,
+          req.iov.iov_len - done,req.ofst + done);
+        if (ret <= 0) {
+          throw PERSIST_EXP_WRITE_FILE(ret < 0 ? errno : EIO);
+        }
+        done += ret;
+      }
+    }
+  }
+
+  void DirectWriter::submitSync() noexcept(false) {
+    // adjacent writes to the same file go in one pwritev().
+    std::size_t i = 0;
+    while (i < this->m_writes.size()) {
+      std::size_t j = i + 1;
+      while (j < this->m_writes.size() && j - i < IOV_MAX &&
+             this->m_writes[j].fd == this->m_writes[i].fd &&
+             this->m_writes[j].ofst == this->m_writes[j-1].ofst + this->m_writes[j-1].iov.iov_len) {
+        j++;
+      }
+      std::vector<struct iovec> iovs;
+      uint64_t len = 0;
+      for (std::size_t k = i; k < j; k++) {
+        iovs.push_back(this->m_writes[k].iov);
+        len += this->m_writes[k].iov.iov_len;
+      }
+      uint64_t done = 0;
+      while (done < len) {
+        ssize_t ret = pwritev(this->m_writes[i].fd,iovs.data(),(int)iovs.size(),
+          this->m_writes[i].ofst + done);
+        if (ret < 0 && errno == EINTR) {
+          continue;
+        }
+        if (ret <= 0) {
+          throw PERSIST_EXP_WRITE_FILE(ret < 0 ? errno : EIO);
+        }
+        done += ret;
+        // skip what is written
+        uint64_t skip = ret;
+        while (!iovs.empty() && skip >= iovs.front().iov_len) {
+          skip -= iovs.front().iov_len;
+          iovs.erase(iovs.begin());
+        }
+        if (!iovs.empty()) {
+          iovs.front().iov_base = (uint8_t *)iovs.front().iov_base + skip;
+          iovs.front().iov_len -= skip;
+        }
+      }
+      i = j;
+    }
+    for (auto fd : this->m_syncs) {
+      if (fdatasync(fd) != 0) {
+        throw PERSIST_EXP_WRITE_FILE(errno);
+      }
+    }
+  }
+}
@@ -0,0 +1,90 @@
+#ifndef DIRECT_WRITER_HPP
+#define DIRECT_WRITER_HPP
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <vector>
+
+namespace ns_persistent {
+
+  // the default number of requests in flight
+  #define DEFAULT_DIRECT_WRITER_DEPTH   (64)
+
+  // DirectWriter writes buffers to files in batches. A batch of writes is
+  // queued by write() and sync(), and submitted at once by wait(), which
+  // polls for the completions. It uses io_uring if the kernel supports it, or
+  // pwritev() and fdatasync() otherwise. For O_DIRECT files, the buffers,
+  // lengths and offsets must be aligned to pages.
+  // DirectWriter is not thread-safe.
+  class DirectWriter {
+  private:
+    // a queued write
+    typedef struct request {
+      int fd;
+      struct iovec iov;
+      uint64_t ofst;
+    } Request;
+
+    // the writes and the files to synchronize in this batch
+    std::vector<Request> m_writes;
+    std::vector<int> m_syncs;
+    // the io_uring, m_iRingFd is -1 if it is not used
+    int m_iRingFd;
+    uint32_t m_iDepth;
+    void * m_pSqRing;
+    uint64_t m_iSqRingSize;
+    void * m_pCqRing;
+    uint64_t m_iCqRingSize;
+    void * m_pSqes;
+    uint64_t m_iSqesSize;
+    // the pointers into the io_uring
+    uint32_t * m_pSqHead;
+    uint32_t * m_pSqTail;
+    uint32_t m_iSqMask;
+    uint32_t * m_pSqArray;
+    uint32_t * m_pCqHead;
+    uint32_t * m_pCqTail;
+    uint32_t m_iCqMask;
+    void * m_pCqes;
+
+    // setup the io_uring. Returns false if it is not supported.
+    bool setupRing() noexcept(true);
+
+    // close the io_uring, which drops the requests in it. The writes go
+    // through pwritev() from then on.
+    void closeRing() noexcept(true);
+
+    // submit writes [from,to) of m_writes, or the synchronizations of
+    // m_syncs if writes is false, through the io_uring and poll for the
+    // completions. If the io_uring fails, it is closed before the exception
+    // is thrown, so no request is left in it.
+    void submitRing(const bool & writes, const std::size_t & from,
+      const std::size_t & to) noexcept(false);
+
+    // the same with pwritev() and fdatasync()
+    void submitSync() noexcept(false);
+
+  public:
+    DirectWriter(const uint32_t & depth = DEFAULT_DIRECT_WRITER_DEPTH) noexcept(true);
+    virtual ~DirectWriter() noexcept(true);
+
+    // queue a write of len bytes at buf to fd at ofst
+    void write(const int & fd, const void * buf, const uint64_t & len,
+      const uint64_t & ofst) noexcept(true);
+
+    // queue a synchronization of the data of fd after the writes
+    void sync(const int & fd) noexcept(true);
+
+    // submit the queued requests and wait till they are completed. Throws
+    // PERSIST_EXP_WRITE_FILE on failure, after all the requests are done.
+    void wait() noexcept(false);
+
+    // if the io_uring is used
+    bool isAsync() const noexcept(true) {
+      return (this->m_iRingFd != -1);
+    }
+  };
+}
+
+#endif//DIRECT_WRITER_HPP
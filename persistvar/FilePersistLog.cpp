@@ -2,11 +2,15 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <unistd.h>
+#include <sched.h>
+#include <time.h>
 #include <string.h>
 #include <iostream>
 #include <string>
 #include "util.hpp"
+#include "CRC32C.hpp"
 #include "FilePersistLog.hpp"
 
 using namespace std;
@@ -17,29 +21,84 @@ namespace ns_persistent{
   // internal structures //
   /////////////////////////
 
-  // verify the existence of the meta file
-  static bool checkOrCreateMetaFile(const string & metaFile) noexcept(false);
+  // verify the existence of the meta file. An existing file keeps its
+  // format, which is returned in format. Otherwise, it is created in format.
+  static bool checkOrCreateMetaFile(const string & metaFile, MetaFormat & format) noexcept(false);
 
-  // verify the existence of the log file
-  static bool checkOrCreateLogFile(const string & logFile) noexcept(false);
+  // verify the existence of a ring buffer file. An existing file keeps its
+  // size, which is returned in size. Otherwise, it is created with size.
+  static bool checkOrCreateRingFile(const string & file, uint64_t & size) noexcept(false);
 
-  // verify the existence of the data file
-  static bool checkOrCreateDataFile(const string & dataFile) noexcept(false);
+  // map a ring buffer file to memory. With pmem, the file is mapped by
+  // pmemMap(), and dax is cleared if it is not on DAX.
+  static void * mapRingBuffer(const int & fd, const uint64_t & size,
+    const bool & pmem = false, bool * dax = nullptr) noexcept(false);
+
+  // open a ring buffer file for direct I/O. It falls back to buffered I/O if
+  // the file system does not support O_DIRECT.
+  static int openDirectFile(const string & file, const int & flags) noexcept(false);
+
+  // map an anonymous ring buffer to memory, and read a ring buffer file to it
+  // if fd is not -1. For the direct I/O mode. With huge, the memory is backed
+  // by transparent huge pages if possible.
+  static void * loadRingBuffer(const int & fd, const uint64_t & size,
+    const bool & huge = false) noexcept(false);
+
+  // remove the segment files of a log out of [first,last]
+  static void removeStaleSegments(const string & file, const int64_t & first,
+    const int64_t & last) noexcept(false);
+
+  // align the sizes in a log configuration to pages
+  static PersistLogConfig alignConfig(const PersistLogConfig & config) noexcept(true);
+
+  // the monotonic clock in nanoseconds
+  static uint64_t nowNs() noexcept(true);
 
   ////////////////////////
   // visible to outside //
   ////////////////////////
 
-  FilePersistLog::FilePersistLog(const string &name, const string &dataPath) 
+  FilePersistLog::FilePersistLog(const string &name, const string &dataPath,
+    const PersistLogConfig &config)
   noexcept(false) : PersistLog(name),
+    m_oConfig(alignConfig(config)),
+    m_metaFormat((m_oConfig.pmem && !m_oConfig.direct_io)? MF_PMEM : m_oConfig.meta_format),
+    m_pMeta(MAP_FAILED),
+    m_iMetaSeqno(0),
     m_sDataPath(dataPath),
     m_sMetaFile(dataPath + "/" + name + "." + META_FILE_SUFFIX),
     m_sLogFile(dataPath + "/" + name + "." + LOG_FILE_SUFFIX),
     m_sDataFile(dataPath + "/" + name + "." + DATA_FILE_SUFFIX),
     m_iLogFileDesc(-1),
     m_iDataFileDesc(-1),
-    m_pLog(MAP_FAILED),
-    m_pData(MAP_FAILED) {
+    m_pLogRing(nullptr),
+    m_pDataRing(nullptr),
+    m_bGrowing(false),
+    m_iFirstLogSeg(0),
+    m_iFirstDataSeg(0),
+    m_bNewSegments(false),
+    m_bGcThread(false),
+    m_iGcTicket(0),
+    m_iGcDone(0),
+    m_iGcFailed(0),
+    m_gcVer(INVALID_VERSION),
+    m_bGcStop(false),
+    m_pVerIndex(nullptr),
+    m_pVerColumn(nullptr),
+    m_pHlcColumn(nullptr),
+    m_bReserved(false),
+    m_iReservedOfst(0),
+    m_iReservedSize(0),
+    m_bSingleWriter(false),
+    m_pDirectWriter(nullptr),
+    m_bPmem(m_oConfig.pmem && !m_oConfig.direct_io),
+    m_bDax(true),
+    m_oRecoveryStats(),
+    m_oStartupStats(),
+    m_iStartNs(nowNs()),
+    m_bFirstRead(false),
+    m_bPfThread(false),
+    m_bPfStop(false) {
 #ifdef _DEBUG
     spdlog::set_level(spdlog::level::trace);
 #endif
@@ -52,6 +111,135 @@ namespace ns_persistent{
     dbg_trace("{0} constructor: before load()",name);
     load();
     dbg_trace("{0} constructor: after load()",name);
+    if (this->m_oConfig.single_writer) {
+      if (IS_SEGMENTED) {
+        dbg_warn("{0}:single-writer mode is ignored by a segmented log.",name);
+      } else {
+        this->m_bSingleWriter = true;
+      }
+    }
+    if (this->m_oConfig.direct_io && IS_SEGMENTED) {
+      dbg_warn("{0}:direct I/O is ignored by a segmented log.",name);
+    }
+    if (this->m_oConfig.pmem && this->m_oConfig.direct_io) {
+      dbg_warn("{0}:persistent memory is ignored with direct I/O.",name);
+    }
+    if (this->m_bPmem) {
+      dbg_info("{0}:persistent memory mode, flush={1}, dax={2}.",name,
+        getPmemFlushKernel(),this->m_bDax);
+      if (!this->m_bDax) {
+        dbg_warn("{0}:the files are not on a DAX file system. The persistent memory is emulated by the page cache, which does not survive a power failure.",name);
+      }
+    }
+    if (this->m_oConfig.version_index) {
+      this->m_pVerIndex = new VersionIndex();
+    }
+    if (this->m_oConfig.packed_keys) {
+      this->m_pVerColumn = new KeyColumn<__int128>(this->m_oConfig.log_entries);
+      this->m_pHlcColumn = new KeyColumn<unsigned __int128>(this->m_oConfig.log_entries);
+    }
+    for (int64_t idx = META_HEADER->fields.head; idx < META_HEADER->fields.tail; idx ++) {
+      indexEntry(idx);
+    }
+    if (this->m_pVerIndex != nullptr) {
+      dbg_trace("{0}:version index built with {1} runs.",name,this->m_pVerIndex->getNumOfRuns());
+    }
+    if (this->m_oConfig.group_commit) {
+      pthread_condattr_t attr;
+      pthread_condattr_init(&attr);
+      pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+      if (pthread_mutex_init(&this->m_gclock,NULL) != 0 ||
+          pthread_cond_init(&this->m_gcReqCond,&attr) != 0 ||
+          pthread_cond_init(&this->m_gcDoneCond,NULL) != 0) {
+        throw PERSIST_EXP_COND_INIT(errno);
+      }
+      pthread_condattr_destroy(&attr);
+      int err = pthread_create(&this->m_gcThread,NULL,groupCommitThread,(void*)this);
+      if (err != 0) {
+        throw PERSIST_EXP_CREATE_THREAD(err);
+      }
+      this->m_bGcThread = true;
+    }
+    this->m_oStartupStats.load_us = (nowNs() - this->m_iStartNs)/1000;
+    if (this->m_oConfig.startup == SM_PREFAULT) {
+      if (this->m_pDirectWriter != nullptr) {
+        // the direct I/O mode has read the whole log to memory.
+        this->m_oStartupStats.full_speed_us = this->m_oStartupStats.load_us;
+      } else {
+        int err = pthread_create(&this->m_pfThread,NULL,prefaultThread,(void*)this);
+        if (err != 0) {
+          throw PERSIST_EXP_CREATE_THREAD(err);
+        }
+        this->m_bPfThread = true;
+      }
+    } else if (this->m_oConfig.startup == SM_HUGEPAGE && this->m_pDirectWriter == nullptr) {
+      dbg_info("{0}:huge pages are not used by the mapped files.",name);
+    }
+    dbg_trace("{0}:loaded in {1}us.",name,this->m_oStartupStats.load_us);
+  }
+
+  void * FilePersistLog::prefaultThread(void * arg) noexcept(true) {
+    FilePersistLog * plog = (FilePersistLog *)arg;
+    try {
+      plog->prefault();
+    } catch (uint64_t e) {
+      dbg_warn("{0}:prefault failed with exception 0x{1:x}.",plog->m_sName,e);
+    }
+    plog->m_oStartupStats.full_speed_us = (nowNs() - plog->m_iStartNs)/1000;
+    dbg_info("{0}:{1} bytes prefaulted in {2}us after the start.",plog->m_sName,
+      plog->m_oStartupStats.prefault_bytes,plog->m_oStartupStats.full_speed_us);
+    return NULL;
+  }
+
+  void FilePersistLog::prefault() noexcept(false) {
+    const uint64_t window = this->m_oConfig.prefault_window;
+    uint64_t & bytes = this->m_oStartupStats.prefault_bytes;
+    FPL_RDLOCK;
+    int64_t idx = CURR_LOG_IDX;
+    // STEP 1: start the read-ahead of the data window of a ring buffer.
+    if (!IS_SEGMENTED && idx != -1) {
+      const uint64_t len = MIN(MIN(window,MAX_DATA_SIZE),NUM_USED_BYTES);
+      const uint64_t end = (uint64_t)DATA_AT(NEXT_DATA_OFST - 1) + 1;
+      madvise(ALIGN_TO_PAGE(end - len),len + (end - len)%PAGE_SIZE,MADV_WILLNEED);
+    }
+    // STEP 2: touch the page of each entry and the pages of its data, from
+    // the latest one backwards, PREFAULT_CHUNK entries at a time.
+    while (true) {
+      try {
+        const int64_t low = MAX(META_HEADER->fields.head,idx - PREFAULT_CHUNK + 1);
+        for (; idx >= low && bytes < window; idx --) {
+          const LogEntry * ple = LOG_ENTRY_AT(idx);
+          const uint64_t dlen = ple->fields.dlen;
+          const uint8_t * pdat = (const uint8_t *)LOG_ENTRY_DATA(ple);
+          for (uint64_t i = 0; i < dlen; i += PAGE_SIZE) {
+            (void)*(volatile const uint8_t *)(pdat + i);
+          }
+          if (dlen > 0) {
+            (void)*(volatile const uint8_t *)(pdat + dlen - 1);
+          }
+          bytes += sizeof(LogEntry) + dlen;
+        }
+      } catch (uint64_t e) {
+        FPL_UNLOCK;
+        throw e;
+      }
+      FPL_UNLOCK;
+      if (idx < 0 || bytes >= window || __atomic_load_n(&this->m_bPfStop,__ATOMIC_RELAXED)) {
+        return;
+      }
+      // let the writers in between the chunks.
+      FPL_RDLOCK;
+      if (idx < META_HEADER->fields.head) {
+        FPL_UNLOCK;
+        return;
+      }
+    }
+  }
+
+  void FilePersistLog::recordFirstRead() noexcept(true) {
+    if (!__atomic_exchange_n(&this->m_bFirstRead,true,__ATOMIC_RELAXED)) {
+      this->m_oStartupStats.first_read_us = (nowNs() - this->m_iStartNs)/1000;
+    }
   }
 
   void FilePersistLog::load()
@@ -60,56 +248,30 @@ namespace ns_persistent{
     // STEP 0: check if data path exists
     checkOrCreateDir(this->m_sDataPath);
     dbg_trace("{0}:checkOrCreateDir passed.",this->m_sName);
-    // STEP 1: check and create files.
-    bool bCreate = checkOrCreateMetaFile(this->m_sMetaFile);
-    checkOrCreateLogFile(this->m_sLogFile);
-    checkOrCreateDataFile(this->m_sDataFile);
-    dbg_trace("{0}:checkOrCreateDataFile passed.",this->m_sName);
-    // STEP 2: open files
-    this->m_iLogFileDesc = open(this->m_sLogFile.c_str(),O_RDWR);
-    if (this->m_iLogFileDesc == -1) {
-      throw PERSIST_EXP_OPEN_FILE(errno);
-    }
-    this->m_iDataFileDesc = open(this->m_sDataFile.c_str(),O_RDWR);
-    if (this->m_iDataFileDesc == -1) {
-      throw PERSIST_EXP_OPEN_FILE(errno);
-    }
-    // STEP 3: mmap to memory
-    //// we map the log entry and data twice to faciliate the search and data
-    //// retrieving then the data is rewinding across the buffer end as follow:
-    //// [1][2][3][4][5][6][1][2][3][4][5][6]
-    this->m_pLog = mmap(NULL,MAX_LOG_SIZE<<1,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
-    if(this->m_pLog == MAP_FAILED) {
-      dbg_trace("{0}:reserve map space for log failed.", this->m_sName);
-      throw PERSIST_EXP_MMAP_FILE(errno);
-    }
-    if(mmap(this->m_pLog,MAX_LOG_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,this->m_iLogFileDesc,0) == MAP_FAILED) {
-      dbg_trace("{0}:map ringbuffer space for the first half of log failed. Is the size of log ringbuffer aligned to page?", this->m_sName);
-      throw PERSIST_EXP_MMAP_FILE(errno);
-    }
-    if(mmap((void*)((uint64_t)this->m_pLog+MAX_LOG_SIZE),MAX_LOG_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,this->m_iLogFileDesc,0) == MAP_FAILED) {
-      dbg_trace("{0}:map ringbuffer space for the second half of log failed. Is the size of log ringbuffer aligned to page?", this->m_sName);
-      throw PERSIST_EXP_MMAP_FILE(errno);
-    }
-    //// data ringbuffer
-    this->m_pData = mmap(NULL,MAX_DATA_SIZE<<1,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
-    if (this->m_pData == MAP_FAILED) {
-      dbg_trace("{0}:reserve map space for data failed.", this->m_sName);
-      throw PERSIST_EXP_MMAP_FILE(errno);
-    }
-    if(mmap(this->m_pData,MAX_DATA_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,this->m_iDataFileDesc,0) == MAP_FAILED) {
-      dbg_trace("{0}:map ringbuffer space for the first half of data failed. Is the size of data ringbuffer aligned to page?", this->m_sName);
-      throw PERSIST_EXP_MMAP_FILE(errno);
-    }
-    if(mmap((void*)((uint64_t)this->m_pData + MAX_DATA_SIZE),MAX_DATA_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,this->m_iDataFileDesc,0) == MAP_FAILED) {
-      dbg_trace("{0}:map ringbuffer space for the second half of data failed. Is the size of data ringbuffer aligned to page?", this->m_sName);
-      throw PERSIST_EXP_MMAP_FILE(errno);
+    // STEP 1: check and create the meta file.
+    bool bCreate = checkOrCreateMetaFile(this->m_sMetaFile,this->m_metaFormat);
+    if (this->m_metaFormat == MF_DUAL_SLOT) {
+      mapMetaFile();
+      // no slot has been written if we crashed right after creating the file.
+      if (META_SLOT_AT(0)->fields.magic == 0 && META_SLOT_AT(1)->fields.magic == 0) {
+        bCreate = true;
+      }
+    } else if (this->m_metaFormat == MF_PMEM) {
+      mapMetaFile();
+      // the magic is written after the rest of the slot.
+      if (META_SLOT_AT(0)->fields.magic != META_SLOT_MAGIC) {
+        bCreate = true;
+      }
     }
-    dbg_trace("{0}:data/meta file mapped to memory",this->m_sName);
-    // STEP 4: initialize the header for new created Metafile
+    // STEP 2: initialize the header for new created Metafile
     if (bCreate) {
+      bzero((void*)META_HEADER,sizeof(MetaHeader));
+      bzero((void*)META_HEADER_PERS,sizeof(MetaHeader));
       META_HEADER->fields.head = 0ll;
       META_HEADER->fields.tail = 0ll;
+      META_HEADER->fields.layout = this->m_oConfig.layout;
+      META_HEADER->fields.seg_entries = this->m_oConfig.segment_log_entries;
+      META_HEADER->fields.seg_size = this->m_oConfig.segment_data_size;
       META_HEADER_PERS->fields.head = -1ll; // -1 means uninitialized
       META_HEADER_PERS->fields.tail = -1ll; // -1 means uninitialized
       // persist the header
@@ -117,7 +279,7 @@ namespace ns_persistent{
       FPL_PERS_LOCK;
 
       try {
-        persistMetaHeaderAtomically();
+        persistMetaHeaderAtomically(*META_HEADER);
       } catch (uint64_t e) {
         FPL_PERS_UNLOCK;
         FPL_UNLOCK;
@@ -130,16 +292,22 @@ namespace ns_persistent{
       FPL_WRLOCK;
       FPL_PERS_LOCK;
       try {
-        int fd = open(this->m_sMetaFile.c_str(), O_RDONLY);
-        if (fd == -1) {
-          throw PERSIST_EXP_OPEN_FILE(errno);
-        }
-        ssize_t nRead = read(fd, (void*)META_HEADER_PERS, sizeof(MetaHeader));
-        if(nRead != sizeof(MetaHeader)) {
+        if (this->m_metaFormat == MF_DUAL_SLOT) {
+          loadMetaSlot();
+        } else if (this->m_metaFormat == MF_PMEM) {
+          *META_HEADER_PERS = META_SLOT_AT(0)->fields.header;
+        } else {
+          int fd = open(this->m_sMetaFile.c_str(), O_RDONLY);
+          if (fd == -1) {
+            throw PERSIST_EXP_OPEN_FILE(errno);
+          }
+          ssize_t nRead = read(fd, (void*)META_HEADER_PERS, sizeof(MetaHeader));
+          if(nRead != sizeof(MetaHeader)) {
+            close(fd);
+            throw PERSIST_EXP_READ_FILE(errno);
+          }
           close(fd);
-          throw PERSIST_EXP_READ_FILE(errno);
         }
-        close(fd);
         *META_HEADER = *META_HEADER_PERS;
       } catch (uint64_t e) {
         FPL_PERS_UNLOCK;
@@ -150,6 +318,51 @@ namespace ns_persistent{
       FPL_PERS_UNLOCK;
       FPL_UNLOCK;
     }
+    // STEP 3: load the log entries and data.
+    if (IS_SEGMENTED) {
+      loadSegments();
+      dbg_trace("{0}:segments loaded: log segments={1}, data segments={2}.",
+        this->m_sName,this->m_logSegs.size(),this->m_dataSegs.size());
+    } else {
+      //// check and create files.
+      uint64_t logSize = this->m_oConfig.log_entries*sizeof(LogEntry);
+      uint64_t dataSize = this->m_oConfig.data_size;
+      checkOrCreateRingFile(this->m_sLogFile,logSize);
+      checkOrCreateRingFile(this->m_sDataFile,dataSize);
+      dbg_trace("{0}:checkOrCreateDataFile passed: log entries={1}, data size={2}.",
+        this->m_sName,logSize/sizeof(LogEntry),dataSize);
+      if (this->m_oConfig.direct_io) {
+        //// read the files to anonymous memory
+        this->m_pDirectWriter = new DirectWriter();
+        this->m_iLogFileDesc = openDirectFile(this->m_sLogFile,O_RDWR);
+        this->m_iDataFileDesc = openDirectFile(this->m_sDataFile,O_RDWR);
+        const bool huge = (this->m_oConfig.startup == SM_HUGEPAGE);
+        this->m_pLogRing = new RingBuffer{loadRingBuffer(this->m_iLogFileDesc,logSize,huge),logSize};
+        this->m_pDataRing = new RingBuffer{loadRingBuffer(this->m_iDataFileDesc,dataSize,huge),dataSize};
+        dbg_trace("{0}:data/meta file loaded to memory, io_uring={1}",this->m_sName,
+          this->m_pDirectWriter->isAsync());
+      } else {
+        //// open files
+        this->m_iLogFileDesc = open(this->m_sLogFile.c_str(),O_RDWR);
+        if (this->m_iLogFileDesc == -1) {
+          throw PERSIST_EXP_OPEN_FILE(errno);
+        }
+        this->m_iDataFileDesc = open(this->m_sDataFile.c_str(),O_RDWR);
+        if (this->m_iDataFileDesc == -1) {
+          throw PERSIST_EXP_OPEN_FILE(errno);
+        }
+        //// mmap to memory
+        this->m_pLogRing = new RingBuffer{mapRingBuffer(this->m_iLogFileDesc,logSize,
+          this->m_bPmem,&this->m_bDax),logSize};
+        this->m_pDataRing = new RingBuffer{mapRingBuffer(this->m_iDataFileDesc,dataSize,
+          this->m_bPmem,&this->m_bDax),dataSize};
+        dbg_trace("{0}:data/meta file mapped to memory",this->m_sName);
+      }
+    }
+    // STEP 4: verify the entries left by a crash.
+    if (this->m_oConfig.recovery_threads > 0) {
+      recover();
+    }
     // STEP 5: update m_hlcLE with the latest event: we don't need this anymore
     //if (META_HEADER->fields.eno >0) {
     //  if (this->m_hlcLE.m_rtc_us < CURR_LOG_ENTRY->fields.hlc_r &&
@@ -163,101 +376,394 @@ namespace ns_persistent{
 
   FilePersistLog::~FilePersistLog()
   noexcept(true){
+    if (this->m_bPfThread) {
+      __atomic_store_n(&this->m_bPfStop,true,__ATOMIC_RELAXED);
+      pthread_join(this->m_pfThread,NULL);
+    }
+    if (this->m_bGcThread) {
+      // the flusher quits after serving the pending tickets.
+      pthread_mutex_lock(&this->m_gclock);
+      this->m_bGcStop = true;
+      pthread_cond_signal(&this->m_gcReqCond);
+      pthread_mutex_unlock(&this->m_gclock);
+      pthread_join(this->m_gcThread,NULL);
+      pthread_cond_destroy(&this->m_gcReqCond);
+      pthread_cond_destroy(&this->m_gcDoneCond);
+      pthread_mutex_destroy(&this->m_gclock);
+    }
     pthread_rwlock_destroy(&this->m_rwlock);
     pthread_mutex_destroy(&this->m_perslock);
-    if (this->m_pData != MAP_FAILED){
-      munmap(m_pData,MAX_DATA_SIZE<<1);
+    if (this->m_pVerIndex != nullptr) {
+      delete this->m_pVerIndex;
+    }
+    if (this->m_pVerColumn != nullptr) {
+      delete this->m_pVerColumn;
+      delete this->m_pHlcColumn;
     }
-    this->m_pData = nullptr; // prevent ~MemLog() destructor to release it again.
-    if (this->m_pLog != MAP_FAILED){
-      munmap(m_pLog,MAX_LOG_SIZE);
+    if (this->m_pDataRing != nullptr){
+      this->m_retiredRings.push_back(this->m_pDataRing);
+    }
+    this->m_pDataRing = nullptr; // prevent ~MemLog() destructor to release it again.
+    if (this->m_pLogRing != nullptr){
+      this->m_retiredRings.push_back(this->m_pLogRing);
+    }
+    this->m_pLogRing = nullptr; // prevent ~MemLog() destructor to release it again.
+    for (auto ring : this->m_retiredRings) {
+      munmap(ring->addr,ring->size<<1);
+      delete ring;
+    }
+    if (this->m_pMeta != MAP_FAILED) {
+      munmap(this->m_pMeta,META_FILE_SIZE(this->m_metaFormat));
+    }
+    for (auto & seg : this->m_logSegs) {
+      if (seg.addr != nullptr) {
+        munmap(seg.addr,seg.size);
+      }
+    }
+    for (auto & seg : this->m_dataSegs) {
+      if (seg.addr != nullptr) {
+        munmap(seg.addr,seg.size);
+      }
+    }
+    for (auto & seg : this->m_retiredSegs) {
+      munmap(seg.addr,seg.size);
     }
-    this->m_pLog = nullptr; // prevent ~MemLog() destructor to release it again.
     if (this->m_iLogFileDesc != -1){
       close(this->m_iLogFileDesc);
     }
     if (this->m_iDataFileDesc != -1){
       close(this->m_iDataFileDesc);
     }
+    if (this->m_pDirectWriter != nullptr) {
+      delete this->m_pDirectWriter;
+    }
   }
 
-  void FilePersistLog::append(const void *pdat, const uint64_t & size, const __int128 &ver, const HLC & mhlc)
+  void FilePersistLog::append(const void *pdat, const uint64_t & size, const __int128 &ver, const HLCStamp & mhlc)
   noexcept(false) {
     dbg_trace("{0} append event ({1},{2})",this->m_sName, mhlc.m_rtc_us, mhlc.m_logic);
-    FPL_RDLOCK;
+    void * pdst = this->reserve(size);
+    memcpy(pdst,pdat,size);
+    dbg_trace("{0} append:data is copied to log.",this->m_sName);
+    this->commit(ver,mhlc);
+  }
 
-#define __DO_VALIDATION \
+#define __APPEND_UNLOCK \
     do { \
-      if (NUM_FREE_SLOTS < 1 ) { \
+      if (!this->m_bSingleWriter) { \
         FPL_UNLOCK; \
-        throw PERSIST_EXP_NOSPACE_LOG; \
       } \
-      if (NUM_FREE_BYTES < size) { \
+    } while (0)
+
+// validate the space for num entries with size bytes of data in total, the
+// largest of which has maxSize bytes.
+#define __DO_VALIDATION(num,size,maxSize) \
+    do { \
+      if (IS_SEGMENTED) { \
+        if ((maxSize) > DATA_SEG_MAX_SIZE) { \
+          __APPEND_UNLOCK; \
+          throw PERSIST_EXP_NOSPACE_DATA; \
+        } \
+      } else if (NUM_USED_SLOTS + (int64_t)(num) + 1 > (int64_t)this->m_oConfig.log_entries_limit) { \
+        __APPEND_UNLOCK; \
+        throw PERSIST_EXP_NOSPACE_LOG; \
+      } else if (NUM_USED_BYTES + (size) > this->m_oConfig.data_size_limit) { \
         dbg_trace("{0}-append exception no space for data: NUM_FREE_BYTES={1}, size={2}", \
-          this->m_sName, NUM_FREE_BYTES, size); \
-        FPL_UNLOCK; \
+          this->m_sName, NUM_FREE_BYTES, (size)); \
+        __APPEND_UNLOCK; \
         throw PERSIST_EXP_NOSPACE_DATA; \
       } \
-      if ((CURR_LOG_IDX != -1) && \
-          (LOG_ENTRY_AT(CURR_LOG_IDX)->fields.ver >= ver)) { \
-        __int128 cver = LOG_ENTRY_AT(CURR_LOG_IDX)->fields.ver; \
-        dbg_trace("{0}-append cur_ver:{1}.{2} new_ver:{3}.{4}", this->m_sName, \
-          (int64_t)(cver>>64),(int64_t)cver,(int64_t)(ver>>64),(int64_t)ver); \
-        FPL_UNLOCK; \
-        throw PERSIST_EXP_INV_VERSION; \
-      } \
     } while (0)
 
-    __DO_VALIDATION;
-    FPL_UNLOCK;
-    dbg_trace("{0} append:validate check1 Finished.",this->m_sName);
+  void * FilePersistLog::reserve(const uint64_t & size)
+  noexcept(false) {
+    if (!this->m_bSingleWriter) {
+      // hold the write lock till commit() or cancel().
+      FPL_WRLOCK;
+    }
+    if (this->m_bReserved) {
+      __APPEND_UNLOCK;
+      throw PERSIST_EXP_INV_RESERVATION;
+    }
+    __DO_VALIDATION(1,size,size);
+    dbg_trace("{0} reserve:validate check Finished.",this->m_sName);
 
-    FPL_WRLOCK;
-    //check
-    __DO_VALIDATION;
-    dbg_trace("{0} append:validate check2 Finished.",this->m_sName);
+    uint64_t ofst;
+    if (!this->m_bSingleWriter) {
+      try {
+        ofst = prepareAppend(size);
+      } catch (...) {
+        FPL_UNLOCK;
+        throw;
+      }
+    } else if (fitsRing(1,size)) {
+      // Nobody else moves the tail. A concurrent trim() or persist() only
+      // moves the heads forward, which leaves more space than we see.
+      ofst = NEXT_DATA_OFST;
+    } else {
+      // growing the ring buffers excludes persist() and trim().
+      FPL_WRLOCK;
+      try {
+        ofst = prepareAppend(size);
+      } catch (...) {
+        FPL_UNLOCK;
+        throw;
+      }
+      FPL_UNLOCK;
+    }
+    this->m_iReservedOfst = ofst;
+    this->m_iReservedSize = size;
+    this->m_bReserved = true;
+    return DATA_AT(ofst);
+  }
 
-    // copy data
-    memcpy(NEXT_DATA,pdat,size);
-    dbg_trace("{0} append:data is copied to log.",this->m_sName);
+  void FilePersistLog::commit(const __int128 &ver, const HLCStamp & mhlc)
+  noexcept(false) {
+    if (!this->m_bReserved) {
+      throw PERSIST_EXP_INV_RESERVATION;
+    }
+    if ((CURR_LOG_IDX != -1) &&
+        (LOG_ENTRY_AT(CURR_LOG_IDX)->fields.ver >= ver)) {
+      __int128 cver = LOG_ENTRY_AT(CURR_LOG_IDX)->fields.ver;
+      dbg_trace("{0}-commit cur_ver:{1}.{2} new_ver:{3}.{4}", this->m_sName,
+        (int64_t)(cver>>64),(int64_t)cver,(int64_t)(ver>>64),(int64_t)ver);
+      this->cancel();
+      throw PERSIST_EXP_INV_VERSION;
+    }
 
     // fill the log entry
-    NEXT_LOG_ENTRY->fields.ver = ver;
-    NEXT_LOG_ENTRY->fields.dlen = size;
-    NEXT_LOG_ENTRY->fields.ofst = NEXT_DATA_OFST;
-    NEXT_LOG_ENTRY->fields.hlc_r = mhlc.m_rtc_us;
-    NEXT_LOG_ENTRY->fields.hlc_l = mhlc.m_logic;
-/* No Sync required here.
-    if (msync(ALIGN_TO_PAGE(NEXT_LOG_ENTRY), 
-        sizeof(LogEntry) + (((uint64_t)NEXT_LOG_ENTRY) % PAGE_SIZE),MS_SYNC) != 0) {
+    try {
+      uint32_t ulen;
+      NEXT_LOG_ENTRY->fields.dlen = compressData(this->m_iReservedOfst,
+        this->m_iReservedSize,ulen);
+      NEXT_LOG_ENTRY->fields.ulen = ulen;
+      NEXT_LOG_ENTRY->fields.ver = ver;
+      NEXT_LOG_ENTRY->fields.ofst = this->m_iReservedOfst;
+      NEXT_LOG_ENTRY->fields.hlc = mhlc;
+      NEXT_LOG_ENTRY->fields.crc = checksumEntry(META_HEADER->fields.tail,NEXT_LOG_ENTRY);
+      indexEntry(META_HEADER->fields.tail);
+    } catch (uint64_t e) {
+      this->cancel();
+      throw e;
+    }
+
+    // update meta header: publish the entry to the lock-free readers.
+    __atomic_store_n(&META_HEADER->fields.tail,META_HEADER->fields.tail + 1,
+      __ATOMIC_RELEASE);
+    dbg_trace("{0} commit:log entry and meta data are updated.",this->m_sName);
+    dbg_trace("{0} commit a log ver:{1}.{2} hlc:({3},{4})",this->m_sName,
+      HIGH__int128(ver), LOW__int128(ver),  mhlc.m_rtc_us, mhlc.m_logic);
+    this->m_bReserved = false;
+    __APPEND_UNLOCK;
+  }
+
+  void FilePersistLog::cancel()
+  noexcept(false) {
+    if (!this->m_bReserved) {
+      return;
+    }
+    // the reserved space is taken by the next reservation.
+    this->m_bReserved = false;
+    __APPEND_UNLOCK;
+  }
+
+  void FilePersistLog::appendBatch(const std::vector<PersistLogEntry> & entries)
+  noexcept(false) {
+    if (entries.empty()) {
+      return;
+    }
+    dbg_trace("{0} append a batch of {1} entries.",this->m_sName,entries.size());
+    if (!this->m_bSingleWriter) {
+      FPL_WRLOCK;
+    }
+    if (this->m_bReserved) {
+      __APPEND_UNLOCK;
+      throw PERSIST_EXP_INV_RESERVATION;
+    }
+    // validate the whole batch before writing any of it.
+    uint64_t total = 0, maxSize = 0;
+    __int128 ver = (CURR_LOG_IDX == -1)? INVALID_VERSION : LOG_ENTRY_AT(CURR_LOG_IDX)->fields.ver;
+    for (const auto & e : entries) {
+      if (ver != INVALID_VERSION && ver >= e.ver) {
+        __APPEND_UNLOCK;
+        throw PERSIST_EXP_INV_VERSION;
+      }
+      ver = e.ver;
+      total += e.size;
+      maxSize = MAX(maxSize,e.size);
+    }
+    __DO_VALIDATION(entries.size(),total,maxSize);
+    dbg_trace("{0} appendBatch:validate check Finished.",this->m_sName);
+
+    if (IS_SEGMENTED) {
+      // The readers wait for the write lock, so they see the batch at once
+      // though the tail is moved entry by entry. A failure moves the tail
+      // back, and the entries are indexed once they are all appended.
+      const int64_t tail = META_HEADER->fields.tail;
+      try {
+        for (const auto & e : entries) {
+          uint64_t ofst = prepareAppend(e.size);
+          uint32_t ulen;
+          memcpy(DATA_AT(ofst),e.pdata,e.size);
+          NEXT_LOG_ENTRY->fields.dlen = compressData(ofst,e.size,ulen);
+          NEXT_LOG_ENTRY->fields.ulen = ulen;
+          NEXT_LOG_ENTRY->fields.ver = e.ver;
+          NEXT_LOG_ENTRY->fields.ofst = ofst;
+          NEXT_LOG_ENTRY->fields.hlc = e.mhlc;
+          NEXT_LOG_ENTRY->fields.crc = checksumEntry(META_HEADER->fields.tail,NEXT_LOG_ENTRY);
+          META_HEADER->fields.tail ++;
+        }
+        for (int64_t idx = tail; idx < META_HEADER->fields.tail; idx ++) {
+          indexEntry(idx);
+        }
+      } catch (...) {
+        META_HEADER->fields.tail = tail;
+        FPL_UNLOCK;
+        throw;
+      }
       FPL_UNLOCK;
-      throw PERSIST_EXP_MSYNC(errno);
+      return;
     }
-*/
 
-    // update meta header
-    META_HEADER->fields.tail ++;
-    dbg_trace("{0} append:log entry and meta data are updated.",this->m_sName);
-/* No sync
-    if (msync(this->m_pMeta,sizeof(MetaHeader),MS_SYNC) != 0) {
+    // make room for the whole batch
+    uint64_t ofst;
+    if (!this->m_bSingleWriter) {
+      try {
+        ofst = prepareAppend(total,entries.size());
+      } catch (...) {
+        FPL_UNLOCK;
+        throw;
+      }
+    } else if (fitsRing(entries.size(),total)) {
+      ofst = NEXT_DATA_OFST;
+    } else {
+      FPL_WRLOCK;
+      try {
+        ofst = prepareAppend(total,entries.size());
+      } catch (...) {
+        FPL_UNLOCK;
+        throw;
+      }
       FPL_UNLOCK;
-      throw PERSIST_EXP_MSYNC(errno);
     }
-*/
-    dbg_trace("{0} append a log ver:{1}.{2} hlc:({3},{4})",this->m_sName, 
-      HIGH__int128(ver), LOW__int128(ver),  mhlc.m_rtc_us, mhlc.m_logic);
-    FPL_UNLOCK;
+    // fill the entries after the tail, and publish them with one update.
+    const int64_t tail = META_HEADER->fields.tail;
+    try {
+      for (std::size_t i = 0; i < entries.size(); i++) {
+        const PersistLogEntry & e = entries[i];
+        LogEntry * ple = LOG_ENTRY_AT(tail + (int64_t)i);
+        uint32_t ulen;
+        memcpy(DATA_AT(ofst),e.pdata,e.size);
+        ple->fields.ver = e.ver;
+        ple->fields.dlen = compressData(ofst,e.size,ulen);
+        ple->fields.ulen = ulen;
+        ple->fields.ofst = ofst;
+        ple->fields.hlc = e.mhlc;
+        ple->fields.crc = checksumEntry(tail + (int64_t)i,ple);
+        indexEntry(tail + (int64_t)i);
+        ofst += ple->fields.dlen;
+      }
+    } catch (uint64_t e) {
+      __APPEND_UNLOCK;
+      throw e;
+    }
+    __atomic_store_n(&META_HEADER->fields.tail,tail + (int64_t)entries.size(),
+      __ATOMIC_RELEASE);
+    dbg_trace("{0} appendBatch:{1} entries are appended.",this->m_sName,entries.size());
+    __APPEND_UNLOCK;
   }
 
   const __int128 FilePersistLog::persist()
+    noexcept(false) {
+    if (!this->m_bGcThread) {
+      return doPersist();
+    }
+    // take a ticket and wait for a flush started after it.
+    FPL_GC_LOCK;
+    const int64_t ticket = ++this->m_iGcTicket;
+    pthread_cond_signal(&this->m_gcReqCond);
+    while (this->m_iGcDone < ticket) {
+      pthread_cond_wait(&this->m_gcDoneCond,&this->m_gclock);
+    }
+    // A flush failed after the ticket was taken, it may or may not cover
+    // the ticket. Persist in this thread to get the exception, if any.
+    const bool bFailed = (this->m_iGcFailed >= ticket);
+    const __int128 ver_ret = this->m_gcVer;
+    FPL_GC_UNLOCK;
+    if (bFailed) {
+      return doPersist();
+    }
+    return ver_ret;
+  }
+
+  void * FilePersistLog::groupCommitThread(void * arg)
+    noexcept(true) {
+    FilePersistLog * plog = (FilePersistLog *)arg;
+    const uint64_t maxBatch = plog->m_oConfig.group_commit_max_batch;
+    const uint64_t window_ns = plog->m_oConfig.group_commit_window_us * 1000;
+    pthread_mutex_lock(&plog->m_gclock);
+    while (true) {
+      while (!plog->m_bGcStop && plog->m_iGcTicket == plog->m_iGcDone) {
+        pthread_cond_wait(&plog->m_gcReqCond,&plog->m_gclock);
+      }
+      if (plog->m_iGcTicket == plog->m_iGcDone) {
+        break; // stopped
+      }
+      // wait for more callers till the window closes or the batch is full.
+      if (window_ns > 0) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC,&deadline);
+        deadline.tv_sec += (deadline.tv_nsec + window_ns) / 1000000000;
+        deadline.tv_nsec = (deadline.tv_nsec + window_ns) % 1000000000;
+        while (!plog->m_bGcStop &&
+               (uint64_t)(plog->m_iGcTicket - plog->m_iGcDone) < maxBatch) {
+          if (pthread_cond_timedwait(&plog->m_gcReqCond,&plog->m_gclock,&deadline) == ETIMEDOUT) {
+            break;
+          }
+        }
+      }
+      // the flush covers all the tickets taken so far.
+      const int64_t batch = plog->m_iGcTicket;
+      pthread_mutex_unlock(&plog->m_gclock);
+      bool bFailed = false;
+      __int128 ver = INVALID_VERSION;
+      try {
+        ver = plog->doPersist();
+      } catch (unsigned long long e) {
+        dbg_warn("{0} group commit failed with exception:{1:x}",plog->m_sName,e);
+        bFailed = true;
+      } catch (...) {
+        // the waiters persist in their own threads to get the exception.
+        dbg_warn("{0} group commit failed with an unknown exception.",plog->m_sName);
+        bFailed = true;
+      }
+      pthread_mutex_lock(&plog->m_gclock);
+      if (bFailed) {
+        plog->m_iGcFailed = batch;
+      } else {
+        plog->m_gcVer = ver;
+      }
+      dbg_trace("{0} group commit served tickets ({1},{2}].",plog->m_sName,plog->m_iGcDone,batch);
+      plog->m_iGcDone = batch;
+      pthread_cond_broadcast(&plog->m_gcDoneCond);
+    }
+    pthread_mutex_unlock(&plog->m_gclock);
+    return nullptr;
+  }
+
+  const __int128 FilePersistLog::doPersist()
     noexcept(false) {
     __int128 ver_ret = INVALID_VERSION;
     FPL_RDLOCK;
     FPL_PERS_LOCK;
 
-    if(*META_HEADER == *META_HEADER_PERS) {
-      if (CURR_LOG_IDX != -1){
-        ver_ret = LOG_ENTRY_AT(CURR_LOG_IDX)->fields.ver;
+    // In the single-writer mode, append() moves the tail concurrently. We
+    // persist the entries published till now.
+    MetaHeader header = *META_HEADER;
+    header.fields.tail = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE);
+    if(header == *META_HEADER_PERS) {
+      if (header.fields.tail > header.fields.head){
+        ver_ret = LOG_ENTRY_AT(header.fields.tail - 1)->fields.ver;
       }
       FPL_PERS_UNLOCK;
       FPL_UNLOCK;
@@ -266,29 +772,26 @@ namespace ns_persistent{
 
     //flush data
     dbg_trace("{0} flush data,log,and meta.", this->m_sName);
+    bool bRetire = false;
     try {
-      if ((NUM_USED_SLOTS > 0) && 
-          (NEXT_LOG_ENTRY > NEXT_LOG_ENTRY_PERS)){
-        size_t flush_len = (LOG_ENTRY_AT(CURR_LOG_IDX)->fields.ofst +
-          LOG_ENTRY_AT(CURR_LOG_IDX)->fields.dlen - 
-          NEXT_LOG_ENTRY_PERS->fields.ofst);
-        // flush data
-        void * flush_start;
-        flush_start = ALIGN_TO_PAGE(NEXT_DATA_PERS);
-        flush_len += ((int64_t)NEXT_DATA_PERS)%PAGE_SIZE;
-        if (msync(flush_start,flush_len,MS_SYNC) != 0) {
-          throw PERSIST_EXP_MSYNC(errno);
-        }
-        // flush log
-        flush_start = ALIGN_TO_PAGE(NEXT_LOG_ENTRY_PERS);
-        flush_len = ((size_t)NEXT_LOG_ENTRY-(size_t)NEXT_LOG_ENTRY_PERS) + 
-          ((int64_t)NEXT_LOG_ENTRY_PERS)%PAGE_SIZE;
-        if (msync(flush_start,flush_len,MS_SYNC) != 0) {
-          throw PERSIST_EXP_MSYNC(errno);
+      // The entries in [flush_head,tail) are not persisted yet.
+      int64_t flush_head = MAX(META_HEADER_PERS->fields.tail,header.fields.head);
+      if (header.fields.tail > flush_head) {
+        flushEntries(flush_head,header.fields.tail);
+      }
+      // the new segment files must be found after a crash.
+      if (this->m_bNewSegments) {
+        int fd = open(this->m_sDataPath.c_str(),O_RDONLY|O_DIRECTORY);
+        if (fd == -1) {
+          throw PERSIST_EXP_OPEN_FILE(errno);
         }
+        fsync(fd);
+        close(fd);
+        this->m_bNewSegments = false;
       }
       // flush meta data
-      this->persistMetaHeaderAtomically();
+      this->persistMetaHeaderAtomically(header);
+      bRetire = IS_SEGMENTED && hasRetiredSegments();
     } catch (uint64_t e) {
       FPL_PERS_UNLOCK;
       FPL_UNLOCK;
@@ -297,61 +800,338 @@ namespace ns_persistent{
     dbg_trace("{0} flush data,log,and meta...done.", this->m_sName);
 
     //get the latest flushed version
-    if (NUM_USED_SLOTS > 0) {
-      ver_ret = LOG_ENTRY_AT(CURR_LOG_IDX)->fields.ver;
+    if (header.fields.tail > header.fields.head) {
+      ver_ret = LOG_ENTRY_AT(header.fields.tail - 1)->fields.ver;
     }
 
     FPL_PERS_UNLOCK;
     FPL_UNLOCK;
+
+    // the persisted head may have passed some segments
+    if (bRetire) {
+      FPL_WRLOCK;
+      try {
+        retireSegments();
+      } catch (uint64_t e) {
+        FPL_UNLOCK;
+        throw e;
+      }
+      FPL_UNLOCK;
+    }
     return ver_ret;
   }
 
-  int64_t FilePersistLog::getLength ()
-  noexcept(false) {
-
-    FPL_RDLOCK;
-    int64_t len = NUM_USED_SLOTS;
-    FPL_UNLOCK;
-
-    return len;
+  void FilePersistLog::recover() noexcept(false) {
+    struct timespec start,end;
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    const int64_t head = META_HEADER->fields.head;
+    const int64_t tail = META_HEADER->fields.tail;
+    // the data of the entries fits in the data ring from the head on.
+    uint64_t dataEnd = UINT64_MAX;
+    if (!IS_SEGMENTED) {
+      dataEnd = NEXT_DATA_OFST + MAX_DATA_SIZE;
+      if (head < tail) {
+        dataEnd = LOG_ENTRY_AT(head)->fields.ofst + MAX_DATA_SIZE;
+      }
+    }
+    // STEP 1: verify the persisted entries. By default, only the last one is
+    // verified, and the others if it is torn.
+    int64_t newTail = tail;
+    if (head < tail && (this->m_oConfig.verify_persisted ||
+        verifyEntries(tail - 1,tail,false,dataEnd) < tail)) {
+      newTail = verifyEntries(head,tail,false,dataEnd);
+    }
+    // STEP 2: recover the entries appended after the last persist(). In a
+    // segmented log, they may be in the segments removed by load().
+    if (newTail == tail && !IS_SEGMENTED) {
+      newTail = verifyEntries(tail,head + (int64_t)MAX_LOG_ENTRY - 1,true,dataEnd);
+    }
+    if (newTail < tail) {
+      this->m_oRecoveryStats.entries_dropped = tail - newTail;
+      dbg_warn("{0}:log entry {1} is torn, {2} persisted entries are dropped.",
+        this->m_sName,newTail,tail - newTail);
+    } else {
+      this->m_oRecoveryStats.entries_recovered = newTail - tail;
+    }
+    // STEP 3: persist the new tail
+    if (newTail != tail) {
+      META_HEADER->fields.tail = newTail;
+      if (IS_SEGMENTED) {
+        // reload the segments up to the new tail
+        for (auto & seg : this->m_logSegs) {
+          if (seg.addr != nullptr) {
+            munmap(seg.addr,seg.size);
+          }
+        }
+        for (auto & seg : this->m_dataSegs) {
+          if (seg.addr != nullptr) {
+            munmap(seg.addr,seg.size);
+          }
+        }
+        this->m_logSegs.clear();
+        this->m_dataSegs.clear();
+        loadSegments();
+      }
+      FPL_RDLOCK;
+      FPL_PERS_LOCK;
+      try {
+        if (newTail > tail) {
+          flushEntries(tail,newTail);
+        }
+        persistMetaHeaderAtomically(*META_HEADER);
+      } catch (uint64_t e) {
+        FPL_PERS_UNLOCK;
+        FPL_UNLOCK;
+        throw e;
+      }
+      FPL_PERS_UNLOCK;
+      FPL_UNLOCK;
+    }
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    this->m_oRecoveryStats.time_us = (end.tv_sec - start.tv_sec)*1000000 +
+      (end.tv_nsec - start.tv_nsec)/1000;
+    dbg_info("{0}:recovered in {1}us, {2} entries and {3} bytes scanned, {4} entries recovered, {5} entries dropped, crc32c={6}.",
+      this->m_sName,this->m_oRecoveryStats.time_us,this->m_oRecoveryStats.entries_scanned,
+      this->m_oRecoveryStats.bytes_scanned,this->m_oRecoveryStats.entries_recovered,
+      this->m_oRecoveryStats.entries_dropped,getCrc32cKernel());
   }
 
-  int64_t FilePersistLog::getEarliestIndex ()
-  noexcept(false) {
-    FPL_RDLOCK;
-    int64_t idx = (NUM_FREE_SLOTS == 0)? INVALID_INDEX:META_HEADER->fields.head;
-    FPL_UNLOCK;
-    return idx;
+  int64_t FilePersistLog::verifyEntries(const int64_t & from, const int64_t & to,
+    const bool & strict, const uint64_t & dataEnd) noexcept(true) {
+    if (from >= to) {
+      return to;
+    }
+    // split the range to chunks of at least RECOVERY_MIN_CHUNK entries, one
+    // for each thread, but not more than the CPUs.
+    const int64_t cpus = MAX(1,sysconf(_SC_NPROCESSORS_ONLN));
+    const int64_t num = MAX(1,MIN(MIN((int64_t)this->m_oConfig.recovery_threads,cpus),
+      (to - from + RECOVERY_MIN_CHUNK - 1) / RECOVERY_MIN_CHUNK));
+    const int64_t len = (to - from + num - 1) / num;
+    std::vector<VerifyChunk> chunks;
+    for (int64_t i = from; i < to; i += len) {
+      chunks.push_back({this,i,MIN(i + len,to),strict,dataEnd,0,0,0});
+    }
+    // the first chunk is verified in this thread.
+    std::vector<pthread_t> threads(chunks.size());
+    std::vector<bool> started(chunks.size(),false);
+    for (std::size_t i = 1; i < chunks.size(); i++) {
+      started[i] = (pthread_create(&threads[i],NULL,verifyThread,(void*)&chunks[i]) == 0);
+    }
+    for (std::size_t i = 0; i < chunks.size(); i++) {
+      if (i == 0 || !started[i]) {
+        verifyThread((void*)&chunks[i]);
+      } else {
+        pthread_join(threads[i],NULL);
+      }
+    }
+    // the first chunk with an invalid entry ends the valid range.
+    int64_t bad = to;
+    for (const auto & chunk : chunks) {
+      this->m_oRecoveryStats.entries_scanned += chunk.entries;
+      this->m_oRecoveryStats.bytes_scanned += chunk.bytes;
+      if (bad == to && chunk.bad < chunk.to) {
+        bad = chunk.bad;
+      }
+    }
+    return bad;
   }
 
-  const void * FilePersistLog::getEntryByIndex (const int64_t &eidx)
-    noexcept(false) {
-
-    FPL_RDLOCK;
-    dbg_trace("{0}-getEntryByIndex-head:{1},tail:{2},eidx:{3}",
-      this->m_sName,META_HEADER->fields.head,META_HEADER->fields.tail,eidx);
-
-    int64_t ridx = (eidx < 0)?(META_HEADER->fields.tail + eidx):eidx;
-
-    if (META_HEADER->fields.tail <= ridx || ridx < META_HEADER->fields.head ) {
-      FPL_UNLOCK;
-      throw PERSIST_EXP_INV_ENTRY_IDX(eidx);
+  void * FilePersistLog::verifyThread(void * arg) noexcept(true) {
+    VerifyChunk * chunk = (VerifyChunk *)arg;
+    chunk->bad = chunk->to;
+    for (int64_t idx = chunk->from; idx < chunk->to; idx ++) {
+      if (!chunk->plog->verifyEntry(idx,chunk->strict,chunk->dataEnd,chunk->bytes)) {
+        chunk->bad = idx;
+        break;
+      }
+      chunk->entries ++;
     }
-    FPL_UNLOCK;
-
-    dbg_trace("{0} getEntryByIndex at idx:{1} ver:{2}.{3} time:({4},{5})",
-     this->m_sName,
-       ridx,
-       (int64_t)(LOG_ENTRY_AT(ridx)->fields.ver>>64),
-       (int64_t)(LOG_ENTRY_AT(ridx)->fields.ver),
-       (LOG_ENTRY_AT(ridx))->fields.hlc_r,
-       (LOG_ENTRY_AT(ridx))->fields.hlc_l);
-
-    return LOG_ENTRY_DATA(LOG_ENTRY_AT(ridx));
+    return NULL;
   }
 
-  // binary search through the log
-  /**
+  bool FilePersistLog::verifyEntry(const int64_t & idx, const bool & strict,
+    const uint64_t & dataEnd, uint64_t & bytes) noexcept(true) {
+    try {
+      const LogEntry * ple = LOG_ENTRY_AT(idx);
+      if (ple->fields.crc == 0) {
+        // an entry written before the checksums
+        return !strict;
+      }
+      // the data must be in the buffer before it is checksummed.
+      if (ple->fields.ofst + ple->fields.dlen > dataEnd ||
+          ple->fields.ofst + ple->fields.dlen < ple->fields.ofst) {
+        return false;
+      }
+      if (IS_SEGMENTED) {
+        const int64_t segno = DATA_SEG_OF(ple->fields.ofst);
+        if (segno < this->m_iFirstDataSeg ||
+            segno >= this->m_iFirstDataSeg + (int64_t)this->m_dataSegs.size()) {
+          return false;
+        }
+        DATA_AT(ple->fields.ofst);
+        if (DATA_SEG_OFST(ple->fields.ofst) + ple->fields.dlen >
+            this->m_dataSegs[segno - this->m_iFirstDataSeg].size) {
+          return false;
+        }
+      } else if (ple->fields.dlen > MAX_DATA_SIZE) {
+        return false;
+      }
+      if (strict) {
+        // the entry follows the previous one, or starts an empty log.
+        const bool bFirst = (idx == META_HEADER->fields.head);
+        const LogEntry * pprev = bFirst ? nullptr : LOG_ENTRY_AT(idx - 1);
+        const uint64_t ofst = bFirst ? 0 : pprev->fields.ofst + pprev->fields.dlen;
+        if (ple->fields.ofst != ofst ||
+            (!bFirst && pprev->fields.ver >= ple->fields.ver)) {
+          return false;
+        }
+      }
+      bytes += sizeof(LogEntry) + ple->fields.dlen;
+      return checksumEntry(idx,ple) == ple->fields.crc;
+    } catch (uint64_t e) {
+      return false;
+    }
+  }
+
+  uint32_t FilePersistLog::checksumEntry(const int64_t & idx, const LogEntry * ple)
+  noexcept(false) {
+    uint32_t crc = crc32c(0,&idx,sizeof(idx));
+    crc = crc32c(crc,ple,offsetof(LogEntry,fields.crc));
+    crc = crc32c(crc,DATA_AT(ple->fields.ofst),ple->fields.dlen);
+    return (crc == 0)? 1 : crc;
+  }
+
+  void FilePersistLog::flushEntries(const int64_t & from, const int64_t & to)
+  noexcept(false) {
+    LogEntry * ple = LOG_ENTRY_AT(from);
+    uint64_t dataFrom = ple->fields.ofst;
+    uint64_t dataTo = LOG_ENTRY_AT(to - 1)->fields.ofst + LOG_ENTRY_AT(to - 1)->fields.dlen;
+    if (this->m_pDirectWriter != nullptr) {
+      // write both ranges and synchronize the files in one batch.
+      writeRing(this->m_iDataFileDesc,DATA_RING,dataFrom,dataTo);
+      writeRing(this->m_iLogFileDesc,LOG_RING,from*sizeof(LogEntry),to*sizeof(LogEntry));
+      this->m_pDirectWriter->sync(this->m_iDataFileDesc);
+      this->m_pDirectWriter->sync(this->m_iLogFileDesc);
+      this->m_pDirectWriter->wait();
+      return;
+    }
+    if (!IS_SEGMENTED) {
+      // The double mapping makes both ranges contiguous.
+      // flush data
+      flushRange(LOG_ENTRY_DATA(ple),dataTo - dataFrom);
+      // flush log
+      flushRange(ple,(to - from)*sizeof(LogEntry));
+      drainFlushes();
+      return;
+    }
+    // flush data segment by segment
+    for (int64_t segno = DATA_SEG_OF(dataFrom); segno <= DATA_SEG_OF(dataTo - 1); segno ++) {
+      uint64_t start = (segno == DATA_SEG_OF(dataFrom))? dataFrom : ((uint64_t)segno << DATA_SEG_SHIFT);
+      uint64_t end = (segno == DATA_SEG_OF(dataTo - 1))? dataTo :
+        ((uint64_t)segno << DATA_SEG_SHIFT) + this->m_dataSegs[segno - this->m_iFirstDataSeg].size;
+      if (end <= start) {
+        continue;
+      }
+      flushRange(DATA_AT(start),end - start);
+    }
+    // flush log segment by segment
+    const int64_t segEntries = META_HEADER->fields.seg_entries;
+    for (int64_t idx = from; idx < to; idx = (LOG_SEG_OF(idx) + 1) * segEntries) {
+      int64_t end = MIN((LOG_SEG_OF(idx) + 1) * segEntries, to);
+      flushRange(LOG_ENTRY_AT(idx),(end - idx)*sizeof(LogEntry));
+    }
+    drainFlushes();
+  }
+
+  void FilePersistLog::flushRange(const void * addr, const uint64_t & len)
+  noexcept(false) {
+    if (this->m_bPmem) {
+      pmemFlush(addr,len);
+      return;
+    }
+    if (msync(ALIGN_TO_PAGE(addr),len + ((uint64_t)addr)%PAGE_SIZE,MS_SYNC) != 0) {
+      throw PERSIST_EXP_MSYNC(errno);
+    }
+  }
+
+  void * FilePersistLog::mapShared(void * addr, const uint64_t & len, const int & fd)
+  noexcept(true) {
+    if (!this->m_bPmem) {
+      return mmap(addr,len,PROT_READ|PROT_WRITE,MAP_SHARED|((addr == NULL)? 0 : MAP_FIXED),fd,0);
+    }
+    bool dax = false;
+    void * ret = pmemMap(addr,len,fd,0,dax);
+    if (ret != MAP_FAILED && !dax) {
+      this->m_bDax = false;
+    }
+    return ret;
+  }
+
+  int64_t FilePersistLog::getLength ()
+  noexcept(false) {
+    int64_t len;
+
+    FPL_READ_BEGIN;
+    len = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE) -
+      __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_ACQUIRE);
+    FPL_READ_END;
+
+    return len;
+  }
+
+  int64_t FilePersistLog::getEarliestIndex ()
+  noexcept(false) {
+    int64_t idx;
+    FPL_READ_BEGIN;
+    int64_t head = __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_ACQUIRE);
+    int64_t tail = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE);
+    idx = (tail == head)? INVALID_INDEX:head;
+    FPL_READ_END;
+    return idx;
+  }
+
+  const void * FilePersistLog::getEntryByIndex (const int64_t &eidx)
+    noexcept(false) {
+
+    LogEntry * ple;
+    const void * pdat;
+    int64_t ridx;
+    FPL_READ_BEGIN;
+    int64_t head = __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_ACQUIRE);
+    int64_t tail = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE);
+    dbg_trace("{0}-getEntryByIndex-head:{1},tail:{2},eidx:{3}",
+      this->m_sName,head,tail,eidx);
+
+    ridx = (eidx < 0)?(tail + eidx):eidx;
+
+    if (tail <= ridx || ridx < head ) {
+      FPL_READ_UNLOCK;
+      throw PERSIST_EXP_INV_ENTRY_IDX(eidx);
+    }
+
+    try {
+      ple = LOG_ENTRY_AT(ridx);
+      pdat = readEntry(ridx);
+      FPL_READ_LOW(ridx);
+    } catch (uint64_t e) {
+      FPL_READ_UNLOCK;
+      throw e;
+    }
+    FPL_READ_END;
+
+    dbg_trace("{0} getEntryByIndex at idx:{1} ver:{2}.{3} time:({4},{5})",
+     this->m_sName,
+       ridx,
+       (int64_t)(ple->fields.ver>>64),
+       (int64_t)(ple->fields.ver),
+       ple->fields.hlc.m_rtc_us,
+       ple->fields.hlc.m_logic);
+
+    return pdat;
+  }
+
+  // binary search through the log
+  /**
    * binary search through the log
    * [ ][ ][ ][ ][X][X][X][X][ ][ ][ ]
    *              ^logHead   ^logTail
@@ -399,64 +1179,424 @@ namespace ns_persistent{
   noexcept(false) {
 
     LogEntry * ple = nullptr;
+    const void * pdat = nullptr;
 
-    FPL_RDLOCK;
+    FPL_READ_BEGIN;
 
     //binary search
-    int64_t head = META_HEADER->fields.head % MAX_LOG_ENTRY;
-    int64_t tail = META_HEADER->fields.tail % MAX_LOG_ENTRY;
-    if (tail < head) tail += MAX_LOG_ENTRY;
+    int64_t head = __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_ACQUIRE);
+    int64_t tail = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE);
     dbg_trace("{0} - begin binary search.",this->m_sName);
-    int64_t l_idx = binarySearch<__int128>(
-      [&](int64_t idx){
-        return LOG_ENTRY_AT(idx)->fields.ver;
-      },
-      ver,head,tail);
-    ple = (l_idx == -1) ? nullptr : LOG_ENTRY_AT(l_idx);
+    try {
+      int64_t l_idx = searchVersion(ver,head,tail);
+      ple = (l_idx == -1) ? nullptr : LOG_ENTRY_AT(l_idx);
+      pdat = (l_idx == -1) ? nullptr : readEntry(l_idx);
+      FPL_READ_LOW(head);
+    } catch (uint64_t e) {
+      FPL_READ_UNLOCK;
+      throw e;
+    }
     dbg_trace("{0} - end binary search.",this->m_sName);
 
-    FPL_UNLOCK;
+    FPL_READ_END;
 
     // no object exists before the requested timestamp.
     if (ple == nullptr){
       return nullptr;
     }
 
-    dbg_trace("{0} getEntry at ({1},{2})",this->m_sName,ple->fields.hlc_r,ple->fields.hlc_l);
+    dbg_trace("{0} getEntry at ({1},{2})",this->m_sName,ple->fields.hlc.m_rtc_us,ple->fields.hlc.m_logic);
 
-    return LOG_ENTRY_DATA(ple);
+    return pdat;
   }
 
-  const void * FilePersistLog::getEntry(const HLC &rhlc)
+  int64_t FilePersistLog::searchVersion(const __int128 & ver, const int64_t & head,
+    const int64_t & tail) noexcept(false) {
+    if (this->m_pVerIndex != nullptr && tail > head) {
+      // check the hint from the index: it may be stale.
+      int64_t idx = this->m_pVerIndex->lookup(ver);
+      if (idx < head) {
+        if (LOG_ENTRY_AT(head)->fields.ver > ver) {
+          return -1;
+        }
+      } else if (idx < tail && LOG_ENTRY_AT(idx)->fields.ver <= ver &&
+          (idx + 1 == tail || LOG_ENTRY_AT(idx + 1)->fields.ver > ver)) {
+        return idx;
+      }
+      dbg_trace("{0} version index missed version {1}.{2}.",this->m_sName,
+        (int64_t)(ver>>64),(int64_t)ver);
+    }
+    if (this->m_pVerColumn != nullptr) {
+      return this->m_pVerColumn->search(ver,head,tail);
+    }
+    return binarySearch<__int128>(
+      [&](int64_t idx){
+        return LOG_ENTRY_AT(idx)->fields.ver;
+      },
+      ver,head,tail);
+  }
+
+  int64_t FilePersistLog::searchHlc(const unsigned __int128 & key, const int64_t & head,
+    const int64_t & tail) noexcept(false) {
+    if (this->m_pHlcColumn != nullptr) {
+      return this->m_pHlcColumn->search(key,head,tail);
+    }
+    return binarySearch<unsigned __int128>(
+      [&](int64_t idx){
+        return LOG_ENTRY_AT(idx)->fields.hlc.key();
+      },
+      key,head,tail);
+  }
+
+  void FilePersistLog::searchHlcRange(const unsigned __int128 & from,
+    const unsigned __int128 & to, const int64_t & head, const int64_t & tail,
+    int64_t & first, int64_t & last) noexcept(false) {
+    searchRange<unsigned __int128>(
+      [&](const unsigned __int128 & key) {
+        return searchHlc(key,head,tail);
+      },
+      from,to,0,head,first,last);
+  }
+
+  // the buffers of a thread for compression, and for the decompressed data
+  // returned to the thread.
+  static thread_local std::vector<char> t_compressBuffer;
+  static thread_local std::vector<char> t_readBuffer;
+  static thread_local std::vector<char> t_bulkReadBuffer;
+
+  uint64_t FilePersistLog::compressData(const uint64_t & ofst, const uint64_t & size,
+    uint32_t & ulen) noexcept(false) {
+    ulen = 0;
+    if (this->m_oConfig.compression == CT_NONE || size <= 16 || size > UINT32_MAX) {
+      return size;
+    }
+    if (t_compressBuffer.size() < LZ4_COMPRESS_BOUND(size)) {
+      t_compressBuffer.resize(LZ4_COMPRESS_BOUND(size));
+    }
+    uint64_t csize = lz4Compress(DATA_AT(ofst),size,t_compressBuffer.data());
+    if (csize >= size) {
+      return size;
+    }
+    memcpy(DATA_AT(ofst),t_compressBuffer.data(),csize);
+    ulen = (uint32_t)size;
+    return csize;
+  }
+
+  const void * FilePersistLog::readEntry(const int64_t & idx) noexcept(false) {
+    noteRead();
+    const LogEntry * ple = LOG_ENTRY_AT(idx);
+    const uint32_t ulen = ple->fields.ulen;
+    const uint64_t dlen = ple->fields.dlen;
+    const void * pdat = LOG_ENTRY_DATA(ple);
+    // a lock-free reader may see an entry being overwritten: it retries.
+    if (ulen == 0 || (this->m_bSingleWriter && !validateRead(idx))) {
+      return pdat;
+    }
+    if (t_readBuffer.size() < ulen) {
+      t_readBuffer.resize(ulen);
+    }
+    if (!lz4Decompress(pdat,dlen,t_readBuffer.data(),ulen) &&
+        (!this->m_bSingleWriter || validateRead(idx))) {
+      throw PERSIST_EXP_DECOMPRESS(idx);
+    }
+    return t_readBuffer.data();
+  }
+
+  void FilePersistLog::readEntries(const int64_t & first, const int64_t & last,
+    std::vector<const void *> & entries, std::vector<char> * buffer) noexcept(false) {
+    noteRead();
+    if (this->m_oConfig.compression == CT_NONE) {
+      for (int64_t idx = first; idx < last; idx++) {
+        entries.push_back(LOG_ENTRY_DATA(LOG_ENTRY_AT(idx)));
+      }
+      return;
+    }
+    // size the buffer for all of the compressed entries, then decompress them.
+    std::vector<char> & buf = (buffer == nullptr) ? t_bulkReadBuffer : *buffer;
+    uint64_t total = 0;
+    for (int64_t idx = first; idx < last; idx++) {
+      total += LOG_ENTRY_AT(idx)->fields.ulen;
+    }
+    if (this->m_bSingleWriter && !validateRead(first)) {
+      return;
+    }
+    buf.resize(total);
+    uint64_t pos = 0;
+    for (int64_t idx = first; idx < last; idx++) {
+      const LogEntry * ple = LOG_ENTRY_AT(idx);
+      const uint32_t ulen = ple->fields.ulen;
+      if (ulen == 0 || pos + ulen > total) {
+        entries.push_back(LOG_ENTRY_DATA(ple));
+        continue;
+      }
+      if (!lz4Decompress(LOG_ENTRY_DATA(ple),ple->fields.dlen,buf.data() + pos,ulen) &&
+          (!this->m_bSingleWriter || validateRead(idx))) {
+        throw PERSIST_EXP_DECOMPRESS(idx);
+      }
+      entries.push_back(buf.data() + pos);
+      pos += ulen;
+    }
+  }
+
+  void FilePersistLog::indexEntry(const int64_t & idx) noexcept(false) {
+    const LogEntry * ple = LOG_ENTRY_AT(idx);
+    if (this->m_pVerIndex != nullptr) {
+      this->m_pVerIndex->append(idx,ple->fields.ver);
+    }
+    if (this->m_pVerColumn != nullptr) {
+      const int64_t head = __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_RELAXED);
+      this->m_pVerColumn->append(idx,ple->fields.ver,head);
+      this->m_pHlcColumn->append(idx,
+        ple->fields.hlc.key(),head);
+    }
+  }
+
+  const void * FilePersistLog::getEntry(const HLCStamp & rhlc)
   noexcept(false) {
 
     LogEntry * ple = nullptr;
-    unsigned __int128 key = ((((unsigned __int128)rhlc.m_rtc_us)<<64) | rhlc.m_logic);
+    const void * pdat = nullptr;
+    unsigned __int128 key = rhlc.key();
 
-    FPL_RDLOCK;
+    FPL_READ_BEGIN;
 
     //binary search
-    int64_t head = META_HEADER->fields.head % MAX_LOG_ENTRY;
-    int64_t tail = META_HEADER->fields.tail % MAX_LOG_ENTRY;
-    if (tail < head) tail += MAX_LOG_ENTRY; //because we mapped it twice
+    int64_t head = __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_ACQUIRE);
+    int64_t tail = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE);
     dbg_trace("{0} - begin binary search.",this->m_sName);
-    int64_t l_idx = binarySearch<unsigned __int128>(
-      [&](int64_t idx){
-        return ((((unsigned __int128)LOG_ENTRY_AT(idx)->fields.hlc_r)<<64) | LOG_ENTRY_AT(idx)->fields.hlc_l);
-      },
-      key,head,tail);
+    try {
+      int64_t l_idx = searchHlc(key,head,tail);
+      ple = (l_idx == -1) ? nullptr : LOG_ENTRY_AT(l_idx);
+      pdat = (l_idx == -1) ? nullptr : readEntry(l_idx);
+      FPL_READ_LOW(head);
+    } catch (uint64_t e) {
+      FPL_READ_UNLOCK;
+      throw e;
+    }
     dbg_trace("{0} - end binary search.",this->m_sName);
-    ple = (l_idx == -1) ? nullptr : LOG_ENTRY_AT(l_idx);
-    FPL_UNLOCK;
+    FPL_READ_END;
 
     // no object exists before the requested timestamp.
     if (ple == nullptr){
       return nullptr;
     }
 
-    dbg_trace("{0} getEntry at ({1},{2})",this->m_sName,ple->fields.hlc_r,ple->fields.hlc_l);
+    dbg_trace("{0} getEntry at ({1},{2})",this->m_sName,ple->fields.hlc.m_rtc_us,ple->fields.hlc.m_logic);
+
+    return pdat;
+  }
+
+  int64_t FilePersistLog::getLatestIndex() noexcept(false) {
+    int64_t head = __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_ACQUIRE);
+    int64_t tail = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE);
+    return (tail > head) ? tail - 1 : -1;
+  }
+
+  int64_t FilePersistLog::getIndex(const __int128 & ver) noexcept(false) {
+    int64_t l_idx;
+
+    FPL_READ_BEGIN;
+    int64_t head = __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_ACQUIRE);
+    int64_t tail = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE);
+    try {
+      l_idx = searchVersion(ver,head,tail);
+      FPL_READ_LOW(head);
+    } catch (uint64_t e) {
+      FPL_READ_UNLOCK;
+      throw e;
+    }
+    FPL_READ_END;
+    return l_idx;
+  }
+
+  int64_t FilePersistLog::getIndex(const HLCStamp & hlc) noexcept(false) {
+    const unsigned __int128 key = hlc.key();
+    int64_t l_idx;
+
+    FPL_READ_BEGIN;
+    int64_t head = __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_ACQUIRE);
+    int64_t tail = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE);
+    try {
+      l_idx = searchHlc(key,head,tail);
+      FPL_READ_LOW(head);
+    } catch (uint64_t e) {
+      FPL_READ_UNLOCK;
+      throw e;
+    }
+    FPL_READ_END;
+    return l_idx;
+  }
+
+  void FilePersistLog::getIndexRange(const HLCStamp & from, const HLCStamp & to,
+    int64_t & first, int64_t & last) noexcept(false) {
+    const unsigned __int128 kfrom = from.key();
+    const unsigned __int128 kto = to.key();
+
+    FPL_READ_BEGIN;
+    int64_t head = __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_ACQUIRE);
+    int64_t tail = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE);
+    try {
+      searchHlcRange(kfrom,kto,head,tail,first,last);
+      FPL_READ_LOW(head);
+    } catch (uint64_t e) {
+      FPL_READ_UNLOCK;
+      throw e;
+    }
+    FPL_READ_END;
+    dbg_trace("{0} getIndexRange:[{1},{2})",this->m_sName,first,last);
+  }
+
+  int64_t FilePersistLog::getIndexNotBefore(const HLCStamp & hlc) noexcept(false) {
+    const unsigned __int128 key = hlc.key();
+    int64_t l_idx;
+
+    FPL_READ_BEGIN;
+    int64_t head = __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_ACQUIRE);
+    int64_t tail = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE);
+    try {
+      l_idx = searchNotBefore<unsigned __int128>(
+        [&](const unsigned __int128 & k) {
+          return searchHlc(k,head,tail);
+        },
+        key,0,head);
+      if (l_idx >= tail) {
+        l_idx = -1;
+      }
+      FPL_READ_LOW(head);
+    } catch (uint64_t e) {
+      FPL_READ_UNLOCK;
+      throw e;
+    }
+    FPL_READ_END;
+    return l_idx;
+  }
+
+  int64_t FilePersistLog::getEntries(const HLCStamp & from, const HLCStamp & to,
+    std::vector<const void *> & entries, std::vector<char> * buffer) noexcept(false) {
+    const unsigned __int128 kfrom = from.key();
+    const unsigned __int128 kto = to.key();
+    int64_t first, last;
+    const std::size_t base = entries.size();
+
+    FPL_READ_BEGIN;
+    int64_t head = __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_ACQUIRE);
+    int64_t tail = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE);
+    entries.resize(base);
+    try {
+      searchHlcRange(kfrom,kto,head,tail,first,last);
+      readEntries(first,last,entries,buffer);
+      FPL_READ_LOW(head);
+    } catch (uint64_t e) {
+      FPL_READ_UNLOCK;
+      throw e;
+    }
+    FPL_READ_END;
+    dbg_trace("{0} getEntries:{1} entries from {2}",this->m_sName,last-first,first);
+    return first;
+  }
+
+  int64_t FilePersistLog::getEntries(const __int128 & from, const __int128 & to,
+    std::vector<const void *> & entries, std::vector<char> * buffer) noexcept(false) {
+    int64_t first, last;
+    const std::size_t base = entries.size();
+
+    FPL_READ_BEGIN;
+    int64_t head = __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_ACQUIRE);
+    int64_t tail = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE);
+    entries.resize(base);
+    try {
+      searchRange<__int128>(
+        [&](const __int128 & ver) {
+          return searchVersion(ver,head,tail);
+        },
+        from,to,INVALID_VERSION,head,first,last);
+      readEntries(first,last,entries,buffer);
+      FPL_READ_LOW(head);
+    } catch (uint64_t e) {
+      FPL_READ_UNLOCK;
+      throw e;
+    }
+    FPL_READ_END;
+    dbg_trace("{0} getEntries:{1} entries from {2}",this->m_sName,last-first,first);
+    return first;
+  }
+
+  int64_t FilePersistLog::getEntriesByIndex(const int64_t & from, const int64_t & to,
+    std::vector<const void *> & entries, std::vector<char> * buffer) noexcept(false) {
+    int64_t first, last;
+    const std::size_t base = entries.size();
+
+    FPL_READ_BEGIN;
+    int64_t head = __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_ACQUIRE);
+    int64_t tail = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE);
+    entries.resize(base);
+    first = MAX(from,head);
+    last = MAX(first,MIN(to,tail));
+    try {
+      readEntries(first,last,entries,buffer);
+      FPL_READ_LOW(head);
+    } catch (uint64_t e) {
+      FPL_READ_UNLOCK;
+      throw e;
+    }
+    FPL_READ_END;
+    dbg_trace("{0} getEntriesByIndex:{1} entries from {2}",this->m_sName,last-first,first);
+    return first;
+  }
+
+  uint64_t FilePersistLog::getDataSize(const int64_t & idx) noexcept(false) {
+    uint64_t size;
 
-    return LOG_ENTRY_DATA(ple);
+    FPL_READ_BEGIN;
+    int64_t head = __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_ACQUIRE);
+    int64_t tail = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE);
+    const int64_t first = MAX(idx,head);
+    size = 0;
+    try {
+      if (first < tail) {
+        const uint64_t from = LOG_ENTRY_AT(first)->fields.ofst;
+        const uint64_t to = LOG_ENTRY_AT(tail - 1)->fields.ofst;
+        size = to + LOG_ENTRY_AT(tail - 1)->fields.dlen - from;
+        if (IS_SEGMENTED && DATA_SEG_OF(from) != DATA_SEG_OF(to)) {
+          // count the data segments in between, with the unused space at
+          // their ends.
+          size = this->m_dataSegs[DATA_SEG_OF(from) - this->m_iFirstDataSeg].size -
+            DATA_SEG_OFST(from) + DATA_SEG_OFST(to) + LOG_ENTRY_AT(tail - 1)->fields.dlen;
+          for (int64_t seg = DATA_SEG_OF(from) + 1; seg < DATA_SEG_OF(to); seg++) {
+            size += this->m_dataSegs[seg - this->m_iFirstDataSeg].size;
+          }
+        }
+        FPL_READ_LOW(first);
+      }
+    } catch (uint64_t e) {
+      FPL_READ_UNLOCK;
+      throw e;
+    }
+    FPL_READ_END;
+    return size;
+  }
+
+  uint32_t FilePersistLog::getEntryFormat() noexcept(false) {
+    return __atomic_load_n(&META_HEADER->fields.format,__ATOMIC_ACQUIRE);
+  }
+
+  void FilePersistLog::setEntryFormat(const uint32_t & format) noexcept(false) {
+    FPL_WRLOCK;
+    FPL_PERS_LOCK;
+    try {
+      // persist the format with the persisted head and tail, which do not
+      // refer to the entries appended since the last persist().
+      MetaHeader header = *META_HEADER_PERS;
+      header.fields.format = format;
+      this->persistMetaHeaderAtomically(header);
+      __atomic_store_n(&META_HEADER->fields.format,format,__ATOMIC_RELEASE);
+    } catch (...) {
+      FPL_PERS_UNLOCK;
+      FPL_UNLOCK;
+      throw;
+    }
+    FPL_PERS_UNLOCK;
+    FPL_UNLOCK;
   }
 
   // trim by index
@@ -476,30 +1616,504 @@ namespace ns_persistent{
       FPL_UNLOCK;
       return;
     }
-    META_HEADER->fields.head = idx + 1;
+    __atomic_store_n(&META_HEADER->fields.head,idx + 1,__ATOMIC_RELEASE);
+    if (this->m_pVerIndex != nullptr) {
+      this->m_pVerIndex->trim(idx + 1);
+    }
+    if (IS_SEGMENTED) {
+      try {
+        retireSegments();
+      } catch (uint64_t e) {
+        FPL_UNLOCK;
+        throw e;
+      }
+    }
     FPL_UNLOCK;
     dbg_trace("{0} trim at index: {1}...done",this->m_sName,idx);
   }
 
   void FilePersistLog::trim(const __int128 &ver) noexcept(false) {
     dbg_trace("{0} trim at version: {1}.{2}",this->m_sName,(int64_t)(ver>>64),(int64_t)ver);
-    this->trim<__int128>(ver,
-      [&](int64_t idx){return LOG_ENTRY_AT(idx)->fields.ver;});
+    if (this->m_pVerIndex != nullptr || this->m_pVerColumn != nullptr) {
+      // search with the index, then trim by index.
+      int64_t l_idx;
+      FPL_READ_BEGIN;
+      int64_t head = __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_ACQUIRE);
+      int64_t tail = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE);
+      try {
+        l_idx = searchVersion(ver,head,tail);
+        FPL_READ_LOW(head);
+      } catch (uint64_t e) {
+        FPL_READ_UNLOCK;
+        throw e;
+      }
+      FPL_READ_END;
+      if (l_idx != -1) {
+        this->trim(l_idx);
+      }
+    } else {
+      this->trim<__int128>(ver,
+        [&](int64_t idx){return LOG_ENTRY_AT(idx)->fields.ver;});
+    }
     dbg_trace("{0} trim at version: {1}.{2}...done",this->m_sName,(int64_t)(ver>>64),(int64_t)ver);
   }
 
-  void FilePersistLog::trim(const HLC & hlc) noexcept(false) {
+  void FilePersistLog::trim(const HLCStamp & hlc) noexcept(false) {
     dbg_trace("{0} trim at time: {1}.{2}",this->m_sName,hlc.m_rtc_us,hlc.m_logic);
-    this->trim<unsigned __int128>(
-      ((((const unsigned __int128)hlc.m_rtc_us)<<64) | hlc.m_logic),
-      [&](int64_t idx) {
-        return ((((const unsigned __int128)LOG_ENTRY_AT(idx)->fields.hlc_r)<<64) | 
-          LOG_ENTRY_AT(idx)->fields.hlc_l);
-      });
+    const unsigned __int128 key = hlc.key();
+    if (this->m_pHlcColumn != nullptr) {
+      // search the packed keys, then trim by index.
+      int64_t l_idx;
+      FPL_READ_BEGIN;
+      int64_t head = __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_ACQUIRE);
+      int64_t tail = __atomic_load_n(&META_HEADER->fields.tail,__ATOMIC_ACQUIRE);
+      try {
+        l_idx = searchHlc(key,head,tail);
+        FPL_READ_LOW(head);
+      } catch (uint64_t e) {
+        FPL_READ_UNLOCK;
+        throw e;
+      }
+      FPL_READ_END;
+      if (l_idx != -1) {
+        this->trim(l_idx);
+      }
+    } else {
+      this->trim<unsigned __int128>(key,
+        [&](int64_t idx) {
+          return LOG_ENTRY_AT(idx)->fields.hlc.key();
+        });
+    }
     dbg_trace("{0} trim at time: {1}.{2}...done",this->m_sName,hlc.m_rtc_us,hlc.m_logic);
   }
 
-  void FilePersistLog::persistMetaHeaderAtomically() noexcept(false) {
+  int64_t FilePersistLog::getRetainedHead() noexcept(true) {
+    // keep the entries after the persisted head as well, they are still
+    // referred by the meta file till the next persist().
+    int64_t head = META_HEADER->fields.head;
+    if (META_HEADER_PERS->fields.head >= 0 &&
+        META_HEADER_PERS->fields.head < META_HEADER_PERS->fields.tail) {
+      head = MIN(META_HEADER_PERS->fields.head,head);
+      if (!IS_SEGMENTED) {
+        // the older entries are overwritten in the ring buffer.
+        head = MAX(head,META_HEADER->fields.tail - (int64_t)MAX_LOG_ENTRY + 1);
+      }
+    }
+    return head;
+  }
+
+  bool FilePersistLog::fitsRing(const uint64_t & num, const uint64_t & size) noexcept(true) {
+    const int64_t head = getRetainedHead();
+    const int64_t tail = META_HEADER->fields.tail;
+    if (head < META_HEADER->fields.head && tail == META_HEADER->fields.head) {
+      // the data of an empty log starts over at offset 0.
+      return false;
+    }
+    const uint64_t used = (head == tail)? 0 :
+      NEXT_DATA_OFST - LOG_ENTRY_AT(head)->fields.ofst;
+    return (int64_t)MAX_LOG_ENTRY - 1 - (tail - head) >= (int64_t)num &&
+      MAX_DATA_SIZE - used >= size;
+  }
+
+  void FilePersistLog::persistHead() noexcept(false) {
+    FPL_PERS_LOCK;
+    try {
+      // the entries appended since the last persist() are not flushed yet,
+      // so the persisted tail stays.
+      MetaHeader header = *META_HEADER_PERS;
+      header.fields.head = MIN(META_HEADER->fields.head,header.fields.tail);
+      this->persistMetaHeaderAtomically(header);
+    } catch (...) {
+      FPL_PERS_UNLOCK;
+      throw;
+    }
+    FPL_PERS_UNLOCK;
+    dbg_trace("{0}:head {1} is persisted to reuse the space of the trimmed entries.",
+      this->m_sName,META_HEADER_PERS->fields.head);
+  }
+
+  uint64_t FilePersistLog::prepareAppend(const uint64_t & size, const uint64_t & num) noexcept(false) {
+    if (!IS_SEGMENTED) {
+      // grow the ring buffers on demand. The write lock is released while
+      // growing, so the space is checked again afterwards.
+      while (NUM_FREE_SLOTS < num || NUM_FREE_BYTES < size) {
+        if (this->m_bGrowing) {
+          // wait for the writer growing a ring buffer.
+          FPL_UNLOCK;
+          sched_yield();
+          FPL_WRLOCK;
+        } else if (NUM_FREE_SLOTS < num) {
+          growLog(num);
+        } else {
+          growData(size);
+        }
+      }
+      if (!fitsRing(num,size)) {
+        // reuse the space of the entries trimmed since the last persist().
+        persistHead();
+      }
+      return NEXT_DATA_OFST;
+    }
+    // create the log segment for the new entry on demand
+    const int64_t logSeg = LOG_SEG_OF(META_HEADER->fields.tail);
+    if (this->m_logSegs.empty() ||
+        logSeg >= this->m_iFirstLogSeg + (int64_t)this->m_logSegs.size()) {
+      createSegment(this->m_sLogFile,logSeg,
+        META_HEADER->fields.seg_entries*sizeof(LogEntry),
+        this->m_logSegs,this->m_iFirstLogSeg);
+    }
+    // the data goes to the last data segment if it fits. Otherwise, it goes to
+    // a new data segment.
+    uint64_t ofst = NEXT_DATA_OFST;
+    if (!this->m_dataSegs.empty()) {
+      DATA_AT(ofst); // make sure the last segment is mapped.
+      if (DATA_SEG_OFST(ofst) + size <= this->m_dataSegs.back().size) {
+        return ofst;
+      }
+      ofst = (uint64_t)(DATA_SEG_OF(ofst) + 1) << DATA_SEG_SHIFT;
+    }
+    createSegment(this->m_sDataFile,DATA_SEG_OF(ofst),
+      MAX(META_HEADER->fields.seg_size,ALIGN_UP_TO_PAGE(size)),
+      this->m_dataSegs,this->m_iFirstDataSeg);
+    return ofst;
+  }
+
+  void FilePersistLog::loadSegments() noexcept(false) {
+    const int64_t head = META_HEADER->fields.head;
+    const int64_t tail = META_HEADER->fields.tail;
+    int64_t lastLogSeg = -1, lastDataSeg = -1;
+    this->m_iFirstLogSeg = this->m_iFirstDataSeg = 0;
+    if (tail > 0) {
+      // the log segment and data segment of the last entry are always kept.
+      this->m_iFirstLogSeg = LOG_SEG_OF(MIN(head,tail - 1));
+      lastLogSeg = LOG_SEG_OF(tail - 1);
+      for (int64_t segno = this->m_iFirstLogSeg; segno <= lastLogSeg; segno ++) {
+        this->m_logSegs.push_back({nullptr,0});
+      }
+      this->m_iFirstDataSeg = DATA_SEG_OF(LOG_ENTRY_AT(MIN(head,tail - 1))->fields.ofst);
+      lastDataSeg = DATA_SEG_OF(LOG_ENTRY_AT(tail - 1)->fields.ofst);
+      for (int64_t segno = this->m_iFirstDataSeg; segno <= lastDataSeg; segno ++) {
+        this->m_dataSegs.push_back({nullptr,0});
+      }
+    }
+    // remove the segments left by trim() or append() before a crash.
+    removeStaleSegments(this->m_sLogFile,this->m_iFirstLogSeg,lastLogSeg);
+    removeStaleSegments(this->m_sDataFile,this->m_iFirstDataSeg,lastDataSeg);
+  }
+
+  void * FilePersistLog::mapSegment(const string & file, const int64_t & segno,
+    Segment & seg) noexcept(false) {
+    const string segFile = getSegmentFile(file,segno);
+    int fd = open(segFile.c_str(),O_RDWR);
+    if (fd == -1) {
+      throw PERSIST_EXP_OPEN_FILE(errno);
+    }
+    struct stat sb;
+    if (fstat(fd,&sb) != 0) {
+      int err = errno;
+      close(fd);
+      throw PERSIST_EXP_READ_FILE(err);
+    }
+    void * addr = mapShared(NULL,sb.st_size,fd);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      dbg_trace("{0}:map segment {1} failed.",this->m_sName,segFile);
+      throw PERSIST_EXP_MMAP_FILE(errno);
+    }
+    // a concurrent reader may have mapped it.
+    void * expected = nullptr;
+    __atomic_store_n(&seg.size,(uint64_t)sb.st_size,__ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&seg.addr,&expected,addr,false,
+        __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE)) {
+      munmap(addr,sb.st_size);
+      addr = expected;
+    }
+    dbg_trace("{0}:segment {1} mapped.",this->m_sName,segFile);
+    return addr;
+  }
+
+  void FilePersistLog::createSegment(const string & file, const int64_t & segno,
+    const uint64_t & size, std::deque<Segment> & segs, int64_t & firstSeg)
+    noexcept(false) {
+    const string segFile = getSegmentFile(file,segno);
+    // a stale segment may be left by a crash. Truncate it.
+    int fd = open(segFile.c_str(),O_RDWR|O_CREAT|O_TRUNC,S_IWUSR|S_IRUSR|S_IRGRP|S_IWGRP|S_IROTH);
+    if (fd == -1) {
+      throw PERSIST_EXP_CREATE_FILE(errno);
+    }
+    if (ftruncate(fd,size) != 0) {
+      int err = errno;
+      close(fd);
+      throw PERSIST_EXP_TRUNCATE_FILE(err);
+    }
+    void * addr = mapShared(NULL,size,fd);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      throw PERSIST_EXP_MMAP_FILE(errno);
+    }
+    if (segs.empty()) {
+      firstSeg = segno;
+    }
+    segs.push_back({addr,size});
+    this->m_bNewSegments = true;
+    dbg_trace("{0}:segment {1} created with {2} bytes.",this->m_sName,segFile,size);
+  }
+
+  bool FilePersistLog::hasRetiredSegments() noexcept(true) {
+    const int64_t head = getRetainedHead();
+    const int64_t tail = META_HEADER->fields.tail;
+    if (tail == 0) {
+      return false;
+    }
+    // the log segment of the last entry is always kept.
+    if (this->m_iFirstLogSeg < LOG_SEG_OF(MIN(head,tail - 1))) {
+      return true;
+    }
+    return this->m_iFirstDataSeg <
+      DATA_SEG_OF(LOG_ENTRY_AT(MIN(head,tail - 1))->fields.ofst);
+  }
+
+  void FilePersistLog::retireSegments() noexcept(false) {
+    const int64_t head = getRetainedHead();
+    const int64_t tail = META_HEADER->fields.tail;
+    if (tail == 0) {
+      return;
+    }
+    const int64_t logSeg = LOG_SEG_OF(MIN(head,tail - 1));
+    const int64_t dataSeg = DATA_SEG_OF(LOG_ENTRY_AT(MIN(head,tail - 1))->fields.ofst);
+    while (this->m_iFirstLogSeg < logSeg) {
+      retireMapping(this->m_logSegs.front());
+      if (unlink(getSegmentFile(this->m_sLogFile,this->m_iFirstLogSeg).c_str()) != 0) {
+        throw PERSIST_EXP_REMOVE_FILE(errno);
+      }
+      this->m_logSegs.pop_front();
+      this->m_iFirstLogSeg ++;
+    }
+    while (this->m_iFirstDataSeg < dataSeg) {
+      retireMapping(this->m_dataSegs.front());
+      if (unlink(getSegmentFile(this->m_sDataFile,this->m_iFirstDataSeg).c_str()) != 0) {
+        throw PERSIST_EXP_REMOVE_FILE(errno);
+      }
+      this->m_dataSegs.pop_front();
+      this->m_iFirstDataSeg ++;
+    }
+    dbg_trace("{0}:segments retired: first log segment={1}, first data segment={2}.",
+      this->m_sName,this->m_iFirstLogSeg,this->m_iFirstDataSeg);
+  }
+
+  void FilePersistLog::retireMapping(const Segment & seg) noexcept(false) {
+    if (seg.addr == nullptr) {
+      return;
+    }
+    // the readers of the trimmed entries see zeros, as they see stale data
+    // in a ring buffer, instead of faulting.
+    if (mmap(seg.addr,seg.size,PROT_READ,MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED|MAP_NORESERVE,
+          -1,0) == MAP_FAILED) {
+      throw PERSIST_EXP_MMAP_FILE(errno);
+    }
+    this->m_retiredSegs.push_back(seg);
+  }
+
+  void FilePersistLog::growLog(const uint64_t & num) noexcept(false) {
+    uint64_t newEntries = MAX_LOG_ENTRY;
+    while (newEntries - 1 - NUM_USED_SLOTS < num) {
+      if (newEntries == this->m_oConfig.log_entries_limit) {
+        // the other writers have taken the space while we were growing.
+        throw PERSIST_EXP_NOSPACE_LOG;
+      }
+      newEntries = MIN(newEntries<<1,this->m_oConfig.log_entries_limit);
+    }
+    dbg_info("{0} grow log from {1} to {2} entries.",this->m_sName,MAX_LOG_ENTRY,newEntries);
+    this->growRing(true,newEntries*sizeof(LogEntry));
+  }
+
+  void FilePersistLog::growData(const uint64_t & size) noexcept(false) {
+    uint64_t newSize = MAX_DATA_SIZE;
+    while (newSize - NUM_USED_BYTES < size) {
+      if (newSize == this->m_oConfig.data_size_limit) {
+        throw PERSIST_EXP_NOSPACE_DATA;
+      }
+      newSize = MIN(newSize<<1,this->m_oConfig.data_size_limit);
+    }
+    dbg_info("{0} grow data from {1} to {2} bytes.",this->m_sName,MAX_DATA_SIZE,newSize);
+    this->growRing(false,newSize);
+  }
+
+  void FilePersistLog::getRingRange(const bool & log, uint64_t & from, uint64_t & to)
+  noexcept(true) {
+    const int64_t head = this->getRetainedHead();
+    if (log) {
+      from = head*sizeof(LogEntry);
+      to = META_HEADER->fields.tail*sizeof(LogEntry);
+      return;
+    }
+    to = NEXT_DATA_OFST;
+    if (head == META_HEADER->fields.tail) {
+      from = to;
+    } else {
+      // the data before the last MAX_DATA_SIZE bytes are overwritten.
+      from = LOG_ENTRY_AT(head)->fields.ofst;
+      if (to > MAX_DATA_SIZE) {
+        from = MAX(from,to - MAX_DATA_SIZE);
+      }
+    }
+  }
+
+  void FilePersistLog::growRing(const bool & log, const uint64_t & newSize)
+  noexcept(false) {
+    const string & file = log ? this->m_sLogFile : this->m_sDataFile;
+    int & fd = log ? this->m_iLogFileDesc : this->m_iDataFileDesc;
+    RingBuffer * & ring = log ? this->m_pLogRing : this->m_pDataRing;
+    // STEP 1: create the new ring buffer file
+    const string swpFile = file + "." + SWAP_FILE_SUFFIX;
+    int nfd = -1;
+    if (this->m_pDirectWriter != nullptr) {
+      nfd = openDirectFile(swpFile,O_RDWR|O_CREAT|O_TRUNC);
+    } else {
+      nfd = open(swpFile.c_str(),O_RDWR|O_CREAT|O_TRUNC,S_IWUSR|S_IRUSR|S_IRGRP|S_IWGRP|S_IROTH);
+      if (nfd == -1) {
+        throw PERSIST_EXP_OPEN_FILE(errno);
+      }
+    }
+    void * nring = MAP_FAILED;
+    RingBuffer tmp{nullptr,newSize};
+    // copy [from,to) of the ring buffer to the new one, and flush it.
+    auto copyRange = [&](const uint64_t & from, const uint64_t & to) {
+      if (from >= to) {
+        return;
+      }
+      memcpy((void*)((uint64_t)nring + from%newSize),
+        (void*)((uint64_t)ring->addr + from%ring->size), to - from);
+      if (this->m_pDirectWriter != nullptr) {
+        // the rest of the new file is zero.
+        writeRing(nfd,&tmp,from,to);
+        this->m_pDirectWriter->sync(nfd);
+        this->m_pDirectWriter->wait();
+      } else {
+        // The double mapping makes the range contiguous.
+        flushRange((void*)((uint64_t)nring + from%newSize),to - from);
+        drainFlushes();
+      }
+    };
+    bool bLocked = true;
+    this->m_bGrowing = true;
+    try {
+      if (ftruncate(nfd,newSize) != 0) {
+        throw PERSIST_EXP_TRUNCATE_FILE(errno);
+      }
+      nring = (this->m_pDirectWriter != nullptr) ?
+        loadRingBuffer(-1,newSize,this->m_oConfig.startup == SM_HUGEPAGE) :
+        mapRingBuffer(nfd,newSize,this->m_bPmem,&this->m_bDax);
+      tmp.addr = nring;
+      // STEP 2: copy the live range with the read lock. The writers wait,
+      // and the other writers do not grow the ring buffer with m_bGrowing.
+      FPL_UNLOCK;
+      bLocked = false;
+      FPL_RDLOCK;
+      bLocked = true;
+      uint64_t from, to;
+      getRingRange(log,from,to);
+      copyRange(from,to);
+      FPL_UNLOCK;
+      bLocked = false;
+      FPL_WRLOCK;
+      bLocked = true;
+      // STEP 3: copy the entries appended in between. The trimmed entries
+      // are not copied again.
+      uint64_t nfrom, nto;
+      getRingRange(log,nfrom,nto);
+      copyRange(MAX(nfrom,to),nto);
+      // STEP 4: atomically replace the old file
+      if (rename(swpFile.c_str(),file.c_str()) != 0) {
+        throw PERSIST_EXP_RENAME_FILE(errno);
+      }
+    } catch (...) {
+      if (!bLocked) {
+        // the caller unlocks.
+        FPL_WRLOCK;
+      }
+      this->m_bGrowing = false;
+      if (nring != MAP_FAILED) {
+        munmap(nring,newSize<<1);
+      }
+      close(nfd);
+      unlink(swpFile.c_str());
+      throw;
+    }
+    // STEP 5: switch to the new ring buffer. A lock-free reader may still
+    // use the old one, which has all the entries before the switch.
+    this->m_retiredRings.push_back(ring);
+    close(fd);
+    fd = nfd;
+    __atomic_store_n(&ring,new RingBuffer{nring,newSize},__ATOMIC_RELEASE);
+    this->m_bGrowing = false;
+  }
+
+  void FilePersistLog::writeRing(const int & fd, const RingBuffer * ring,
+    const uint64_t & from, const uint64_t & to) noexcept(true) {
+    uint64_t start = from - from%PAGE_SIZE;
+    const uint64_t end = ALIGN_UP_TO_PAGE(to);
+    if (end - start > ring->size) {
+      start = end - ring->size;
+    }
+    // a range crossing the end of the ring goes in two writes.
+    while (start < end) {
+      const uint64_t pos = start % ring->size;
+      const uint64_t len = MIN(end - start,ring->size - pos);
+      this->m_pDirectWriter->write(fd,(void*)((uint64_t)ring->addr + pos),len,pos);
+      start += len;
+    }
+  }
+
+  void FilePersistLog::persistMetaHeaderAtomically(const MetaHeader & header) noexcept(false) {
+    if (this->m_metaFormat == MF_DUAL_SLOT) {
+      // overwrite the older slot in place. The current slot stays intact
+      // till the new one is synced, and a torn slot fails the crc check.
+      const uint64_t seqno = this->m_iMetaSeqno + 1;
+      MetaSlot slot;
+      bzero((void*)&slot,sizeof(MetaSlot));
+      slot.fields.magic = META_SLOT_MAGIC;
+      slot.fields.seqno = seqno;
+      slot.fields.header = header;
+      slot.fields.crc = crc32c(0,&slot,sizeof(MetaSlot));
+      MetaSlot * pslot = META_SLOT_AT(seqno);
+      memcpy((void*)pslot,(void*)&slot,sizeof(MetaSlot));
+      flushRange(pslot,sizeof(MetaSlot));
+      drainFlushes();
+      this->m_iMetaSeqno = seqno;
+      *META_HEADER_PERS = header;
+      return;
+    }
+    if (this->m_metaFormat == MF_PMEM) {
+      MetaSlot * pslot = META_SLOT_AT(0);
+      if (pslot->fields.magic != META_SLOT_MAGIC) {
+        // a new log: the magic validates the slot after the rest is durable.
+        pslot->fields.header = header;
+        flushRange(pslot,sizeof(MetaSlot));
+        drainFlushes();
+        pslot->fields.magic = META_SLOT_MAGIC;
+        flushRange(&pslot->fields.magic,sizeof(uint64_t));
+      } else {
+        if (pslot->fields.header.fields.format != header.fields.format) {
+          __atomic_store_n(&pslot->fields.header.fields.format,header.fields.format,__ATOMIC_RELAXED);
+          flushRange(&pslot->fields.header.fields.format,sizeof(uint32_t));
+          drainFlushes();
+        }
+        // The tail goes first so that [head,tail) is always a range of
+        // durable entries: the head only moves forward, and the entries
+        // before the new head are kept till the new head is durable. Each
+        // store is 8 bytes aligned, which is failure-atomic.
+        __atomic_store_n(&pslot->fields.header.fields.tail,header.fields.tail,__ATOMIC_RELAXED);
+        flushRange(&pslot->fields.header.fields.tail,sizeof(int64_t));
+        drainFlushes();
+        __atomic_store_n(&pslot->fields.header.fields.head,header.fields.head,__ATOMIC_RELAXED);
+        flushRange(&pslot->fields.header.fields.head,sizeof(int64_t));
+      }
+      drainFlushes();
+      *META_HEADER_PERS = header;
+      return;
+    }
+
     // STEP 1: get file name
     const string swpFile = this->m_sMetaFile + "." + SWAP_FILE_SUFFIX;
    
@@ -508,7 +2122,7 @@ namespace ns_persistent{
     if (fd == -1) {
       throw PERSIST_EXP_OPEN_FILE(errno);
     }
-    ssize_t nWrite = write(fd,META_HEADER,sizeof(MetaHeader));
+    ssize_t nWrite = write(fd,&header,sizeof(MetaHeader));
     if (nWrite != sizeof(MetaHeader)) {
       throw PERSIST_EXP_WRITE_FILE(errno);
     }
@@ -520,7 +2134,47 @@ namespace ns_persistent{
     }
 
     // STEP 4: update the persisted header in memory
-    *META_HEADER_PERS = *META_HEADER;
+    *META_HEADER_PERS = header;
+  }
+
+  void FilePersistLog::mapMetaFile() noexcept(false) {
+    int fd = open(this->m_sMetaFile.c_str(),O_RDWR);
+    if (fd == -1) {
+      throw PERSIST_EXP_OPEN_FILE(errno);
+    }
+    if (this->m_metaFormat == MF_PMEM) {
+      this->m_pMeta = mapShared(NULL,META_SLOT_SIZE,fd);
+    } else {
+      this->m_pMeta = mmap(NULL,META_DUAL_SLOT_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    }
+    close(fd);
+    if (this->m_pMeta == MAP_FAILED) {
+      throw PERSIST_EXP_MMAP_FILE(errno);
+    }
+  }
+
+  void FilePersistLog::loadMetaSlot() noexcept(false) {
+    const MetaSlot * pcurr = nullptr;
+    for (uint64_t i = 0; i < 2; i++) {
+      MetaSlot slot = *META_SLOT_AT(i);
+      const uint32_t crc = slot.fields.crc;
+      slot.fields.crc = 0;
+      if (slot.fields.magic != META_SLOT_MAGIC ||
+          slot.fields.seqno % 2 != i ||
+          crc32c(0,&slot,sizeof(MetaSlot)) != crc) {
+        dbg_warn("{0}:meta slot {1} is invalid.",this->m_sName,i);
+        continue;
+      }
+      if (pcurr == nullptr || slot.fields.seqno > pcurr->fields.seqno) {
+        pcurr = META_SLOT_AT(i);
+      }
+    }
+    if (pcurr == nullptr) {
+      throw PERSIST_EXP_CORRUPTED_META;
+    }
+    this->m_iMetaSeqno = pcurr->fields.seqno;
+    *META_HEADER_PERS = pcurr->fields.header;
+    dbg_trace("{0}:meta slot {1} loaded.",this->m_sName,this->m_iMetaSeqno);
   }
 
   //////////////////////////
@@ -569,18 +2223,159 @@ namespace ns_persistent{
     return bCreate;
   }
 */
-  bool checkOrCreateMetaFile(const string & metaFile)
+  bool checkOrCreateMetaFile(const string & metaFile, MetaFormat & format)
   noexcept(false) {
-    return checkOrCreateFileWithSize(metaFile,META_SIZE);
+    struct stat sb;
+    if (stat(metaFile.c_str(),&sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+      // the format is told by the size of the meta file.
+      format = (sb.st_size == META_DUAL_SLOT_SIZE)? MF_DUAL_SLOT :
+        (sb.st_size == META_SLOT_SIZE)? MF_PMEM : MF_SWAP;
+      return false;
+    }
+    return checkOrCreateFileWithSize(metaFile,META_FILE_SIZE(format));
   }
 
-  bool checkOrCreateLogFile(const string & logFile)
+  bool checkOrCreateRingFile(const string & file, uint64_t & size)
   noexcept(false) {
-    return checkOrCreateFileWithSize(logFile,MAX_LOG_SIZE);
+    struct stat sb;
+    if (stat(file.c_str(),&sb) == 0 && S_ISREG(sb.st_mode) && sb.st_size > 0) {
+      // the layout of the ring buffer depends on its size, keep it.
+      size = sb.st_size;
+      return false;
+    }
+    return checkOrCreateFileWithSize(file,size);
+  }
+
+  void * mapRingBuffer(const int & fd, const uint64_t & size,
+    const bool & pmem, bool * dax)
+  noexcept(false) {
+    //// we map the log entry and data twice to faciliate the search and data
+    //// retrieving then the data is rewinding across the buffer end as follow:
+    //// [1][2][3][4][5][6][1][2][3][4][5][6]
+    void * ring = mmap(NULL,size<<1,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (ring == MAP_FAILED) {
+      dbg_trace("reserve map space for ringbuffer failed.");
+      throw PERSIST_EXP_MMAP_FILE(errno);
+    }
+    auto mapHalf = [&](void * addr) {
+      if (!pmem) {
+        return mmap(addr,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,fd,0);
+      }
+      bool onDax = false;
+      void * ret = pmemMap(addr,size,fd,0,onDax);
+      if (ret != MAP_FAILED && !onDax && dax != nullptr) {
+        *dax = false;
+      }
+      return ret;
+    };
+    if (mapHalf(ring) == MAP_FAILED) {
+      dbg_trace("map ringbuffer space for the first half failed. Is the size of ringbuffer aligned to page?");
+      int err = errno;
+      munmap(ring,size<<1);
+      throw PERSIST_EXP_MMAP_FILE(err);
+    }
+    if (mapHalf((void*)((uint64_t)ring+size)) == MAP_FAILED) {
+      dbg_trace("map ringbuffer space for the second half failed. Is the size of ringbuffer aligned to page?");
+      int err = errno;
+      munmap(ring,size<<1);
+      throw PERSIST_EXP_MMAP_FILE(err);
+    }
+    return ring;
+  }
+
+  int openDirectFile(const string & file, const int & flags)
+  noexcept(false) {
+    const mode_t mode = S_IWUSR|S_IRUSR|S_IRGRP|S_IWGRP|S_IROTH;
+    int fd = open(file.c_str(),flags|O_DIRECT,mode);
+    if (fd == -1 && errno == EINVAL) {
+      dbg_warn("{0} does not support O_DIRECT, falling back to buffered I/O.",file);
+      fd = open(file.c_str(),flags,mode);
+    }
+    if (fd == -1) {
+      throw PERSIST_EXP_OPEN_FILE(errno);
+    }
+    return fd;
   }
 
-  bool checkOrCreateDataFile(const string & dataFile)
+  void * loadRingBuffer(const int & fd, const uint64_t & size, const bool & huge)
   noexcept(false) {
-    return checkOrCreateFileWithSize(dataFile,MAX_DATA_SIZE);
+    //// the anonymous memory is double mapped as the files are.
+    int mfd = memfd_create("plog",MFD_CLOEXEC);
+    if (mfd == -1) {
+      throw PERSIST_EXP_MMAP_FILE(errno);
+    }
+    void * ring = MAP_FAILED;
+    try {
+      if (ftruncate(mfd,size) != 0) {
+        throw PERSIST_EXP_TRUNCATE_FILE(errno);
+      }
+      ring = mapRingBuffer(mfd,size);
+      if (huge && madvise(ring,size<<1,MADV_HUGEPAGE) != 0) {
+        dbg_trace("huge pages are not available: {0}.",strerror(errno));
+      }
+      for (uint64_t done = 0; fd != -1 && done < size;) {
+        ssize_t ret = pread(fd,(void*)((uint64_t)ring + done),size - done,done);
+        if (ret < 0 && errno == EINTR) {
+          continue;
+        }
+        if (ret <= 0) {
+          throw PERSIST_EXP_READ_FILE(ret < 0 ? errno : EIO);
+        }
+        done += ret;
+      }
+    } catch (uint64_t e) {
+      if (ring != MAP_FAILED) {
+        munmap(ring,size<<1);
+      }
+      close(mfd);
+      throw e;
+    }
+    close(mfd);
+    return ring;
+  }
+
+  void removeStaleSegments(const string & file, const int64_t & first,
+    const int64_t & last) noexcept(false) {
+    const size_t pos = file.rfind('/');
+    const string dir = file.substr(0,pos);
+    const string prefix = file.substr(pos + 1) + ".";
+    DIR * pdir = opendir(dir.c_str());
+    if (pdir == NULL) {
+      throw PERSIST_EXP_OPEN_FILE(errno);
+    }
+    struct dirent * pent;
+    while ((pent = readdir(pdir)) != NULL) {
+      if (strncmp(pent->d_name,prefix.c_str(),prefix.size()) != 0) {
+        continue;
+      }
+      const char * pnum = pent->d_name + prefix.size();
+      char * pend;
+      int64_t segno = strtoll(pnum,&pend,10);
+      if (*pnum == '\0' || *pend != '\0' || (first <= segno && segno <= last)) {
+        continue;
+      }
+      dbg_trace("remove stale segment {0}{1}.",prefix,segno);
+      unlink((dir + "/" + pent->d_name).c_str());
+    }
+    closedir(pdir);
+  }
+
+  PersistLogConfig alignConfig(const PersistLogConfig & config)
+  noexcept(true) {
+    PersistLogConfig aligned = config;
+    aligned.log_entries = ALIGN_UP_TO_PAGE(MAX(config.log_entries,2UL)*sizeof(LogEntry))/sizeof(LogEntry);
+    aligned.log_entries_limit = MAX(aligned.log_entries,
+      ALIGN_UP_TO_PAGE(config.log_entries_limit*sizeof(LogEntry))/sizeof(LogEntry));
+    aligned.data_size = ALIGN_UP_TO_PAGE(MAX(config.data_size,1UL));
+    aligned.data_size_limit = MAX(aligned.data_size,ALIGN_UP_TO_PAGE(config.data_size_limit));
+    aligned.segment_log_entries = ALIGN_UP_TO_PAGE(MAX(config.segment_log_entries,1UL)*sizeof(LogEntry))/sizeof(LogEntry);
+    aligned.segment_data_size = ALIGN_UP_TO_PAGE(MIN(MAX(config.segment_data_size,1UL),DATA_SEG_MAX_SIZE));
+    return aligned;
+  }
+
+  uint64_t nowNs() noexcept(true) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
   }
 }
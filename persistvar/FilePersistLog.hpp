@@ -3,8 +3,16 @@
 
 #include <pthread.h>
 #include <string>
+#include <vector>
+#include <deque>
+#include <utility>
 #include "util.hpp"
 #include "PersistLog.hpp"
+#include "VersionIndex.hpp"
+#include "KeyColumn.hpp"
+#include "Compress.hpp"
+#include "DirectWriter.hpp"
+#include "Pmem.hpp"
 
 namespace ns_persistent {
 
@@ -22,6 +30,11 @@ namespace ns_persistent {
       int64_t tail;     // the tail index
       // uint64_t d_head;  // the data head offset
       // uint64_t d_tail;  // the data tail offset
+      uint32_t layout;  // LL_RING(0) or LL_SEGMENT
+      uint32_t format;  // the format of the entries, see
+                        // PersistLog::getEntryFormat()
+      uint64_t seg_entries; // number of log entries in a segment
+      uint64_t seg_size;    // size of a data segment
     } fields;
     uint8_t bytes[256];
     bool operator == (const union meta_header & other) {
@@ -30,51 +43,83 @@ namespace ns_persistent {
     };
   } MetaHeader;
 
+  // a header slot in a MF_DUAL_SLOT meta file. The meta file has two slots,
+  // which are written alternately. A slot is valid if the magic and the crc
+  // match; the valid slot with the larger seqno is the current one.
+  // A MF_PMEM meta file has one slot, which is valid if the magic matches.
+  // The seqno and crc are not used.
+  typedef union meta_slot {
+    struct {
+      uint64_t magic;   // META_SLOT_MAGIC
+      uint64_t seqno;   // increased by every write
+      uint32_t crc;     // crc32c of the slot with crc set to 0
+      uint32_t reserved;
+      MetaHeader header;
+    } fields;
+    uint8_t bytes[512];
+  } MetaSlot;
+
   // log entry format
   typedef union log_entry {
     struct {
       __int128 ver;      // version of the data
       uint64_t dlen;    // length of the data
       uint64_t ofst;    // offset of the data in the memory buffer
-      uint64_t hlc_r;   // realtime component of hlc
-      uint64_t hlc_l;   // logic component of hlc
+      HLCStamp hlc;     // hlc clock of the data
+      uint32_t ulen;    // length of the data before compression, 0 if the
+                        // data is not compressed
+      uint32_t crc;     // checksum of the entry before crc and the data, 0
+                        // if the entry is not checksummed
     } fields;
     uint8_t bytes[64];
   } LogEntry;
 
-  // TODO: make this hard-wired number configurable.
-  // Currently, we allow 16383(2^14-1) log entries and
-  // 16M data size.
-  // #define MAX_LOG_ENTRY         (1UL<<14)
-  #define MAX_LOG_ENTRY         (1UL<<6)
-  #define MAX_LOG_SIZE          (sizeof(LogEntry)*MAX_LOG_ENTRY)
-  // #define MAX_DATA_SIZE         (1UL<<26)
-  #define MAX_DATA_SIZE         (1UL<<12)
   #define META_SIZE             (sizeof(MetaHeader))
+  #define META_SLOT_MAGIC       (0x544f4c5341544d46ULL) // "FMTASLOT"
+  // a slot takes a block so that writing it does not touch the other slot.
+  #define META_SLOT_SIZE        (4096UL)
+  #define META_DUAL_SLOT_SIZE   (META_SLOT_SIZE*2)
+  #define META_FILE_SIZE(format) \
+    ((format) == MF_DUAL_SLOT ? META_DUAL_SLOT_SIZE : \
+     (format) == MF_PMEM ? META_SLOT_SIZE : META_SIZE)
+  #define META_SLOT_AT(seqno)   \
+    ((MetaSlot*)((uint64_t)this->m_pMeta + ((seqno)%2)*META_SLOT_SIZE))
 
   // helpers:
   ///// READ or WRITE LOCK on LOG REQUIRED to use the following MACROs!!!!
+  // The capacities of the log and data ring buffers are decided at runtime.
+  // They start from the sizes in PersistLogConfig and grow on demand.
+  #define LOG_RING              (__atomic_load_n(&this->m_pLogRing,__ATOMIC_ACQUIRE))
+  #define DATA_RING             (__atomic_load_n(&this->m_pDataRing,__ATOMIC_ACQUIRE))
+  #define MAX_LOG_ENTRY         (MAX_LOG_SIZE/sizeof(LogEntry))
+  #define MAX_LOG_SIZE          (LOG_RING->size)
+  #define MAX_DATA_SIZE         (DATA_RING->size)
   #define META_HEADER           ((MetaHeader*)(&(this->m_currMetaHeader)))
   #define META_HEADER_PERS      ((MetaHeader*)(&(this->m_persMetaHeader)))
-  #define LOG_ENTRY_ARRAY       ((LogEntry*)(this->m_pLog))
 
   #define NUM_USED_SLOTS        (META_HEADER->fields.tail - META_HEADER->fields.head)
   // #define NUM_USED_SLOTS_PERS   (META_HEADER_PERS->tail - META_HEADER_PERS->head)
   #define NUM_FREE_SLOTS        (MAX_LOG_ENTRY - 1 - NUM_USED_SLOTS)
   // #define NUM_FREE_SLOTS_PERS   (MAX_LOG_ENTRY - 1 - NUM_USERD_SLOTS_PERS)
 
-  #define LOG_ENTRY_AT(idx)     (LOG_ENTRY_ARRAY + (int)((idx)%MAX_LOG_ENTRY))
+  #define IS_SEGMENTED          (META_HEADER->fields.layout == LL_SEGMENT)
+  #define LOG_ENTRY_AT(idx)     (IS_SEGMENTED ? this->segLogEntryAt(idx) : \
+    this->ringLogEntryAt(idx))
   #define NEXT_LOG_ENTRY        LOG_ENTRY_AT(META_HEADER->fields.tail)
   #define NEXT_LOG_ENTRY_PERS   LOG_ENTRY_AT( \
     MIN(META_HEADER_PERS->fields.tail,META_HEADER->fields.head))
   #define CURR_LOG_IDX        ((NUM_USED_SLOTS == 0)? -1 : META_HEADER->fields.tail - 1)
-  #define LOG_ENTRY_DATA(e)     ((void *)((uint8_t *)this->m_pData + \
-    (e)->fields.ofst%MAX_DATA_SIZE))
+  #define DATA_AT(ofst)         (IS_SEGMENTED ? this->segDataAt(ofst) : \
+    this->ringDataAt(ofst))
+  #define LOG_ENTRY_DATA(e)     DATA_AT((e)->fields.ofst)
 
-  #define NEXT_DATA_OFST        ((CURR_LOG_IDX == -1)? 0 : \
-    (LOG_ENTRY_AT(CURR_LOG_IDX)->fields.ofst + \
-     LOG_ENTRY_AT(CURR_LOG_IDX)->fields.dlen))
-  #define NEXT_DATA             ((void *)((uint64_t)this->m_pData + NEXT_DATA_OFST%MAX_DATA_SIZE))
+  // In a segmented log, the data of the last entry is kept even after it is
+  // trimmed so that the data offset grows monotonically.
+  #define LAST_LOG_IDX          (IS_SEGMENTED ? META_HEADER->fields.tail - 1 : CURR_LOG_IDX)
+  #define NEXT_DATA_OFST        ((LAST_LOG_IDX == -1)? 0 : \
+    (LOG_ENTRY_AT(LAST_LOG_IDX)->fields.ofst + \
+     LOG_ENTRY_AT(LAST_LOG_IDX)->fields.dlen))
+  #define NEXT_DATA             DATA_AT(NEXT_DATA_OFST)
   #define NEXT_DATA_PERS        ((NEXT_LOG_ENTRY > NEXT_LOG_ENTRY_PERS) ? \
     LOG_ENTRY_DATA(NEXT_LOG_ENTRY_PERS) : NULL)
 
@@ -84,8 +129,41 @@ namespace ns_persistent {
       LOG_ENTRY_AT(META_HEADER->fields.head)->fields.ofst ))
   #define NUM_FREE_BYTES        (MAX_DATA_SIZE - NUM_USED_BYTES)
 
+  // In a segmented log, the offset of data is composed of the segment number
+  // and the offset inside of the segment. An entry never crosses segments.
+  #define DATA_SEG_SHIFT        (40)
+  #define DATA_SEG_MAX_SIZE     (1ULL<<(DATA_SEG_SHIFT-1))
+  #define DATA_SEG_OF(ofst)     ((int64_t)((ofst)>>DATA_SEG_SHIFT))
+  #define DATA_SEG_OFST(ofst)   ((ofst)&((1ULL<<DATA_SEG_SHIFT)-1))
+  #define LOG_SEG_OF(idx)       ((int64_t)((idx)/(int64_t)META_HEADER->fields.seg_entries))
+
   #define PAGE_SIZE             (getpagesize())
   #define ALIGN_TO_PAGE(x)      ((void *)(((uint64_t)(x))-((uint64_t)(x))%PAGE_SIZE))
+  #define ALIGN_UP_TO_PAGE(x)   ((((uint64_t)(x))+PAGE_SIZE-1)/PAGE_SIZE*PAGE_SIZE)
+
+  // the statistics of the crash recovery in load()
+  typedef struct recovery_stats {
+    uint64_t entries_scanned;   // number of log entries verified
+    uint64_t bytes_scanned;     // bytes of log entries and data verified
+    int64_t entries_recovered;  // entries after the persisted tail recovered
+    int64_t entries_dropped;    // persisted entries dropped after a torn one
+    uint64_t time_us;           // time spent on the recovery
+  } RecoveryStats;
+
+  // the statistics of the startup of a log, in microseconds from the start
+  // of the constructor. A statistic is 0 till it is known.
+  typedef struct startup_stats {
+    uint64_t load_us;         // the log is loaded and ready to read
+    uint64_t first_read_us;   // the first entry is read
+    uint64_t full_speed_us;   // the tail is faulted in by SM_PREFAULT
+    uint64_t prefault_bytes;  // bytes of log entries and data faulted in
+  } StartupStats;
+
+  // the number of entries faulted in by the prefault thread at a time
+  #define PREFAULT_CHUNK        (1024)
+
+  // the least number of entries verified by a recovery thread
+  #define RECOVERY_MIN_CHUNK    (1024)
 
   // declaration for binary search util. see cpp file for comments.
   template<typename TKey,typename KeyGetter>
@@ -94,10 +172,18 @@ namespace ns_persistent {
   // FilePersistLog is the default persist Log
   class FilePersistLog : public PersistLog {
   protected:
+    // the log configuration, with sizes aligned to pages
+    const PersistLogConfig m_oConfig;
     // the current meta header
     MetaHeader m_currMetaHeader;
     // the persisted meta header
     MetaHeader m_persMetaHeader;
+    // the format of the meta file
+    MetaFormat m_metaFormat;
+    // memory mapped meta file, for MF_DUAL_SLOT and MF_PMEM
+    void * m_pMeta;
+    // the seqno of the current slot, for MF_DUAL_SLOT
+    uint64_t m_iMetaSeqno;
    // path of the data files
     const string m_sDataPath;
     // full meta file name
@@ -107,19 +193,100 @@ namespace ns_persistent {
     // full data file name
     const string m_sDataFile;
 
-    // the log file descriptor
+    // the log file descriptor. In the direct I/O mode, the log and data files
+    // are opened with O_DIRECT.
     int m_iLogFileDesc;
     // the data file descriptor
     int m_iDataFileDesc;
 
+    // a mapped ring buffer. Growing a ring buffer replaces it instead of
+    // changing it so that a reader always sees a matching address and size.
+    typedef struct ring_buffer {
+      void * addr;
+      uint64_t size;
+    } RingBuffer;
     // memory mapped Log RingBuffer
-    void * m_pLog;
+    RingBuffer * m_pLogRing;
     // memory mapped Data RingBuffer
-    void * m_pData;
+    RingBuffer * m_pDataRing;
+    // the ring buffers replaced by growing. They are kept till the log is
+    // destroyed because readers may still hold pointers to them.
+    std::vector<RingBuffer *> m_retiredRings;
+    // if a ring buffer is being grown. growRing() copies the live range
+    // without the write lock, and the other writers do not grow the ring
+    // buffers till it is done.
+    bool m_bGrowing;
+
+    // a segment file. It is mapped on demand, addr is nullptr till then.
+    typedef struct segment {
+      void * addr;
+      uint64_t size;
+    } Segment;
+    // the log segments, starting from segment m_iFirstLogSeg
+    std::deque<Segment> m_logSegs;
+    int64_t m_iFirstLogSeg;
+    // the data segments, starting from segment m_iFirstDataSeg
+    std::deque<Segment> m_dataSegs;
+    int64_t m_iFirstDataSeg;
+    // the mappings of the retired segments. The files are deleted, but the
+    // addresses are kept till the log is destroyed because readers may still
+    // hold pointers to them, see retireSegments().
+    std::vector<Segment> m_retiredSegs;
+    // if segments are created since the last persist()
+    bool m_bNewSegments;
     // read/write lock
     pthread_rwlock_t m_rwlock;
     // persistent lock
     pthread_mutex_t m_perslock;
+    // group commit: the callers of persist() take increasing tickets and
+    // wait till the flusher thread has served their tickets.
+    pthread_t m_gcThread;
+    bool m_bGcThread;
+    pthread_mutex_t m_gclock;
+    // signals the flusher about new tickets
+    pthread_cond_t m_gcReqCond;
+    // signals the callers about served tickets
+    pthread_cond_t m_gcDoneCond;
+    // the last ticket issued
+    int64_t m_iGcTicket;
+    // the last ticket served
+    int64_t m_iGcDone;
+    // the last ticket served by a failed flush
+    int64_t m_iGcFailed;
+    // the latest version persisted by the flusher
+    __int128 m_gcVer;
+    // tells the flusher to quit
+    bool m_bGcStop;
+    // the version index, nullptr if it is disabled
+    VersionIndex * m_pVerIndex;
+    // the packed versions and HLCs of the entries, nullptr if they are disabled
+    KeyColumn<__int128> * m_pVerColumn;
+    KeyColumn<unsigned __int128> * m_pHlcColumn;
+    // the space reserved by reserve() for the next entry
+    bool m_bReserved;
+    uint64_t m_iReservedOfst;
+    uint64_t m_iReservedSize;
+    // Single-writer mode: append() and reserve() take no lock but publish the tail
+    // with a release store. Readers take no lock either; they validate what
+    // they read against the head instead. It applies to LL_RING logs only.
+    bool m_bSingleWriter;
+    // the writer of the direct I/O mode, nullptr if it is disabled. It is
+    // used with FPL_PERS_LOCK or FPL_WRLOCK.
+    DirectWriter * m_pDirectWriter;
+    // Persistent memory mode: the files are mapped by pmemMap() and flushed
+    // by cache lines. m_bDax is cleared once a file is found not on DAX.
+    bool m_bPmem;
+    bool m_bDax;
+    // the statistics of the recovery in load()
+    RecoveryStats m_oRecoveryStats;
+    // the statistics of the startup, and when the constructor started
+    StartupStats m_oStartupStats;
+    uint64_t m_iStartNs;
+    bool m_bFirstRead;
+    // the prefault thread for SM_PREFAULT
+    pthread_t m_pfThread;
+    bool m_bPfThread;
+    bool m_bPfStop;
     // lock macro
     #define FPL_WRLOCK \
     do { \
@@ -161,50 +328,375 @@ namespace ns_persistent {
       dbg_trace("PERS_UNLOCK"); \
     } while (0)
 
+    // The lock of readers. In the single-writer mode, a reader loops till the
+    // entries it read are still in the log after reading, i.e., the head
+    // has not passed the lowest index it read.
+    #define FPL_READ_BEGIN \
+    int64_t __read_low; \
+    do { \
+      __read_low = INT64_MAX; \
+      if (!this->m_bSingleWriter) { \
+        FPL_RDLOCK; \
+      }
+
+    #define FPL_READ_UNLOCK \
+    do { \
+      if (!this->m_bSingleWriter) { \
+        FPL_UNLOCK; \
+      } \
+    } while (0)
+
+    #define FPL_READ_END \
+      FPL_READ_UNLOCK; \
+    } while (this->m_bSingleWriter && !this->validateRead(__read_low))
+
+    // record the lowest index read between FPL_READ_BEGIN and FPL_READ_END
+    #define FPL_READ_LOW(idx) (__read_low = MIN(__read_low,(int64_t)(idx)))
+
+    #define FPL_GC_LOCK \
+    do { \
+      if (pthread_mutex_lock(&this->m_gclock) != 0) { \
+        throw PERSIST_EXP_MUTEX_LOCK(errno); \
+      } \
+    } while (0)
+
+    #define FPL_GC_UNLOCK \
+    do { \
+      if (pthread_mutex_unlock(&this->m_gclock) != 0) { \
+        throw PERSIST_EXP_MUTEX_UNLOCK(errno); \
+      } \
+    } while (0)
+
  
     // load the log from files. This method may through exceptions if read from
     // file failed.
     virtual void load() noexcept(false);
 
-    // Persistent the Metadata header, we assume 
+    // Flush the log and persist the meta header in the caller's thread.
+    virtual const __int128 doPersist() noexcept(false);
+
+    // the flusher thread for group commit
+    static void * groupCommitThread(void * arg) noexcept(true);
+
+    // Persistent the Metadata header, which is a snapshot of META_HEADER.
+    // We assume
     // 1) FPL_RDLOCK or FPL_WRLOCK is acquired.
     // 2) FPL_PERS_LOCK is acquired.
-    virtual void persistMetaHeaderAtomically() noexcept(false);
+    virtual void persistMetaHeaderAtomically(const MetaHeader & header) noexcept(false);
+
+    // map the MF_DUAL_SLOT or MF_PMEM meta file
+    void mapMetaFile() noexcept(false);
+
+    // load the newest valid slot of the MF_DUAL_SLOT meta file to
+    // META_HEADER_PERS. Throws PERSIST_EXP_CORRUPTED_META if no slot is valid.
+    void loadMetaSlot() noexcept(false);
+
+    // Get the index of the first entry referred by either the current or
+    // the persisted meta header. We assume FPL_RDLOCK or FPL_WRLOCK is acquired.
+    int64_t getRetainedHead() noexcept(true);
+
+    // If num new entries with size bytes of data fit in the ring buffers
+    // without overwriting the entries referred by the persisted meta header.
+    bool fitsRing(const uint64_t & num, const uint64_t & size) noexcept(true);
+
+    // Persist the current head with the persisted tail, which releases the
+    // space of the entries trimmed since the last persist(). We assume
+    // FPL_WRLOCK is acquired.
+    void persistHead() noexcept(false);
+
+    // Make room for num new entries with size bytes of data in total, and
+    // return the offset of the data of the first one. The data of the
+    // entries are contiguous. num > 1 is for LL_RING only. We assume
+    // FPL_WRLOCK is acquired.
+    uint64_t prepareAppend(const uint64_t & size, const uint64_t & num = 1) noexcept(false);
+
+    // Verify the entries after load(): truncate the log before the first
+    // torn entry, and recover the intact entries after the persisted tail.
+    void recover() noexcept(false);
+
+    // a range of entries verified by a recovery thread
+    typedef struct verify_chunk {
+      FilePersistLog * plog;
+      int64_t from;
+      int64_t to;
+      bool strict;
+      uint64_t dataEnd;
+      int64_t bad;      // the first invalid entry, or to
+      uint64_t entries; // the number of entries verified
+      uint64_t bytes;   // the bytes verified
+    } VerifyChunk;
+
+    // the recovery thread, which verifies a VerifyChunk
+    static void * verifyThread(void * arg) noexcept(true);
+
+    // Verify the entries in [from,to) in parallel chunks, and return the
+    // first invalid one, or to. With strict, an entry must be checksummed and
+    // follow the previous one, for the entries after the persisted tail. The
+    // data of an entry must end before dataEnd. We assume no other thread
+    // uses the log.
+    int64_t verifyEntries(const int64_t & from, const int64_t & to,
+      const bool & strict, const uint64_t & dataEnd) noexcept(true);
+
+    // verify an entry, see verifyEntries(). bytes is increased by the bytes
+    // verified.
+    bool verifyEntry(const int64_t & idx, const bool & strict,
+      const uint64_t & dataEnd, uint64_t & bytes) noexcept(true);
+
+    // The checksum of an entry and its data, which is never 0. The index is
+    // included so that a stale entry left in the slot does not pass.
+    uint32_t checksumEntry(const int64_t & idx, const LogEntry * ple) noexcept(false);
+
+    // the prefault thread for SM_PREFAULT
+    static void * prefaultThread(void * arg) noexcept(true);
+
+    // fault in the tail of the log up to PersistLogConfig::prefault_window
+    // bytes, for prefaultThread()
+    void prefault() noexcept(false);
+
+    // record the time of the first read
+    void recordFirstRead() noexcept(true);
+
+    // called by the readers
+    void noteRead() noexcept(true) {
+      if (__builtin_expect(!__atomic_load_n(&this->m_bFirstRead,__ATOMIC_RELAXED),0)) {
+        recordFirstRead();
+      }
+    }
+
+    // flush the log entries and data in [from,to) to storage. We assume
+    // FPL_RDLOCK or FPL_WRLOCK is acquired.
+    void flushEntries(const int64_t & from, const int64_t & to) noexcept(false);
+
+    // Flush [addr,addr+len) of a mapped file to storage. In the persistent
+    // memory mode, the cache lines are only written back, and drainFlushes()
+    // waits for them. Otherwise, it is an msync().
+    void flushRange(const void * addr, const uint64_t & len) noexcept(false);
+
+    // wait for the cache lines written back by flushRange()
+    void drainFlushes() noexcept(true) {
+      if (this->m_bPmem) {
+        pmemDrain();
+      }
+    }
+
+    // Map len bytes of fd shared at addr, or anywhere if addr is NULL. In
+    // the persistent memory mode, it uses pmemMap().
+    // @return the address, or MAP_FAILED with errno set
+    void * mapShared(void * addr, const uint64_t & len, const int & fd) noexcept(true);
+
+    // Search the latest entry in [head,tail) with version equal or earlier
+    // than ver with the version index or the packed keys, if they are
+    // enabled, or binary search.
+    // @return the index of the entry, or -1 if it does not exist.
+    int64_t searchVersion(const __int128 & ver, const int64_t & head,
+      const int64_t & tail) noexcept(false);
+
+    // Search the latest entry in [head,tail) with HLC equal or earlier than
+    // key, which is HLCStamp::key(), with the packed keys, if they are
+    // enabled, or binary search.
+    // @return the index of the entry, or -1 if it does not exist.
+    int64_t searchHlc(const unsigned __int128 & key, const int64_t & head,
+      const int64_t & tail) noexcept(false);
+
+    // Search the entries in [head,tail) with HLC in [from,to], which are
+    // HLCStamp::key(), and return them as [first,last).
+    void searchHlcRange(const unsigned __int128 & from, const unsigned __int128 & to,
+      const int64_t & head, const int64_t & tail, int64_t & first, int64_t & last)
+      noexcept(false);
+
+    // Add the log entry idx, which is filled but not published yet, to the
+    // version index and the packed keys.
+    void indexEntry(const int64_t & idx) noexcept(false);
+
+    // Compress the data of size bytes at ofst in place if compression is
+    // enabled and the data shrinks.
+    // @param ulen - set to size if the data is compressed, or 0.
+    // @return the length of the data kept
+    uint64_t compressData(const uint64_t & ofst, const uint64_t & size,
+      uint32_t & ulen) noexcept(false);
+
+    // Get the data of entry idx, decompressed in the buffer of the thread if
+    // it is compressed. We assume FPL_READ_BEGIN.
+    const void * readEntry(const int64_t & idx) noexcept(false);
+
+    // Collect the data of the entries in [first,last), decompressed in buffer,
+    // or in the bulk buffer of the thread if it is nullptr. We assume
+    // FPL_READ_BEGIN.
+    void readEntries(const int64_t & first, const int64_t & last,
+      std::vector<const void *> & entries, std::vector<char> * buffer) noexcept(false);
+
+    // Grow the log ring buffer to have at least num free slots. We assume
+    // FPL_WRLOCK is acquired, which is released in between, see growRing().
+    virtual void growLog(const uint64_t & num = 1) noexcept(false);
+
+    // Grow the data ring buffer to have at least size free bytes. We assume
+    // FPL_WRLOCK is acquired, which is released in between, see growRing().
+    virtual void growData(const uint64_t & size) noexcept(false);
+
+    // Replace a ring buffer file with a larger one, which is renamed over the
+    // old one after the live range is copied and flushed. The live range is
+    // copied with FPL_RDLOCK so that the readers are not blocked. Then the
+    // entries appended in between are copied with FPL_WRLOCK, and the new
+    // ring buffer replaces the old one, which is retired. We assume
+    // FPL_WRLOCK is acquired, and it is acquired on return.
+    // @param log the log ring buffer, or the data ring buffer
+    void growRing(const bool & log, const uint64_t & newSize) noexcept(false);
+
+    // Get the live range [from,to) of a ring buffer in the ring's offset
+    // space. We assume FPL_RDLOCK or FPL_WRLOCK is acquired.
+    void getRingRange(const bool & log, uint64_t & from, uint64_t & to) noexcept(true);
+
+    // Queue the writes of the range [from,to) in the ring's offset space to
+    // its file, which are aligned to pages. For the direct I/O mode.
+    void writeRing(const int & fd, const RingBuffer * ring, const uint64_t & from,
+      const uint64_t & to) noexcept(true);
+
+    // load the segment tables of a segmented log
+    void loadSegments() noexcept(false);
+
+    // get the name of a segment file
+    const string getSegmentFile(const string & file, const int64_t & segno) noexcept(true) {
+      return file + "." + std::to_string(segno);
+    }
+
+    // map a segment file on demand. It may be called concurrently by readers.
+    void * mapSegment(const string & file, const int64_t & segno, Segment & seg)
+      noexcept(false);
+
+    // create the segment file segno and append it to the segment table. We
+    // assume FPL_WRLOCK is acquired.
+    void createSegment(const string & file, const int64_t & segno,
+      const uint64_t & size, std::deque<Segment> & segs, int64_t & firstSeg)
+      noexcept(false);
+
+    // If there are segments to retire: the segments before the retained head
+    // are not used anymore. We assume FPL_RDLOCK or FPL_WRLOCK is acquired.
+    bool hasRetiredSegments() noexcept(true);
+
+    // Delete the segments before the retained head. The mapping of a
+    // retired segment is replaced by zero pages, which frees the file and
+    // keeps the addresses valid for the readers still holding pointers to
+    // it, like the retired ring buffers. We assume FPL_WRLOCK is acquired.
+    void retireSegments() noexcept(false);
+
+    // Replace the mapping of a retired segment, if any, and keep it in
+    // m_retiredSegs. We assume FPL_WRLOCK is acquired.
+    void retireMapping(const Segment & seg) noexcept(false);
+
+    // get a log entry in a ring buffer
+    LogEntry * ringLogEntryAt(const int64_t & idx) noexcept(true) {
+      const RingBuffer * ring = LOG_RING;
+      return (LogEntry*)ring->addr + (uint64_t)idx % (ring->size/sizeof(LogEntry));
+    }
+
+    // get the data at an offset in a ring buffer
+    void * ringDataAt(const uint64_t & ofst) noexcept(true) {
+      const RingBuffer * ring = DATA_RING;
+      return (void*)((uint8_t*)ring->addr + ofst % ring->size);
+    }
+
+    // In the single-writer mode, if the entries from low on are still in the
+    // log. They are never overwritten by append() before the head passes
+    // them.
+    bool validateRead(const int64_t & low) noexcept(true) {
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      return __atomic_load_n(&META_HEADER->fields.head,__ATOMIC_RELAXED) <= low;
+    }
+
+    // get a log entry in a segmented log
+    LogEntry * segLogEntryAt(const int64_t & idx) noexcept(false) {
+      const int64_t segno = LOG_SEG_OF(idx);
+      Segment & seg = this->m_logSegs[segno - this->m_iFirstLogSeg];
+      void * addr = __atomic_load_n(&seg.addr,__ATOMIC_ACQUIRE);
+      if (addr == nullptr) {
+        addr = mapSegment(this->m_sLogFile,segno,seg);
+      }
+      return (LogEntry*)addr + idx % (int64_t)META_HEADER->fields.seg_entries;
+    }
+
+    // get the data at an offset in a segmented log
+    void * segDataAt(const uint64_t & ofst) noexcept(false) {
+      const int64_t segno = DATA_SEG_OF(ofst);
+      Segment & seg = this->m_dataSegs[segno - this->m_iFirstDataSeg];
+      void * addr = __atomic_load_n(&seg.addr,__ATOMIC_ACQUIRE);
+      if (addr == nullptr) {
+        addr = mapSegment(this->m_sDataFile,segno,seg);
+      }
+      return (void*)((uint8_t*)addr + DATA_SEG_OFST(ofst));
+    }
 
   public:
 
     //Constructor
-    FilePersistLog(const string &name,const string &dataPath) noexcept(false);
-    FilePersistLog(const string &name) noexcept(false):
-      FilePersistLog(name,DEFAULT_FILE_PERSIST_LOG_DATA_PATH){
+    FilePersistLog(const string &name,const string &dataPath,
+      const PersistLogConfig &config = PersistLogConfig()) noexcept(false);
+    FilePersistLog(const string &name,
+      const PersistLogConfig &config = PersistLogConfig()) noexcept(false):
+      FilePersistLog(name,DEFAULT_FILE_PERSIST_LOG_DATA_PATH,config){
     };
     //Destructor
     virtual ~FilePersistLog() noexcept(true);
 
+    // the statistics of the crash recovery when the log is loaded
+    const RecoveryStats & getRecoveryStats() const noexcept(true) {
+      return this->m_oRecoveryStats;
+    }
+
+    // the statistics of the startup, which are filled in as they are known
+    const StartupStats & getStartupStats() const noexcept(true) {
+      return this->m_oStartupStats;
+    }
+
     //Derived from PersistLog
     virtual void append(const void * pdata,
       const uint64_t & size, const __int128 & ver,
-      const HLC &mhlc) noexcept(false);
+      const HLCStamp & mhlc) noexcept(false);
+    virtual void * reserve(const uint64_t & size) noexcept(false);
+    virtual void commit(const __int128 & ver, const HLCStamp & mhlc) noexcept(false);
+    virtual void cancel() noexcept(false);
+    virtual void appendBatch(const std::vector<PersistLogEntry> & entries) noexcept(false);
     virtual int64_t getLength() noexcept(false);
     virtual int64_t getEarliestIndex() noexcept(false);
     virtual const void* getEntryByIndex(const int64_t &eno) noexcept(false);
     virtual const void* getEntry(const __int128 & ver) noexcept(false);
-    virtual const void* getEntry(const HLC &hlc) noexcept(false);
+    virtual const void* getEntry(const HLCStamp & hlc) noexcept(false);
+    virtual int64_t getLatestIndex() noexcept(false);
+    virtual int64_t getIndex(const __int128 & ver) noexcept(false);
+    virtual int64_t getIndex(const HLCStamp & hlc) noexcept(false);
+    virtual void getIndexRange(const HLCStamp & from, const HLCStamp & to,
+      int64_t & first, int64_t & last) noexcept(false);
+    virtual int64_t getIndexNotBefore(const HLCStamp & hlc) noexcept(false);
+    virtual int64_t getEntries(const HLCStamp & from, const HLCStamp & to,
+      std::vector<const void *> & entries,
+      std::vector<char> * buffer = nullptr) noexcept(false);
+    virtual int64_t getEntries(const __int128 & from, const __int128 & to,
+      std::vector<const void *> & entries,
+      std::vector<char> * buffer = nullptr) noexcept(false);
+    virtual int64_t getEntriesByIndex(const int64_t & from, const int64_t & to,
+      std::vector<const void *> & entries,
+      std::vector<char> * buffer = nullptr) noexcept(false);
+    virtual uint64_t getDataSize(const int64_t & idx) noexcept(false);
+    virtual uint32_t getEntryFormat() noexcept(false);
+    virtual void setEntryFormat(const uint32_t & format) noexcept(false);
     //virtual const __int128 persist(const __int128 & ver = -1) noexcept(false);
     virtual const __int128 persist() noexcept(false);
     virtual void trim(const int64_t &eno) noexcept(false);
     virtual void trim(const __int128 &ver) noexcept(false);
-    virtual void trim(const HLC & hlc) noexcept(false);
+    virtual void trim(const HLCStamp & hlc) noexcept(false);
 
     template <typename TKey,typename KeyGetter>
     void trim(const TKey &key,const KeyGetter &keyGetter) noexcept(false) {
       int64_t head,tail,idx;
       // RDLOCK for validation
       FPL_RDLOCK;
-      head = META_HEADER->fields.head % MAX_LOG_ENTRY;
-      tail = META_HEADER->fields.tail % MAX_LOG_ENTRY;
-      if (tail < head) tail += MAX_LOG_ENTRY;
-      idx = binarySearch<TKey>(keyGetter,key,head,tail);
+      head = META_HEADER->fields.head;
+      tail = META_HEADER->fields.tail;
+      try {
+        idx = binarySearch<TKey>(keyGetter,key,head,tail);
+      } catch (uint64_t e) {
+        FPL_UNLOCK;
+        throw e;
+      }
       if (idx == -1) {
         FPL_UNLOCK;
         return;
@@ -215,15 +707,22 @@ namespace ns_persistent {
       // search?
       // WRLOCK for trim
       FPL_WRLOCK;
-      head = META_HEADER->fields.head % MAX_LOG_ENTRY;
-      tail = META_HEADER->fields.tail % MAX_LOG_ENTRY;
-      if (tail < head) tail += MAX_LOG_ENTRY;
-      idx = binarySearch<TKey>(keyGetter,key,head,tail);
-      if (idx != -1) {
-        META_HEADER->fields.head += (idx-head+1);
-      } else {
+      head = META_HEADER->fields.head;
+      tail = META_HEADER->fields.tail;
+      try {
+        idx = binarySearch<TKey>(keyGetter,key,head,tail);
+        if (idx != -1) {
+          __atomic_store_n(&META_HEADER->fields.head,idx + 1,__ATOMIC_RELEASE);
+          if (this->m_pVerIndex != nullptr) {
+            this->m_pVerIndex->trim(idx + 1);
+          }
+          if (IS_SEGMENTED) {
+            retireSegments();
+          }
+        }
+      } catch (uint64_t e) {
         FPL_UNLOCK;
-        return;
+        throw e;
       }
       FPL_UNLOCK;
     }
@@ -232,7 +731,9 @@ namespace ns_persistent {
 #ifdef _DEBUG
     //dbg functions
     void dbgDumpMeta() {
-      dbg_trace("m_pData={0},m_pLog={1}",(void*)this->m_pData,(void*)this->m_pLog);
+      if (!IS_SEGMENTED) {
+        dbg_trace("m_pData={0},m_pLog={1}",LOG_RING->addr,DATA_RING->addr);
+      }
       dbg_trace("MEAT_HEADER:head={0},tail={1}",(int64_t)META_HEADER->fields.head,(int64_t)META_HEADER->fields.tail);
       dbg_trace("MEAT_HEADER_PERS:head={0},tail={1}",(int64_t)META_HEADER_PERS->fields.head,(int64_t)META_HEADER_PERS->fields.tail);
       dbg_trace("NEXT_LOG_ENTRY={0},NEXT_LOG_ENTRY_PERS={1}",(void*)NEXT_LOG_ENTRY,(void*)NEXT_LOG_ENTRY_PERS);
@@ -1,9 +1,15 @@
 #include <time.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 #include "HLC.hpp"
 
 // return microsecond
-uint64_t read_rtc_us () 
+static uint64_t read_rtc_us_precise ()
   noexcept(false) {
   struct timespec tp;
   if ( clock_gettime(CLOCK_REALTIME,&tp) != 0 ) {
@@ -13,6 +19,187 @@ uint64_t read_rtc_us ()
   }
 }
 
+static uint64_t read_rtc_us_coarse ()
+  noexcept(false) {
+  struct timespec tp;
+  if ( clock_gettime(CLOCK_REALTIME_COARSE,&tp) != 0 ) {
+    throw HLC_EXP_READ_RTC(errno);
+  } else {
+    return (uint64_t)tp.tv_sec*1000000 + tp.tv_nsec/1000;
+  }
+}
+
+#if defined(__x86_64__)
+// the feature bit of cpuid leaf 0x80000007, in edx
+#define CPUID_INVARIANT_TSC (1U << 8)
+// how long the TSC is measured against the rtc by the first calibration
+#define RTC_TSC_CALIBRATE_US (2000UL)
+
+// The TSC is mapped to the rtc by the anchor: us + (tsc - anchor tsc) *
+// mult / 2^32. The anchor is updated under a sequence lock: the sequence is
+// odd while it is updated.
+static struct {
+  uint64_t seq;
+  uint64_t tsc;
+  uint64_t us;
+  uint64_t mult;
+  uint64_t resync_ticks;
+  bool resyncing;
+} tscAnchor;
+
+// We assume tscAnchor.resyncing is set.
+static void tsc_anchor(const uint64_t & tsc, const uint64_t & us, const uint64_t & mult) {
+  __atomic_store_n(&tscAnchor.seq,tscAnchor.seq + 1,__ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&tscAnchor.tsc,tsc,__ATOMIC_RELAXED);
+  __atomic_store_n(&tscAnchor.us,us,__ATOMIC_RELAXED);
+  __atomic_store_n(&tscAnchor.mult,mult,__ATOMIC_RELAXED);
+  __atomic_store_n(&tscAnchor.resync_ticks,
+    (uint64_t)(((unsigned __int128)RTC_TSC_RESYNC_US << 32)/mult),__ATOMIC_RELAXED);
+  __atomic_store_n(&tscAnchor.seq,tscAnchor.seq + 1,__ATOMIC_RELEASE);
+}
+
+// Read the TSC and the rtc at the same time: the rtc is read between two
+// TSC reads, and the closest pair of a few tries is taken.
+static void tsc_sample(uint64_t & tsc, uint64_t & us) noexcept(false) {
+  uint64_t before = __rdtsc();
+  us = read_rtc_us_precise();
+  uint64_t gap = __rdtsc() - before;
+  tsc = before + gap/2;
+  for (int i = 1; i < 4; i++) {
+    before = __rdtsc();
+    const uint64_t rtc = read_rtc_us_precise();
+    const uint64_t after = __rdtsc();
+    if (after - before < gap) {
+      gap = after - before;
+      tsc = before + gap/2;
+      us = rtc;
+    }
+  }
+}
+
+// Measure the rate of the TSC against the rtc. The rate is refined by the
+// resynchronization, which measures it for a longer time.
+static bool tsc_calibrate() noexcept(false) {
+  unsigned eax, ebx, ecx, edx = 0;
+  if (!__get_cpuid(0x80000007,&eax,&ebx,&ecx,&edx) || !(edx & CPUID_INVARIANT_TSC)) {
+    return false;
+  }
+  uint64_t tsc0, us0, tsc1, us1;
+  tsc_sample(tsc0,us0);
+  do {
+    tsc_sample(tsc1,us1);
+  } while (us1 < us0 + RTC_TSC_CALIBRATE_US);
+  if (tsc1 <= tsc0) {
+    return false;
+  }
+  while (__atomic_test_and_set(&tscAnchor.resyncing,__ATOMIC_ACQUIRE)) {
+  }
+  tsc_anchor(tsc1,us1,(uint64_t)(((unsigned __int128)(us1 - us0) << 32)/(tsc1 - tsc0)));
+  __atomic_clear(&tscAnchor.resyncing,__ATOMIC_RELEASE);
+  return true;
+}
+
+// Move the anchor to now, and correct the rate by the time since the last
+// anchor. Only one thread does it, the others keep the old anchor.
+static uint64_t tsc_resync(const uint64_t & tsc, const uint64_t & atsc,
+  const uint64_t & aus, const uint64_t & amult) noexcept(false) {
+  if (__atomic_test_and_set(&tscAnchor.resyncing,__ATOMIC_ACQUIRE)) {
+    return aus + (uint64_t)(((unsigned __int128)(tsc - atsc) * amult) >> 32);
+  }
+  uint64_t now, us;
+  tsc_sample(now,us);
+  uint64_t mult = amult;
+  if (now > atsc && us > aus) {
+    mult = (uint64_t)(((unsigned __int128)(us - aus) << 32)/(now - atsc));
+  }
+  tsc_anchor(now,us,mult);
+  __atomic_clear(&tscAnchor.resyncing,__ATOMIC_RELEASE);
+  return us;
+}
+
+static uint64_t read_rtc_us_tsc ()
+  noexcept(false) {
+  uint64_t seq, atsc, aus, amult, aresync;
+  do {
+    seq = __atomic_load_n(&tscAnchor.seq,__ATOMIC_ACQUIRE);
+    atsc = __atomic_load_n(&tscAnchor.tsc,__ATOMIC_RELAXED);
+    aus = __atomic_load_n(&tscAnchor.us,__ATOMIC_RELAXED);
+    amult = __atomic_load_n(&tscAnchor.mult,__ATOMIC_RELAXED);
+    aresync = __atomic_load_n(&tscAnchor.resync_ticks,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || seq != __atomic_load_n(&tscAnchor.seq,__ATOMIC_RELAXED));
+  const uint64_t tsc = __rdtsc();
+  // a TSC earlier than the anchor is read on another core a bit behind.
+  if (tsc <= atsc) {
+    return aus;
+  }
+  if (tsc - atsc > aresync) {
+    return tsc_resync(tsc,atsc,aus,amult);
+  }
+  return aus + (uint64_t)(((unsigned __int128)(tsc - atsc) * amult) >> 32);
+}
+#endif
+
+static RtcSource rtcSource = RTC_PRECISE;
+
+typedef uint64_t (*RtcFunc)();
+
+static RtcFunc pick_rtc(const RtcSource & src) noexcept(false) {
+  switch (src) {
+  case RTC_COARSE:
+    rtcSource = RTC_COARSE;
+    return read_rtc_us_coarse;
+#if defined(__x86_64__)
+  case RTC_TSC:
+    if (tsc_calibrate()) {
+      rtcSource = RTC_TSC;
+      return read_rtc_us_tsc;
+    }
+    break;
+#endif
+  default:
+    break;
+  }
+  rtcSource = RTC_PRECISE;
+  return read_rtc_us_precise;
+}
+
+static RtcSource env_rtc_source() noexcept(true) {
+  const char * env = getenv("HLC_RTC_SOURCE");
+  if (env != nullptr && strcmp(env,"coarse") == 0) {
+    return RTC_COARSE;
+  }
+  if (env != nullptr && strcmp(env,"tsc") == 0) {
+    return RTC_TSC;
+  }
+  return RTC_PRECISE;
+}
+
+// The first call picks the source, like pmemFlush.
+static uint64_t read_rtc_us_resolve ()
+  noexcept(false) {
+  RtcFunc func = pick_rtc(env_rtc_source());
+  __atomic_store_n(&read_rtc_us,func,__ATOMIC_RELEASE);
+  return func();
+}
+
+uint64_t (*read_rtc_us)() = read_rtc_us_resolve;
+
+RtcSource set_rtc_source(const RtcSource & src)
+  noexcept(false) {
+  __atomic_store_n(&read_rtc_us,pick_rtc(src),__ATOMIC_RELEASE);
+  return rtcSource;
+}
+
+RtcSource get_rtc_source()
+  noexcept(false) {
+  if (__atomic_load_n(&read_rtc_us,__ATOMIC_ACQUIRE) == read_rtc_us_resolve) {
+    __atomic_store_n(&read_rtc_us,pick_rtc(env_rtc_source()),__ATOMIC_RELEASE);
+  }
+  return rtcSource;
+}
+
 HLC::HLC () 
   noexcept(false) {
   this->m_rtc_us = read_rtc_us();
@@ -113,3 +300,60 @@ void HLC::operator = (const HLC &hlc)
   this->m_rtc_us = hlc.m_rtc_us;
   this->m_logic = hlc.m_logic;
 }
+
+// Compare and swap the 16 bytes of an AtomicHLC. On failure, expected is
+// updated to the current value.
+#if defined(__x86_64__)
+__attribute__((target("cx16")))
+#endif
+static inline bool cas_hlc(unsigned __int128 * ptr, unsigned __int128 & expected,
+  const unsigned __int128 & desired) noexcept(true) {
+#if defined(__x86_64__)
+  // the legacy builtin is inlined to cmpxchg16b, unlike __atomic_*, which
+  // goes through libatomic.
+  const unsigned __int128 prev = __sync_val_compare_and_swap(ptr,expected,desired);
+  if (prev == expected) {
+    return true;
+  }
+  expected = prev;
+  return false;
+#else
+  return __atomic_compare_exchange_n(ptr,&expected,desired,false,
+    __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE);
+#endif
+}
+
+AtomicHLC AtomicHLC::tick()
+  noexcept(false) {
+  const uint64_t rtc = read_rtc_us();
+  AtomicHLC curr = this->load();
+  AtomicHLC next(0,0);
+  do {
+    if (rtc <= curr.m_rtc_us) {
+      next = AtomicHLC(curr.m_rtc_us,curr.m_logic + 1);
+    } else {
+      next = AtomicHLC(rtc,0);
+    }
+  } while (!cas_hlc(&this->m_packed,curr.m_packed,next.m_packed));
+  return next;
+}
+
+AtomicHLC AtomicHLC::tick(const AtomicHLC & msgHlc)
+  noexcept(false) {
+  const uint64_t rtc = read_rtc_us();
+  AtomicHLC curr = this->load();
+  AtomicHLC next(0,0);
+  do {
+    if ((rtc > curr.m_rtc_us) && (rtc > msgHlc.m_rtc_us)) {
+      // use rtc
+      next = AtomicHLC(rtc,0);
+    } else if (curr >= msgHlc) {
+      // use this hlc
+      next = AtomicHLC(curr.m_rtc_us,curr.m_logic + 1);
+    } else {
+      // use msg hlc
+      next = AtomicHLC(msgHlc.m_rtc_us,msgHlc.m_logic + 1);
+    }
+  } while (!cas_hlc(&this->m_packed,curr.m_packed,next.m_packed));
+  return next;
+}
@@ -3,6 +3,8 @@
 #include <sys/types.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <string.h>
+#include <functional>
 
 class HLC{
 
@@ -42,7 +44,186 @@ public:
 #define HLC_EXP_SPIN_LOCK(x)                    HLC_EXP(3,(x))
 #define HLC_EXP_SPIN_UNLOCK(x)                    HLC_EXP(4,(x))
 
-// read the rtc clock in microseconds
-uint64_t read_rtc_us() noexcept(false);
+// The source of the real-time clock of HLC:
+// RTC_PRECISE - clock_gettime(CLOCK_REALTIME).
+// RTC_COARSE - clock_gettime(CLOCK_REALTIME_COARSE), which is read from the
+//           vDSO without a syscall, in the resolution of a kernel tick.
+// RTC_TSC - the invariant TSC, calibrated against CLOCK_REALTIME and
+//           resynchronized every RTC_TSC_RESYNC_US to correct the drift. It
+//           falls back to RTC_PRECISE if the TSC is not invariant.
+// The clock read from any source may step backward when it is adjusted,
+// which the HLC absorbs with its logic clock.
+enum RtcSource {
+  RTC_PRECISE=0,
+  RTC_COARSE,
+  RTC_TSC
+};
+
+// how often the TSC is resynchronized with CLOCK_REALTIME
+#define RTC_TSC_RESYNC_US   (1000000UL)
+
+// Read the rtc clock in microseconds. The source is picked by the first call,
+// from the environment variable HLC_RTC_SOURCE: "precise", "coarse" or "tsc".
+// The default is RTC_PRECISE.
+extern uint64_t (*read_rtc_us)();
+
+// Change the source of read_rtc_us().
+// @return the source in use, which is RTC_PRECISE if src is not available.
+RtcSource set_rtc_source(const RtcSource & src) noexcept(false);
+
+// @return the source of read_rtc_us()
+RtcSource get_rtc_source() noexcept(false);
+
+// AtomicHLC is a hybrid logical clock packed in 16 bytes. Unlike HLC, it has
+// no lock and no virtual function: tick() is a compare-and-swap loop on the
+// 16 bytes (cmpxchg16b on x86_64), so that many threads tick a shared clock
+// without a serialization point. A copy of it is a plain value.
+class alignas(16) AtomicHLC {
+public:
+  union {
+    struct {
+      uint64_t m_rtc_us; // real-time clock in microseconds
+      uint64_t m_logic;  // logic clock
+    };
+    // the clock as one word for compare-and-swap
+    unsigned __int128 m_packed;
+  };
+
+  // constructors
+  AtomicHLC() noexcept(false):
+    m_rtc_us(read_rtc_us()), m_logic(0) {
+  }
+  AtomicHLC(const uint64_t & rtc_us, const uint64_t & logic) noexcept(true):
+    m_rtc_us(rtc_us), m_logic(logic) {
+  }
+  AtomicHLC(const HLC & hlc) noexcept(true):
+    m_rtc_us(hlc.m_rtc_us), m_logic(hlc.m_logic) {
+  }
+  AtomicHLC(const AtomicHLC & hlc) noexcept(true):
+    m_packed(hlc.m_packed) {
+  }
+
+  // ticking methods - thread safe and lock-free
+  // @return the clock after the tick
+  AtomicHLC tick() noexcept(false);
+  AtomicHLC tick(const AtomicHLC & msgHlc) noexcept(false);
+
+  // Read the clock, which may be ticked by the other threads. The clock never
+  // goes backward, so the two words are consistent if the real-time word is
+  // the same before and after the logic word.
+  AtomicHLC load() const noexcept(true) {
+    uint64_t rtc, logic;
+    do {
+      rtc = __atomic_load_n(&this->m_rtc_us,__ATOMIC_ACQUIRE);
+      logic = __atomic_load_n(&this->m_logic,__ATOMIC_ACQUIRE);
+    } while (rtc != __atomic_load_n(&this->m_rtc_us,__ATOMIC_ACQUIRE));
+    return AtomicHLC(rtc,logic);
+  }
+
+  // comparators
+  bool operator > (const AtomicHLC & hlc) const noexcept(true) {
+    return (this->m_rtc_us > hlc.m_rtc_us) ||
+      (this->m_rtc_us == hlc.m_rtc_us && this->m_logic > hlc.m_logic);
+  }
+  bool operator < (const AtomicHLC & hlc) const noexcept(true) {
+    return hlc > *this;
+  }
+  bool operator == (const AtomicHLC & hlc) const noexcept(true) {
+    return this->m_rtc_us == hlc.m_rtc_us && this->m_logic == hlc.m_logic;
+  }
+  bool operator >= (const AtomicHLC & hlc) const noexcept(true) {
+    return !(hlc > *this);
+  }
+  bool operator <= (const AtomicHLC & hlc) const noexcept(true) {
+    return !(*this > hlc);
+  }
+
+  // evaluator - not atomic, see load().
+  AtomicHLC & operator = (const AtomicHLC & hlc) noexcept(true) {
+    this->m_packed = hlc.m_packed;
+    return *this;
+  }
+};
+
+
+// HLCStamp is the value of an HLC: a plain 16-byte struct without a lock or a
+// virtual function. It is trivially copyable and standard-layout, so that it
+// is copied with memcpy, kept in the log entries and mapped files, and sent
+// in messages as it is. The stamps are ordered by (m_rtc_us,m_logic).
+struct HLCStamp {
+  uint64_t m_rtc_us; // real-time clock in microseconds
+  uint64_t m_logic;  // logic clock
+
+  // constructors
+  constexpr HLCStamp() noexcept(true):
+    m_rtc_us(0), m_logic(0) {
+  }
+  constexpr HLCStamp(const uint64_t & rtc_us, const uint64_t & logic) noexcept(true):
+    m_rtc_us(rtc_us), m_logic(logic) {
+  }
+  HLCStamp(const HLC & hlc) noexcept(true):
+    m_rtc_us(hlc.m_rtc_us), m_logic(hlc.m_logic) {
+  }
+  HLCStamp(const AtomicHLC & hlc) noexcept(true):
+    m_rtc_us(hlc.m_rtc_us), m_logic(hlc.m_logic) {
+  }
+
+  // a stamp of the rtc clock now
+  static HLCStamp now() noexcept(false) {
+    return HLCStamp(read_rtc_us(),0);
+  }
+
+  // the stamp as one 128-bit key, which has the same order
+  constexpr unsigned __int128 key() const noexcept(true) {
+    return (((unsigned __int128)this->m_rtc_us)<<64) | this->m_logic;
+  }
+
+  // comparators
+  constexpr bool operator == (const HLCStamp & s) const noexcept(true) {
+    return this->m_rtc_us == s.m_rtc_us && this->m_logic == s.m_logic;
+  }
+  constexpr bool operator != (const HLCStamp & s) const noexcept(true) {
+    return !(*this == s);
+  }
+  constexpr bool operator < (const HLCStamp & s) const noexcept(true) {
+    return this->m_rtc_us < s.m_rtc_us ||
+      (this->m_rtc_us == s.m_rtc_us && this->m_logic < s.m_logic);
+  }
+  constexpr bool operator > (const HLCStamp & s) const noexcept(true) {
+    return s < *this;
+  }
+  constexpr bool operator <= (const HLCStamp & s) const noexcept(true) {
+    return !(s < *this);
+  }
+  constexpr bool operator >= (const HLCStamp & s) const noexcept(true) {
+    return !(*this < s);
+  }
+
+  // serialization, in the byte order of the host
+  static constexpr std::size_t bytes_size() noexcept(true) {
+    return sizeof(HLCStamp);
+  }
+  std::size_t to_bytes(char * buf) const noexcept(true) {
+    memcpy(buf,this,sizeof(HLCStamp));
+    return sizeof(HLCStamp);
+  }
+  static HLCStamp from_bytes(const char * buf) noexcept(true) {
+    HLCStamp s;
+    memcpy(&s,buf,sizeof(HLCStamp));
+    return s;
+  }
+};
+
+namespace std {
+  template <>
+  struct hash<HLCStamp> {
+    std::size_t operator () (const HLCStamp & s) const noexcept(true) {
+      // mix the words so that the stamps in one microsecond spread.
+      uint64_t h = s.m_rtc_us * 0x9e3779b97f4a7c15ULL ^ s.m_logic;
+      h ^= h >> 32;
+      return (std::size_t)(h * 0xd6e8feb86659fd93ULL);
+    }
+  };
+}
 
 #endif//HLC_HPP
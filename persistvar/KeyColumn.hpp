@@ -0,0 +1,165 @@
+#ifndef KEY_COLUMN_HPP
+#define KEY_COLUMN_HPP
+#include <sys/types.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <vector>
+#include <algorithm>
+#include "PersistException.hpp"
+#include "KeyScan.hpp"
+
+namespace ns_persistent {
+
+  // the fanout of the levels of a key column. A window of a level, which
+  // has KEY_COLUMN_FANOUT keys, fits in a cache line for 16-byte keys, and
+  // is compared with one keyMaskLE() call.
+  #define KEY_COLUMN_FANOUT_BITS  (2)
+  #define KEY_COLUMN_FANOUT       (1<<KEY_COLUMN_FANOUT_BITS)
+  #define KEY_COLUMN_MAX_LEVELS   (32)
+  #define KEY_COLUMN_MIN_CAPACITY (64)
+
+  // KeyColumn keeps the keys of the log entries packed in a ring buffer, so
+  // that a search does not touch the 64-byte log entries. Level 0 has the
+  // key of every entry. Level l samples the keys of the entries whose index
+  // is a multiple of FANOUT^l. A search scans the small top level, then
+  // descends a window of FANOUT keys per level, which works like a static
+  // B-tree built incrementally by append().
+  // append() is called by one writer. The readers do not lock. They see the
+  // keys of the entries published by the log tail.
+  template <typename TKey>
+  class KeyColumn {
+  protected:
+    typedef struct column {
+      uint64_t capacity;  // number of keys in level 0, a power of 2
+      int levels;
+      TKey * keys[KEY_COLUMN_MAX_LEVELS];
+    } Column;
+    Column * m_pColumn;
+    // the replaced columns, kept for the readers till destruction.
+    std::vector<Column *> m_retiredColumns;
+
+    static Column * newColumn(const uint64_t & capacity) noexcept(false) {
+      Column * col = new Column();
+      col->capacity = capacity;
+      col->levels = 0;
+      while (col->levels < KEY_COLUMN_MAX_LEVELS &&
+             (capacity >> (KEY_COLUMN_FANOUT_BITS*col->levels)) >= KEY_COLUMN_FANOUT) {
+        void * p;
+        int err = posix_memalign(&p,64,
+          (capacity >> (KEY_COLUMN_FANOUT_BITS*col->levels))*sizeof(TKey));
+        if (err != 0) {
+          deleteColumn(col);
+          throw PERSIST_EXP_ALLOC(err);
+        }
+        col->keys[col->levels++] = (TKey *)p;
+      }
+      return col;
+    }
+
+    static void deleteColumn(Column * col) noexcept(true) {
+      for (int l = 0; l < col->levels; l++) {
+        free(col->keys[l]);
+      }
+      delete col;
+    }
+
+    // the key slot of the entry idx in level l
+    static inline TKey & keyAt(const Column * col, const int & l, const int64_t & idx) {
+      return col->keys[l][((uint64_t)idx >> (KEY_COLUMN_FANOUT_BITS*l)) &
+        ((col->capacity >> (KEY_COLUMN_FANOUT_BITS*l)) - 1)];
+    }
+
+  public:
+    // @param capacity - the initial number of keys
+    KeyColumn(const uint64_t & capacity) noexcept(false) {
+      uint64_t cap = KEY_COLUMN_MIN_CAPACITY;
+      while (cap < capacity) {
+        cap <<= 1;
+      }
+      this->m_pColumn = newColumn(cap);
+    }
+
+    virtual ~KeyColumn() noexcept(true) {
+      this->m_retiredColumns.push_back(this->m_pColumn);
+      for (auto col : this->m_retiredColumns) {
+        deleteColumn(col);
+      }
+    }
+
+    // add the key of the entry idx. The keys of [head,idx) are kept.
+    void append(const int64_t & idx, const TKey & key, const int64_t & head)
+      noexcept(false) {
+      Column * col = this->m_pColumn;
+      if ((uint64_t)(idx - head) >= col->capacity) {
+        // replace the column with a larger one.
+        uint64_t cap = col->capacity << 1;
+        while ((uint64_t)(idx - head) >= cap) {
+          cap <<= 1;
+        }
+        Column * ncol = newColumn(cap);
+        for (int64_t i = head; i < idx; i++) {
+          for (int l = 0; l < ncol->levels &&
+               (i & ((1LL << (KEY_COLUMN_FANOUT_BITS*l)) - 1)) == 0; l++) {
+            keyAt(ncol,l,i) = keyAt(col,0,i);
+          }
+        }
+        this->m_retiredColumns.push_back(col);
+        __atomic_store_n(&this->m_pColumn,ncol,__ATOMIC_RELEASE);
+        col = ncol;
+      }
+      for (int l = 0; l < col->levels &&
+           (idx & ((1LL << (KEY_COLUMN_FANOUT_BITS*l)) - 1)) == 0; l++) {
+        keyAt(col,l,idx) = key;
+      }
+    }
+
+    // Search the latest entry in [head,tail) with key equal or earlier than
+    // key. The keys must grow monotonically.
+    // @return the index of the entry, or -1 if it does not exist.
+    int64_t search(const TKey & key, const int64_t & head, const int64_t & tail)
+      const noexcept(true) {
+      const Column * col = __atomic_load_n(&this->m_pColumn,__ATOMIC_ACQUIRE);
+      if (tail <= head || keyAt(col,0,head) > key) {
+        return -1;
+      }
+      // An entry before the head is taken as not later than key: it is
+      // earlier than the head. Its slot may be reused, so it is not read.
+      // scan the top level
+      int l = col->levels - 1;
+      int64_t step = 1LL << (KEY_COLUMN_FANOUT_BITS*l);
+      int64_t pos = head & ~(step - 1);
+      for (int64_t q = pos + step; q < tail; q += step) {
+        if (q > head && keyAt(col,l,q) > key) {
+          break;
+        }
+        pos = q;
+      }
+      // descend the windows: the window of level l has the keys of the
+      // entries pos + j*step, j in [0,FANOUT).
+      while (l-- > 0) {
+        const int shift = KEY_COLUMN_FANOUT_BITS*l;
+        const TKey * window = &keyAt(col,l,pos);
+        if (l > 0) {
+          // the windows below this one are adjacent: fetch them while this
+          // one is compared.
+          const TKey * below = &keyAt(col,l-1,pos);
+          for (int j = 0; j < KEY_COLUMN_FANOUT; j++) {
+            __builtin_prefetch(below + j*KEY_COLUMN_FANOUT);
+          }
+        }
+        unsigned mask = keyMaskLE(window,key);
+        // the entries not after the head are taken, the ones from the tail not.
+        if (head >= pos) {
+          mask |= (1U << std::min<int64_t>(((head - pos) >> shift) + 1,KEY_COLUMN_FANOUT)) - 1;
+        }
+        mask &= (1U << std::min<int64_t>((tail - pos + (1LL << shift) - 1) >> shift,
+          KEY_COLUMN_FANOUT)) - 1;
+        pos += (int64_t)(__builtin_ctz(~mask) - 1) << shift;
+      }
+      return pos;
+    }
+  };
+}
+
+#endif//KEY_COLUMN_HPP
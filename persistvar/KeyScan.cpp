@@ -0,0 +1,100 @@
+#include <immintrin.h>
+#include "KeyScan.hpp"
+
+namespace ns_persistent {
+
+  // the sign bit of a 64-bit lane
+  #define KEY_SIGN_BIT (0x8000000000000000ULL)
+
+  static unsigned keyMaskLE4Scalar(const void * keys, const unsigned __int128 & key,
+    const bool is_signed) {
+    const unsigned __int128 * pk = (const unsigned __int128 *)keys;
+    // move the signed order to the unsigned order.
+    const unsigned __int128 bias = is_signed ? (((unsigned __int128)KEY_SIGN_BIT)<<64) : 0;
+    unsigned mask = 0;
+    for (int j = 0; j < 4; j++) {
+      if ((pk[j] ^ bias) <= (key ^ bias)) {
+        mask |= (1U << j);
+      }
+    }
+    return mask;
+  }
+
+#if defined(__x86_64__)
+  // A 128-bit key is two 64-bit lanes: the low half, then the high half.
+  __attribute__((target("avx2")))
+  static unsigned keyMaskLE4Avx2(const void * keys, const unsigned __int128 & key,
+    const bool is_signed) {
+    // _mm256_cmpgt_epi64 is signed: flip the sign bit of the unsigned lanes.
+    const __m256i bias = _mm256_set_epi64x(is_signed?0:KEY_SIGN_BIT,KEY_SIGN_BIT,
+      is_signed?0:KEY_SIGN_BIT,KEY_SIGN_BIT);
+    const __m256i k = _mm256_xor_si256(bias,
+      _mm256_set_epi64x((int64_t)(key>>64),(int64_t)key,(int64_t)(key>>64),(int64_t)key));
+    unsigned mask = 0;
+    for (int j = 0; j < 2; j++) {
+      const __m256i v = _mm256_xor_si256(bias,
+        _mm256_load_si256((const __m256i *)keys + j));
+      const __m256i gt = _mm256_cmpgt_epi64(v,k);
+      const __m256i eq = _mm256_cmpeq_epi64(v,k);
+      // high lane: hi > khi || (hi == khi && lo > klo)
+      const __m256i r = _mm256_or_si256(gt,_mm256_and_si256(eq,_mm256_slli_si256(gt,8)));
+      const unsigned m = _mm256_movemask_pd(_mm256_castsi256_pd(r));
+      mask |= (((m >> 1) & 1) | ((m >> 2) & 2)) << (2*j);
+    }
+    return (~mask) & 0xf;
+  }
+
+  __attribute__((target("avx512f")))
+  static unsigned keyMaskLE4Avx512(const void * keys, const unsigned __int128 & key,
+    const bool is_signed) {
+    const __m512i v = _mm512_load_si512(keys);
+    const __m512i k = _mm512_set_epi64(
+      (int64_t)(key>>64),(int64_t)key,(int64_t)(key>>64),(int64_t)key,
+      (int64_t)(key>>64),(int64_t)key,(int64_t)(key>>64),(int64_t)key);
+    // the low lanes are even, the high lanes are odd.
+    const __mmask8 lo_le = _mm512_cmp_epu64_mask(v,k,_MM_CMPINT_LE) & 0x55;
+    const __mmask8 hi_lt = (is_signed ? _mm512_cmp_epi64_mask(v,k,_MM_CMPINT_LT) :
+      _mm512_cmp_epu64_mask(v,k,_MM_CMPINT_LT)) & 0xaa;
+    const __mmask8 hi_eq = _mm512_cmpeq_epi64_mask(v,k) & 0xaa;
+    const unsigned r = hi_lt | (hi_eq & (lo_le << 1));
+    return ((r >> 1) & 1) | ((r >> 2) & 2) | ((r >> 3) & 4) | ((r >> 4) & 8);
+  }
+#endif
+
+  static const char * keyScanKernel = "scalar";
+
+  typedef unsigned (*KeyMaskFunc)(const void *, const unsigned __int128 &, const bool);
+
+  static KeyMaskFunc pickKeyMaskLE4() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      keyScanKernel = "avx512";
+      return keyMaskLE4Avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      keyScanKernel = "avx2";
+      return keyMaskLE4Avx2;
+    }
+#endif
+    return keyMaskLE4Scalar;
+  }
+
+  // The first call picks the kernel. keyMaskLE4 is initialized statically,
+  // so it works in the static initializers of the other modules too.
+  static unsigned keyMaskLE4Resolve(const void * keys, const unsigned __int128 & key,
+    const bool is_signed) {
+    KeyMaskFunc func = pickKeyMaskLE4();
+    __atomic_store_n(&keyMaskLE4,func,__ATOMIC_RELAXED);
+    return func(keys,key,is_signed);
+  }
+
+  KeyMaskFunc keyMaskLE4 = keyMaskLE4Resolve;
+
+  const char * getKeyScanKernel() noexcept(true) {
+    if (__atomic_load_n(&keyMaskLE4,__ATOMIC_RELAXED) == keyMaskLE4Resolve) {
+      __atomic_store_n(&keyMaskLE4,pickKeyMaskLE4(),__ATOMIC_RELAXED);
+    }
+    return keyScanKernel;
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef KEY_SCAN_HPP
+#define KEY_SCAN_HPP
+#include <sys/types.h>
+#include <inttypes.h>
+
+namespace ns_persistent {
+
+  // Compare four packed 128-bit keys with a key at once. The kernel is
+  // picked for the CPU when the library is loaded: AVX-512, AVX2 or scalar.
+  // @param keys - four keys, 64-byte aligned
+  // @param key - the key to compare with
+  // @param is_signed - if the keys are signed
+  // @return a mask with bit j set if keys[j] <= key
+  extern unsigned (*keyMaskLE4)(const void * keys, const unsigned __int128 & key,
+    const bool is_signed);
+
+  inline unsigned keyMaskLE(const __int128 * keys, const __int128 & key) {
+    return keyMaskLE4(keys,(unsigned __int128)key,true);
+  }
+
+  inline unsigned keyMaskLE(const unsigned __int128 * keys, const unsigned __int128 & key) {
+    return keyMaskLE4(keys,key,false);
+  }
+
+  // @return the name of the kernel in use: "avx512", "avx2" or "scalar".
+  const char * getKeyScanKernel() noexcept(true);
+}
+
+#endif//KEY_SCAN_HPP
@@ -0,0 +1,456 @@
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "MemLog.hpp"
+
+using namespace std;
+
+namespace ns_persistent {
+
+  /////////////////////////
+  // internal structures //
+  /////////////////////////
+
+  // the size of a transparent huge page
+  #define HUGE_PAGE_SIZE  (1UL<<21)
+
+  // if the ring buffers are backed by huge pages
+  #define MPL_HUGE        (this->m_oConfig.startup == SM_HUGEPAGE)
+
+  // allocate a ring buffer. With huge, it is aligned to huge pages, which
+  // back it if the kernel allows.
+  static void * allocRing(const uint64_t & size, const bool & huge) noexcept(false) {
+    if (huge && size >= HUGE_PAGE_SIZE) {
+      void * addr = aligned_alloc(HUGE_PAGE_SIZE,
+        (size + HUGE_PAGE_SIZE - 1)/HUGE_PAGE_SIZE*HUGE_PAGE_SIZE);
+      if (addr == nullptr) {
+        throw PERSIST_EXP_ALLOC(errno);
+      }
+      madvise(addr,size,MADV_HUGEPAGE);
+      return addr;
+    }
+    void * addr = malloc(MAX(size,1UL));
+    if (addr == nullptr) {
+      throw PERSIST_EXP_ALLOC(errno);
+    }
+    return addr;
+  }
+
+  ////////////////////////
+  // visible to outside //
+  ////////////////////////
+
+  MemPersistLog::MemPersistLog(const string & name, const PersistLogConfig & config)
+  noexcept(false) : PersistLog(name),
+    m_oConfig(config),
+    m_pLogRing(nullptr),
+    m_pDataRing(nullptr),
+    m_iHead(0),
+    m_iTail(0),
+    m_iDataTail(0),
+    m_iEntryFormat(0),
+    m_bReserved(false),
+    m_iReservedOfst(0),
+    m_iReservedSize(0) {
+    if (pthread_rwlock_init(&this->m_rwlock,NULL) != 0) {
+      throw PERSIST_EXP_RWLOCK_INIT(errno);
+    }
+    const uint64_t entries = MAX(config.log_entries,2UL);
+    const uint64_t size = MAX(config.data_size,1UL);
+    this->m_pLogRing = new MemRing{allocRing(entries*sizeof(MemLogEntry),MPL_HUGE),entries};
+    this->m_pDataRing = new MemRing{allocRing(size,MPL_HUGE),size};
+    dbg_trace("{0}:memory log created: log entries={1}, data size={2}.",name,entries,size);
+  }
+
+  MemPersistLog::~MemPersistLog() noexcept(true) {
+    pthread_rwlock_destroy(&this->m_rwlock);
+    this->m_retiredRings.push_back(this->m_pLogRing);
+    this->m_retiredRings.push_back(this->m_pDataRing);
+    for (auto ring : this->m_retiredRings) {
+      free(ring->addr);
+      delete ring;
+    }
+  }
+
+  void MemPersistLog::append(const void * pdata, const uint64_t & size,
+    const __int128 & ver, const HLCStamp & mhlc) noexcept(false) {
+    void * pdst = this->reserve(size);
+    memcpy(pdst,pdata,size);
+    this->commit(ver,mhlc);
+  }
+
+  void * MemPersistLog::reserve(const uint64_t & size) noexcept(false) {
+    // hold the write lock till commit() or cancel().
+    MPL_WRLOCK;
+    if (this->m_bReserved) {
+      MPL_UNLOCK;
+      throw PERSIST_EXP_INV_RESERVATION;
+    }
+    try {
+      this->m_iReservedOfst = prepareAppend(size);
+    } catch (uint64_t e) {
+      MPL_UNLOCK;
+      throw e;
+    }
+    this->m_iReservedSize = size;
+    this->m_bReserved = true;
+    return dataAt(this->m_iReservedOfst);
+  }
+
+  void MemPersistLog::commit(const __int128 & ver, const HLCStamp & mhlc) noexcept(false) {
+    if (!this->m_bReserved) {
+      throw PERSIST_EXP_INV_RESERVATION;
+    }
+    if (this->m_iTail > this->m_iHead && entryAt(this->m_iTail - 1)->ver >= ver) {
+      this->cancel();
+      throw PERSIST_EXP_INV_VERSION;
+    }
+    MemLogEntry * ple = entryAt(this->m_iTail);
+    ple->ver = ver;
+    ple->dlen = this->m_iReservedSize;
+    ple->ofst = this->m_iReservedOfst;
+    ple->hlc = mhlc;
+    this->m_iDataTail = this->m_iReservedOfst + this->m_iReservedSize;
+    __atomic_store_n(&this->m_iTail,this->m_iTail + 1,__ATOMIC_RELEASE);
+    this->m_bReserved = false;
+    MPL_UNLOCK;
+  }
+
+  void MemPersistLog::cancel() noexcept(false) {
+    if (!this->m_bReserved) {
+      return;
+    }
+    // the reserved space is taken by the next reservation.
+    this->m_bReserved = false;
+    MPL_UNLOCK;
+  }
+
+  void MemPersistLog::appendBatch(const std::vector<PersistLogEntry> & entries)
+  noexcept(false) {
+    if (entries.empty()) {
+      return;
+    }
+    MPL_WRLOCK;
+    if (this->m_bReserved) {
+      MPL_UNLOCK;
+      throw PERSIST_EXP_INV_RESERVATION;
+    }
+    // validate the whole batch before writing any of it.
+    uint64_t total = 0;
+    __int128 ver = (this->m_iTail > this->m_iHead) ? entryAt(this->m_iTail - 1)->ver : INVALID_VERSION;
+    for (const auto & e : entries) {
+      if (ver != INVALID_VERSION && ver >= e.ver) {
+        MPL_UNLOCK;
+        throw PERSIST_EXP_INV_VERSION;
+      }
+      ver = e.ver;
+      total += e.size;
+    }
+    uint64_t ofst;
+    try {
+      ofst = prepareAppend(total,entries.size());
+    } catch (uint64_t e) {
+      MPL_UNLOCK;
+      throw e;
+    }
+    int64_t idx = this->m_iTail;
+    for (const auto & e : entries) {
+      MemLogEntry * ple = entryAt(idx++);
+      memcpy(dataAt(ofst),e.pdata,e.size);
+      ple->ver = e.ver;
+      ple->dlen = e.size;
+      ple->ofst = ofst;
+      ple->hlc = e.mhlc;
+      ofst += e.size;
+    }
+    this->m_iDataTail = ofst;
+    __atomic_store_n(&this->m_iTail,idx,__ATOMIC_RELEASE);
+    MPL_UNLOCK;
+  }
+
+  int64_t MemPersistLog::getLength() noexcept(false) {
+    return __atomic_load_n(&this->m_iTail,__ATOMIC_ACQUIRE) -
+      __atomic_load_n(&this->m_iHead,__ATOMIC_ACQUIRE);
+  }
+
+  int64_t MemPersistLog::getEarliestIndex() noexcept(false) {
+    int64_t idx;
+    MPL_RDLOCK;
+    idx = (this->m_iTail == this->m_iHead) ? INVALID_INDEX : this->m_iHead;
+    MPL_UNLOCK;
+    return idx;
+  }
+
+  const void * MemPersistLog::getEntryByIndex(const int64_t & eidx) noexcept(false) {
+    const void * pdat;
+    MPL_RDLOCK;
+    const int64_t ridx = (eidx < 0) ? (this->m_iTail + eidx) : eidx;
+    if (this->m_iTail <= ridx || ridx < this->m_iHead) {
+      MPL_UNLOCK;
+      throw PERSIST_EXP_INV_ENTRY_IDX(eidx);
+    }
+    pdat = dataAt(entryAt(ridx)->ofst);
+    MPL_UNLOCK;
+    return pdat;
+  }
+
+  const void * MemPersistLog::getEntry(const __int128 & ver) noexcept(false) {
+    const void * pdat;
+    MPL_RDLOCK;
+    const int64_t idx = searchVersion(ver);
+    pdat = (idx == -1) ? nullptr : dataAt(entryAt(idx)->ofst);
+    MPL_UNLOCK;
+    return pdat;
+  }
+
+  const void * MemPersistLog::getEntry(const HLCStamp & hlc) noexcept(false) {
+    const void * pdat;
+    MPL_RDLOCK;
+    const int64_t idx = searchHlc(hlc.key());
+    pdat = (idx == -1) ? nullptr : dataAt(entryAt(idx)->ofst);
+    MPL_UNLOCK;
+    return pdat;
+  }
+
+  int64_t MemPersistLog::getLatestIndex() noexcept(false) {
+    int64_t head = __atomic_load_n(&this->m_iHead,__ATOMIC_ACQUIRE);
+    int64_t tail = __atomic_load_n(&this->m_iTail,__ATOMIC_ACQUIRE);
+    return (tail > head) ? tail - 1 : -1;
+  }
+
+  int64_t MemPersistLog::getIndex(const __int128 & ver) noexcept(false) {
+    int64_t idx;
+    MPL_RDLOCK;
+    idx = searchVersion(ver);
+    MPL_UNLOCK;
+    return idx;
+  }
+
+  int64_t MemPersistLog::getIndex(const HLCStamp & hlc) noexcept(false) {
+    int64_t idx;
+    MPL_RDLOCK;
+    idx = searchHlc(hlc.key());
+    MPL_UNLOCK;
+    return idx;
+  }
+
+  void MemPersistLog::getIndexRange(const HLCStamp & from, const HLCStamp & to,
+    int64_t & first, int64_t & last) noexcept(false) {
+    MPL_RDLOCK;
+    searchHlcRange(from.key(),to.key(),
+      first,last);
+    MPL_UNLOCK;
+  }
+
+  int64_t MemPersistLog::getIndexNotBefore(const HLCStamp & hlc) noexcept(false) {
+    const unsigned __int128 key = hlc.key();
+    int64_t idx;
+    MPL_RDLOCK;
+    idx = searchNotBefore<unsigned __int128>(
+      [&](const unsigned __int128 & k) {
+        return searchHlc(k);
+      },
+      key,0,this->m_iHead);
+    if (idx >= this->m_iTail) {
+      idx = -1;
+    }
+    MPL_UNLOCK;
+    return idx;
+  }
+
+  int64_t MemPersistLog::getEntries(const HLCStamp & from, const HLCStamp & to,
+    std::vector<const void *> & entries, std::vector<char> * buffer) noexcept(false) {
+    int64_t first, last;
+    MPL_RDLOCK;
+    searchHlcRange(from.key(),to.key(),
+      first,last);
+    readEntries(first,last,entries);
+    MPL_UNLOCK;
+    return first;
+  }
+
+  int64_t MemPersistLog::getEntries(const __int128 & from, const __int128 & to,
+    std::vector<const void *> & entries, std::vector<char> * buffer) noexcept(false) {
+    int64_t first, last;
+    MPL_RDLOCK;
+    searchRange<__int128>(
+      [&](const __int128 & ver) {
+        return searchVersion(ver);
+      },
+      from,to,INVALID_VERSION,this->m_iHead,first,last);
+    readEntries(first,last,entries);
+    MPL_UNLOCK;
+    return first;
+  }
+
+  int64_t MemPersistLog::getEntriesByIndex(const int64_t & from, const int64_t & to,
+    std::vector<const void *> & entries, std::vector<char> * buffer) noexcept(false) {
+    int64_t first, last;
+    MPL_RDLOCK;
+    first = MAX(from,this->m_iHead);
+    last = MAX(first,MIN(to,this->m_iTail));
+    readEntries(first,last,entries);
+    MPL_UNLOCK;
+    return first;
+  }
+
+  uint64_t MemPersistLog::getDataSize(const int64_t & idx) noexcept(false) {
+    uint64_t size = 0;
+    MPL_RDLOCK;
+    const int64_t first = MAX(idx,this->m_iHead);
+    if (first < this->m_iTail) {
+      size = this->m_iDataTail - entryAt(first)->ofst;
+    }
+    MPL_UNLOCK;
+    return size;
+  }
+
+  uint32_t MemPersistLog::getEntryFormat() noexcept(false) {
+    return __atomic_load_n(&this->m_iEntryFormat,__ATOMIC_ACQUIRE);
+  }
+
+  void MemPersistLog::setEntryFormat(const uint32_t & format) noexcept(false) {
+    __atomic_store_n(&this->m_iEntryFormat,format,__ATOMIC_RELEASE);
+  }
+
+  const __int128 MemPersistLog::persist() noexcept(false) {
+    // the entries are published to the readers by commit(), so there is
+    // nothing to flush: return the latest version.
+    __int128 ver = INVALID_VERSION;
+    MPL_RDLOCK;
+    if (this->m_iTail > this->m_iHead) {
+      ver = entryAt(this->m_iTail - 1)->ver;
+    }
+    MPL_UNLOCK;
+    return ver;
+  }
+
+  void MemPersistLog::trim(const int64_t & idx) noexcept(false) {
+    MPL_WRLOCK;
+    if (idx >= this->m_iHead && idx < this->m_iTail) {
+      __atomic_store_n(&this->m_iHead,idx + 1,__ATOMIC_RELEASE);
+    }
+    MPL_UNLOCK;
+  }
+
+  void MemPersistLog::trim(const __int128 & ver) noexcept(false) {
+    MPL_WRLOCK;
+    const int64_t idx = searchVersion(ver);
+    if (idx != -1) {
+      __atomic_store_n(&this->m_iHead,idx + 1,__ATOMIC_RELEASE);
+    }
+    MPL_UNLOCK;
+  }
+
+  void MemPersistLog::trim(const HLCStamp & hlc) noexcept(false) {
+    MPL_WRLOCK;
+    const int64_t idx = searchHlc(hlc.key());
+    if (idx != -1) {
+      __atomic_store_n(&this->m_iHead,idx + 1,__ATOMIC_RELEASE);
+    }
+    MPL_UNLOCK;
+  }
+
+  //////////////////////////
+  // invisible to outside //
+  //////////////////////////
+
+  uint64_t MemPersistLog::prepareAppend(const uint64_t & size, const uint64_t & num)
+  noexcept(false) {
+    while (true) {
+      // the data of the entries does not cross the end of the ring: it
+      // starts from the beginning of the ring if it does not fit.
+      const uint64_t ringSize = this->m_pDataRing->size;
+      uint64_t ofst = this->m_iDataTail;
+      if (ofst % ringSize + size > ringSize) {
+        ofst += ringSize - ofst % ringSize;
+      }
+      const uint64_t used = (this->m_iTail == this->m_iHead) ? size :
+        ofst + size - entryAt(this->m_iHead)->ofst;
+      if ((uint64_t)(this->m_iTail - this->m_iHead) + num <= this->m_pLogRing->size &&
+          used <= ringSize) {
+        return ofst;
+      }
+      grow(num,size);
+    }
+  }
+
+  void MemPersistLog::grow(const uint64_t & num, const uint64_t & size) noexcept(false) {
+    const uint64_t len = (uint64_t)(this->m_iTail - this->m_iHead);
+    // STEP 1: grow the log ring
+    if (len + num > this->m_pLogRing->size) {
+      uint64_t entries = this->m_pLogRing->size;
+      while (entries < len + num && entries < this->m_oConfig.log_entries_limit) {
+        entries = MIN(entries<<1,this->m_oConfig.log_entries_limit);
+      }
+      if (entries < len + num) {
+        throw PERSIST_EXP_NOSPACE_LOG;
+      }
+      dbg_info("{0} grow log from {1} to {2} entries.",this->m_sName,this->m_pLogRing->size,entries);
+      MemRing * ring = new MemRing{allocRing(entries*sizeof(MemLogEntry),MPL_HUGE),entries};
+      for (int64_t idx = this->m_iHead; idx < this->m_iTail; idx++) {
+        ((MemLogEntry *)ring->addr)[(uint64_t)idx % entries] = *entryAt(idx);
+      }
+      this->m_retiredRings.push_back(this->m_pLogRing);
+      this->m_pLogRing = ring;
+      return;
+    }
+    // STEP 2: grow the data ring, and compact the data to its beginning.
+    uint64_t live = 0;
+    for (int64_t idx = this->m_iHead; idx < this->m_iTail; idx++) {
+      live += entryAt(idx)->dlen;
+    }
+    uint64_t dataSize = this->m_pDataRing->size;
+    do {
+      dataSize = MIN(dataSize<<1,this->m_oConfig.data_size_limit);
+    } while (dataSize < live + size && dataSize < this->m_oConfig.data_size_limit);
+    if (dataSize <= this->m_pDataRing->size || dataSize < live + size) {
+      throw PERSIST_EXP_NOSPACE_DATA;
+    }
+    dbg_info("{0} grow data from {1} to {2} bytes.",this->m_sName,this->m_pDataRing->size,dataSize);
+    MemRing * ring = new MemRing{allocRing(dataSize,MPL_HUGE),dataSize};
+    uint64_t ofst = 0;
+    for (int64_t idx = this->m_iHead; idx < this->m_iTail; idx++) {
+      MemLogEntry * ple = entryAt(idx);
+      memcpy((uint8_t *)ring->addr + ofst,dataAt(ple->ofst),ple->dlen);
+      ple->ofst = ofst;
+      ofst += ple->dlen;
+    }
+    this->m_iDataTail = ofst;
+    this->m_retiredRings.push_back(this->m_pDataRing);
+    this->m_pDataRing = ring;
+  }
+
+  int64_t MemPersistLog::searchVersion(const __int128 & ver) noexcept(true) {
+    return searchLast<__int128>(
+      [&](int64_t idx) {
+        return entryAt(idx)->ver;
+      },
+      ver,this->m_iHead,this->m_iTail);
+  }
+
+  int64_t MemPersistLog::searchHlc(const unsigned __int128 & key) noexcept(true) {
+    return searchLast<unsigned __int128>(
+      [&](int64_t idx) {
+        return entryAt(idx)->hlc.key();
+      },
+      key,this->m_iHead,this->m_iTail);
+  }
+
+  void MemPersistLog::searchHlcRange(const unsigned __int128 & from,
+    const unsigned __int128 & to, int64_t & first, int64_t & last) noexcept(true) {
+    searchRange<unsigned __int128>(
+      [&](const unsigned __int128 & key) {
+        return searchHlc(key);
+      },
+      from,to,0,this->m_iHead,first,last);
+  }
+
+  void MemPersistLog::readEntries(const int64_t & first, const int64_t & last,
+    std::vector<const void *> & entries) noexcept(true) {
+    for (int64_t idx = first; idx < last; idx++) {
+      entries.push_back(dataAt(entryAt(idx)->ofst));
+    }
+  }
+}
@@ -0,0 +1,165 @@
+#ifndef MEM_LOG_HPP
+#define MEM_LOG_HPP
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "util.hpp"
+#include "PersistLog.hpp"
+
+namespace ns_persistent {
+
+  // MemPersistLog keeps a log on the heap for the volatile variables. The log
+  // entries and data are kept in a pair of ring buffers, which grow on demand
+  // till the limits in PersistLogConfig. There is no file and no syscall on
+  // the append path, and persist() only publishes the appended entries.
+  // SM_HUGEPAGE backs the rings with huge pages. The other knobs of
+  // PersistLogConfig are ignored.
+  class MemPersistLog : public PersistLog {
+  protected:
+    // a log entry. The data of an entry is contiguous in the data ring.
+    typedef struct mem_log_entry {
+      __int128 ver;     // version of the data
+      uint64_t dlen;    // length of the data
+      uint64_t ofst;    // offset of the data in the data ring
+      HLCStamp hlc;     // hlc clock of the data
+    } MemLogEntry;
+
+    // a ring buffer. Growing a ring buffer replaces it instead of changing it
+    // so that a reader always sees a matching address and size.
+    typedef struct mem_ring {
+      void * addr;
+      uint64_t size;
+    } MemRing;
+
+    // the log capacities
+    const PersistLogConfig m_oConfig;
+    // the log entries, with m_pLogRing->size entries
+    MemRing * m_pLogRing;
+    // the data, with m_pDataRing->size bytes
+    MemRing * m_pDataRing;
+    // the ring buffers replaced by growing. They are kept till the log is
+    // destroyed because readers may still hold pointers to them.
+    std::vector<MemRing *> m_retiredRings;
+    // the entries in [head,tail) are in the log.
+    int64_t m_iHead;
+    int64_t m_iTail;
+    // the offset after the data of the last entry
+    uint64_t m_iDataTail;
+    // the format of the entries, see PersistLog::getEntryFormat()
+    uint32_t m_iEntryFormat;
+    // the space reserved by reserve() for the next entry
+    bool m_bReserved;
+    uint64_t m_iReservedOfst;
+    uint64_t m_iReservedSize;
+    // read/write lock
+    pthread_rwlock_t m_rwlock;
+
+    // lock macro
+    #define MPL_WRLOCK \
+    do { \
+      if (pthread_rwlock_wrlock(&this->m_rwlock) != 0) { \
+        throw PERSIST_EXP_RWLOCK_WRLOCK(errno); \
+      } \
+    } while (0)
+
+    #define MPL_RDLOCK \
+    do { \
+      if (pthread_rwlock_rdlock(&this->m_rwlock) != 0) { \
+        throw PERSIST_EXP_RWLOCK_RDLOCK(errno); \
+      } \
+    } while (0)
+
+    #define MPL_UNLOCK \
+    do { \
+      if (pthread_rwlock_unlock(&this->m_rwlock) != 0) { \
+        throw PERSIST_EXP_RWLOCK_UNLOCK(errno); \
+      } \
+    } while (0)
+
+    // get a log entry. We assume MPL_RDLOCK or MPL_WRLOCK is acquired.
+    MemLogEntry * entryAt(const int64_t & idx) noexcept(true) {
+      return (MemLogEntry *)this->m_pLogRing->addr + (uint64_t)idx % this->m_pLogRing->size;
+    }
+
+    // get the data at an offset. We assume MPL_RDLOCK or MPL_WRLOCK is
+    // acquired.
+    void * dataAt(const uint64_t & ofst) noexcept(true) {
+      return (void *)((uint8_t *)this->m_pDataRing->addr + ofst % this->m_pDataRing->size);
+    }
+
+    // Make room for num new entries with size bytes of data in total, and
+    // return the offset of the data of the first one. The data of the
+    // entries are contiguous. We assume MPL_WRLOCK is acquired.
+    uint64_t prepareAppend(const uint64_t & size, const uint64_t & num = 1) noexcept(false);
+
+    // Replace the rings with larger ones for num more entries and size more
+    // bytes of data. The live data is compacted to the start of the new data
+    // ring. We assume MPL_WRLOCK is acquired.
+    void grow(const uint64_t & num, const uint64_t & size) noexcept(false);
+
+    // Search the latest entry in [m_iHead,m_iTail) with version equal or
+    // earlier than ver, or -1. We assume MPL_RDLOCK or MPL_WRLOCK is acquired.
+    int64_t searchVersion(const __int128 & ver) noexcept(true);
+
+    // Search the latest entry in [m_iHead,m_iTail) with HLC equal or earlier
+    // than key, which is HLCStamp::key(), or -1. We assume MPL_RDLOCK or
+    // MPL_WRLOCK is acquired.
+    int64_t searchHlc(const unsigned __int128 & key) noexcept(true);
+
+    // Search the entries with HLC in [from,to] and return them as
+    // [first,last). We assume MPL_RDLOCK or MPL_WRLOCK is acquired.
+    void searchHlcRange(const unsigned __int128 & from, const unsigned __int128 & to,
+      int64_t & first, int64_t & last) noexcept(true);
+
+    // Collect the data of the entries in [first,last). We assume MPL_RDLOCK
+    // or MPL_WRLOCK is acquired.
+    void readEntries(const int64_t & first, const int64_t & last,
+      std::vector<const void *> & entries) noexcept(true);
+
+  public:
+    //Constructor
+    MemPersistLog(const string & name,
+      const PersistLogConfig & config = PersistLogConfig()) noexcept(false);
+    //Destructor
+    virtual ~MemPersistLog() noexcept(true);
+
+    //Derived from PersistLog
+    virtual void append(const void * pdata,
+      const uint64_t & size, const __int128 & ver,
+      const HLCStamp & mhlc) noexcept(false);
+    virtual void * reserve(const uint64_t & size) noexcept(false);
+    virtual void commit(const __int128 & ver, const HLCStamp & mhlc) noexcept(false);
+    virtual void cancel() noexcept(false);
+    virtual void appendBatch(const std::vector<PersistLogEntry> & entries) noexcept(false);
+    virtual int64_t getLength() noexcept(false);
+    virtual int64_t getEarliestIndex() noexcept(false);
+    virtual const void* getEntryByIndex(const int64_t & eno) noexcept(false);
+    virtual const void* getEntry(const __int128 & ver) noexcept(false);
+    virtual const void* getEntry(const HLCStamp & hlc) noexcept(false);
+    virtual int64_t getLatestIndex() noexcept(false);
+    virtual int64_t getIndex(const __int128 & ver) noexcept(false);
+    virtual int64_t getIndex(const HLCStamp & hlc) noexcept(false);
+    virtual void getIndexRange(const HLCStamp & from, const HLCStamp & to,
+      int64_t & first, int64_t & last) noexcept(false);
+    virtual int64_t getIndexNotBefore(const HLCStamp & hlc) noexcept(false);
+    virtual int64_t getEntries(const HLCStamp & from, const HLCStamp & to,
+      std::vector<const void *> & entries,
+      std::vector<char> * buffer = nullptr) noexcept(false);
+    virtual int64_t getEntries(const __int128 & from, const __int128 & to,
+      std::vector<const void *> & entries,
+      std::vector<char> * buffer = nullptr) noexcept(false);
+    virtual int64_t getEntriesByIndex(const int64_t & from, const int64_t & to,
+      std::vector<const void *> & entries,
+      std::vector<char> * buffer = nullptr) noexcept(false);
+    virtual uint64_t getDataSize(const int64_t & idx) noexcept(false);
+    virtual uint32_t getEntryFormat() noexcept(false);
+    virtual void setEntryFormat(const uint32_t & format) noexcept(false);
+    virtual const __int128 persist() noexcept(false);
+    virtual void trim(const int64_t & idx) noexcept(false);
+    virtual void trim(const __int128 & ver) noexcept(false);
+    virtual void trim(const HLCStamp & hlc) noexcept(false);
+  };
+}
+
+#endif//MEM_LOG_HPP
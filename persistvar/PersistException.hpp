@@ -41,6 +41,16 @@ namespace ns_persistent{
   #define PERSIST_EXP_NOSPACE(x)                        PERSIST_EXP(30,(x))
   #define PERSIST_EXP_NOSPACE_LOG                       PERSIST_EXP_NOSPACE(1)
   #define PERSIST_EXP_NOSPACE_DATA                      PERSIST_EXP_NOSPACE(2)
+  #define PERSIST_EXP_REMOVE_FILE(x)                    PERSIST_EXP(31,(x))
+  #define PERSIST_EXP_COND_INIT(x)                      PERSIST_EXP(32,(x))
+  #define PERSIST_EXP_CREATE_THREAD(x)                  PERSIST_EXP(33,(x))
+  #define PERSIST_EXP_CORRUPTED_META                    PERSIST_EXP(34,0)
+  #define PERSIST_EXP_INV_RESERVATION                   PERSIST_EXP(35,0)
+  #define PERSIST_EXP_NO_CHECKPOINT(x)                  PERSIST_EXP(36,(x))
+  #define PERSIST_EXP_DECOMPRESS(x)                     PERSIST_EXP(37,(x))
+  #define PERSIST_EXP_NOT_IN_SNAPSHOT                   PERSIST_EXP(38,0)
+  #define PERSIST_EXP_REGISTERED                        PERSIST_EXP(39,0)
+  #define PERSIST_EXP_ENTRY_FORMAT(x)                   PERSIST_EXP(40,(x))
 }
 
 #endif//PERSISTENT_EXCEPTION_HPP
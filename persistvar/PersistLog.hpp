@@ -9,6 +9,7 @@
 #include <inttypes.h>
 #include <map>
 #include <string>
+#include <vector>
 #include "PersistException.hpp"
 #include "HLC.hpp"
 
@@ -17,15 +18,207 @@ using namespace std;
 namespace ns_persistent {
 
   // Storage type:
+  // ST_3DXP - like ST_FILE, but the files are on persistent memory, which is
+  //           flushed by cache lines. See PersistLogConfig::pmem.
+  // ST_DIRECT - like ST_FILE, but the log is kept in anonymous memory and
+  //           written to the files with direct I/O. See
+  //           PersistLogConfig::direct_io.
   enum StorageType{
     ST_FILE=0,
     ST_MEM,
-    ST_3DXP
+    ST_3DXP,
+    ST_DIRECT
+  };
+
+  // Log layout:
+  // LL_RING - the log entries and data are kept in a pair of ring buffers,
+  //           which grow on demand till the configured limits.
+  // LL_SEGMENT - the log entries and data are kept in a chain of fixed-size
+  //           segments, which are created on demand and retired by trim().
+  enum LogLayout{
+    LL_RING=0,
+    LL_SEGMENT
+  };
+
+  // Meta header format:
+  // MF_SWAP - the header is written to a swap file, which is renamed over
+  //           the meta file.
+  // MF_DUAL_SLOT - the meta file has two checksummed header slots, which
+  //           are overwritten in place alternately. load() picks the newest
+  //           valid one.
+  // MF_PMEM - the meta file has one header slot, whose tail and head are
+  //           updated in place by failure-atomic 8-byte stores. It is meant
+  //           for persistent memory.
+  enum MetaFormat{
+    MF_SWAP=0,
+    MF_DUAL_SLOT,
+    MF_PMEM
+  };
+
+  // Compression of the entry data:
+  // CT_NONE - the data is kept as it is.
+  // CT_LZ4 - the data is compressed in the LZ4 block format when it shrinks.
+  enum CompressionType{
+    CT_NONE=0,
+    CT_LZ4
+  };
+
+  // Startup mode of a log:
+  // SM_LAZY - the files are mapped, and the pages are faulted in on the
+  //           first accesses.
+  // SM_PREFAULT - like SM_LAZY, but a background thread faults in the tail
+  //           of the log, see PersistLogConfig::prefault_window.
+  // SM_HUGEPAGE - the logs kept in memory, of ST_MEM and the direct I/O
+  //           mode, are backed by transparent huge pages if possible. The
+  //           mapped files start as SM_LAZY.
+  enum StartupMode{
+    SM_LAZY=0,
+    SM_PREFAULT,
+    SM_HUGEPAGE
   };
 
   #define INVALID_VERSION ((__int128)-1L)
   #define INVALID_INDEX INT64_MAX
 
+  // default capacities of a log: the log starts with the initial sizes and
+  // grows on demand till the limits.
+  #define DEFAULT_LOG_ENTRIES           (1UL<<10)
+  #define DEFAULT_LOG_ENTRIES_LIMIT     (1UL<<24)
+  #define DEFAULT_DATA_SIZE             (1UL<<20)
+  #define DEFAULT_DATA_SIZE_LIMIT       (1UL<<32)
+  // default sizes of a segment
+  #define DEFAULT_SEGMENT_LOG_ENTRIES   (1UL<<14)
+  #define DEFAULT_SEGMENT_DATA_SIZE     (1UL<<26)
+  // default group commit knobs
+  #define DEFAULT_GROUP_COMMIT_WINDOW_US    (100)
+  #define DEFAULT_GROUP_COMMIT_MAX_BATCH    (64)
+  // default bytes of the log tail faulted in by SM_PREFAULT
+  #define DEFAULT_PREFAULT_WINDOW           (1UL<<26)
+  // default number of threads verifying the log entries on load
+  #define DEFAULT_RECOVERY_THREADS          (4)
+
+  // Log configuration, which is passed to the log through the constructor of
+  // Persistent<T>.
+  struct PersistLogConfig {
+    // initial number of log entries
+    uint64_t log_entries = DEFAULT_LOG_ENTRIES;
+    // the number of log entries can grow up to this limit
+    uint64_t log_entries_limit = DEFAULT_LOG_ENTRIES_LIMIT;
+    // initial size of the data buffer in bytes
+    uint64_t data_size = DEFAULT_DATA_SIZE;
+    // the data buffer can grow up to this limit
+    uint64_t data_size_limit = DEFAULT_DATA_SIZE_LIMIT;
+    // the layout of a new log. An existing log keeps its layout.
+    LogLayout layout = LL_RING;
+    // number of log entries in a segment, for LL_SEGMENT
+    uint64_t segment_log_entries = DEFAULT_SEGMENT_LOG_ENTRIES;
+    // size of a data segment in bytes, for LL_SEGMENT. A data segment is
+    // enlarged for an entry larger than this.
+    uint64_t segment_data_size = DEFAULT_SEGMENT_DATA_SIZE;
+    // the meta header format of a new log. An existing log keeps its format.
+    MetaFormat meta_format = MF_SWAP;
+    // Group commit: persist() hands the request to a flusher thread, which
+    // serves all the pending requests with one flush.
+    bool group_commit = false;
+    // how long the flusher waits for more requests before a flush
+    uint64_t group_commit_window_us = DEFAULT_GROUP_COMMIT_WINDOW_US;
+    // the flusher does not wait for more requests than this
+    uint64_t group_commit_max_batch = DEFAULT_GROUP_COMMIT_MAX_BATCH;
+    // Single-writer mode: append() and reserve() are called by one thread at
+    // a time, so they do not lock, and the readers do not lock either. For
+    // LL_RING only.
+    bool single_writer = false;
+    // Keep a run-length index of the versions, which answers getEntry(ver)
+    // and trim(ver) by arithmetic for dense or strided versions.
+    bool version_index = false;
+    // Keep the versions and HLCs of the entries packed in separate arrays,
+    // which getEntry() and trim() search instead of the log entries.
+    bool packed_keys = false;
+    // Compress the data of the entries. The readers get the data
+    // decompressed in a buffer of the thread, see getEntry().
+    CompressionType compression = CT_NONE;
+    // Direct I/O: the ring buffers are kept in anonymous memory instead of
+    // mapping the files, and persist() writes the new ranges to the files
+    // opened with O_DIRECT through io_uring, or pwritev() if io_uring is not
+    // available. For LL_RING only.
+    bool direct_io = false;
+    // Persistent memory: the files are mapped with MAP_SYNC, and persist()
+    // flushes the cache lines of the new entries instead of msync(). A new
+    // log takes the MF_PMEM meta format. On a file system without DAX, the
+    // persistent memory is emulated by the page cache. It is ignored with
+    // direct_io.
+    bool pmem = false;
+    // Crash recovery: the log entries carry checksums. On load, this many
+    // threads verify the entries in parallel chunks. The intact entries
+    // appended after the last persist() are recovered, for LL_RING. The
+    // last persisted entry is verified as well, and the log is truncated
+    // before the first torn entry if it is torn. 0 trusts the meta header.
+    uint32_t recovery_threads = DEFAULT_RECOVERY_THREADS;
+    // verify all the persisted entries on load, which takes time in the
+    // size of the log.
+    bool verify_persisted = false;
+    // how the pages of the log are brought in after the log is loaded
+    StartupMode startup = SM_LAZY;
+    // SM_PREFAULT faults in the latest entries and their data up to this
+    // many bytes.
+    uint64_t prefault_window = DEFAULT_PREFAULT_WINDOW;
+  };
+
+  // An entry for PersistLog::appendBatch(). See PersistLog::append() for
+  // the fields.
+  struct PersistLogEntry {
+    const void * pdata;
+    uint64_t size;
+    __int128 ver;
+    HLCStamp mhlc;
+  };
+
+  // Search helpers of the PersistLog implementations, for the keys growing
+  // with the index, like versions and HLCs.
+
+  // Search the last entry in [head,tail) with key equal or earlier than key.
+  // @return the index of the entry, or -1 if it does not exist.
+  template<typename TKey,typename KeyGetter>
+  inline int64_t searchLast(const KeyGetter & keyGetter, const TKey & key,
+    const int64_t & head, const int64_t & tail) noexcept(true) {
+    int64_t low = head, high = tail;
+    // the first entry later than key follows the last one equal or earlier.
+    while (low < high) {
+      const int64_t mid = low + (high - low)/2;
+      if (keyGetter(mid) <= key) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    return (low == head) ? -1 : low - 1;
+  }
+
+  // Get the first entry with key equal or later than key, where lastSearcher
+  // searches the last entry with a key equal or earlier than its argument,
+  // or -1, and no key is earlier than minKey. The result is the tail if
+  // there is no such entry.
+  template<typename TKey,typename LastSearcher>
+  inline int64_t searchNotBefore(const LastSearcher & lastSearcher, const TKey & key,
+    const TKey & minKey, const int64_t & head) noexcept(false) {
+    // the first entry not before key follows the last one before it.
+    const int64_t idx = (key <= minKey) ? -1 : lastSearcher(key - 1);
+    return (idx == -1) ? head : idx + 1;
+  }
+
+  // Get the entries [first,last) with keys in [from,to], see searchNotBefore().
+  template<typename TKey,typename LastSearcher>
+  inline void searchRange(const LastSearcher & lastSearcher, const TKey & from,
+    const TKey & to, const TKey & minKey, const int64_t & head,
+    int64_t & first, int64_t & last) noexcept(false) {
+    first = searchNotBefore<TKey>(lastSearcher,from,minKey,head);
+    const int64_t idx = lastSearcher(to);
+    last = (idx == -1) ? head : idx + 1;
+    if (last < first) {
+      last = first;
+    }
+  }
+
   // Persistent log interfaces
   class PersistLog{
   protected:
@@ -51,7 +244,36 @@ namespace ns_persistent {
      */
     virtual void append(const void * pdata, 
       const uint64_t & size, const __int128 & ver, 
-      const HLC & mhlc) noexcept(false) = 0;
+      const HLCStamp & mhlc) noexcept(false) = 0;
+
+    /** Zero-copy Append
+     * reserve() returns the space for the data of the next entry, in which the
+     * caller writes the serialized data. commit() appends the entry with the
+     * data. cancel() drops the reservation instead. Only one reservation can
+     * be outstanding; append() is not allowed till it is committed or
+     * cancelled by the thread who made it.
+     * @param size - length of the data
+     * @return the space of size bytes in the log.
+     */
+    virtual void * reserve(const uint64_t & size) noexcept(false) = 0;
+
+    /** Commit the reservation
+     * @param ver - version of the data, see append().
+     * @param mhlc - the hlc clock of the data, see append().
+     * If the version is invalid, the reservation is cancelled.
+     */
+    virtual void commit(const __int128 & ver, const HLCStamp & mhlc) noexcept(false) = 0;
+
+    // Cancel the reservation, if any.
+    virtual void cancel() noexcept(false) = 0;
+
+    /** Batched Append
+     * Append the entries in one shot: they are validated together, so
+     * none of them is appended if any is invalid, and they become visible to
+     * the readers together.
+     * @param entries - the entries to append, in increasing versions.
+     */
+    virtual void appendBatch(const std::vector<PersistLogEntry> & entries) noexcept(false) = 0;
 
     // Get the length of the log 
     virtual int64_t getLength() noexcept(false) = 0;
@@ -60,6 +282,9 @@ namespace ns_persistent {
     virtual int64_t getEarliestIndex() noexcept(false) = 0;
 
     // Get a version by entry number
+    // If the entry is compressed, the data returned by getEntryByIndex() and
+    // getEntry() is decompressed in a buffer of the calling thread, which is
+    // reused by the next of these calls of the thread.
     virtual const void* getEntryByIndex(const int64_t & eno) noexcept(false) = 0;
 
     // Get the latest version equal or earlier than ver.
@@ -68,7 +293,67 @@ namespace ns_persistent {
     // Get the latest version - deprecated.
     // virtual const void* getEntry() noexcept(false) = 0;
     // Get a version specified by hlc
-    virtual const void* getEntry(const HLC & hlc) noexcept(false) = 0;
+    virtual const void* getEntry(const HLCStamp & hlc) noexcept(false) = 0;
+
+    // Get the index of the latest entry, or -1 if the log is empty.
+    virtual int64_t getLatestIndex() noexcept(false) = 0;
+
+    // Get the index of the latest entry with version equal or earlier than
+    // ver, or -1 if there is no such entry.
+    virtual int64_t getIndex(const __int128 & ver) noexcept(false) = 0;
+
+    // Get the index of the latest entry with HLC equal or earlier than hlc, or
+    // -1 if there is no such entry.
+    virtual int64_t getIndex(const HLCStamp & hlc) noexcept(false) = 0;
+
+    /**
+     * Get the entries with HLC in [from,to], inclusively.
+     * @param first - the index of the first entry in the range
+     * @param last - the index after the last entry in the range. The range is
+     *        empty if last equals first.
+     */
+    virtual void getIndexRange(const HLCStamp & from, const HLCStamp & to,
+      int64_t & first, int64_t & last) noexcept(false) = 0;
+
+    // Get the index of the first entry with HLC equal or later than hlc, or -1
+    // if there is no such entry.
+    virtual int64_t getIndexNotBefore(const HLCStamp & hlc) noexcept(false) = 0;
+
+    /**
+     * Get the data of the entries with HLC in [from,to] in one call.
+     * @param entries - the data of the entries, in the order of the log
+     * @param buffer - the buffer where the compressed entries are
+     *        decompressed. If it is nullptr, a buffer of the calling thread is
+     *        used, which is reused by the next of these calls of the thread.
+     * @return the index of the first entry
+     */
+    virtual int64_t getEntries(const HLCStamp & from, const HLCStamp & to,
+      std::vector<const void *> & entries,
+      std::vector<char> * buffer = nullptr) noexcept(false) = 0;
+
+    // Get the data of the entries with version in [from,to] in one call.
+    // See getEntries(const HLCStamp & ,const HLCStamp & ,std::vector<const void*>&,std::vector<char>*).
+    virtual int64_t getEntries(const __int128 & from, const __int128 & to,
+      std::vector<const void *> & entries,
+      std::vector<char> * buffer = nullptr) noexcept(false) = 0;
+
+    // Get the data of the entries in [from,to) in one call. The range is
+    // clamped to the entries in the log.
+    // @return the index of the first entry
+    virtual int64_t getEntriesByIndex(const int64_t & from, const int64_t & to,
+      std::vector<const void *> & entries,
+      std::vector<char> * buffer = nullptr) noexcept(false) = 0;
+
+    // Get the bytes the data of the entries from index idx to the latest one
+    // takes in the log, or 0 if there is no such entry.
+    virtual uint64_t getDataSize(const int64_t & idx) noexcept(false) = 0;
+
+    // Get the format of the entries, which is recorded in the log by its
+    // user, e.g. the delta mode of Persistent<T>. It is 0 for a new log.
+    virtual uint32_t getEntryFormat() noexcept(false) = 0;
+
+    // Record the format of the entries. It is durable once it returns.
+    virtual void setEntryFormat(const uint32_t & format) noexcept(false) = 0;
 
     /**
      * Persist the log till specified version
@@ -95,7 +380,7 @@ namespace ns_persistent {
      * Trim the log till HLC clock, inclusively.
      * @param hlc - all log entry before hlc will be trimmed.
      */
-    virtual void trim(const HLC & hlc) noexcept(false) = 0;
+    virtual void trim(const HLCStamp & hlc) noexcept(false) = 0;
   };
 }
 
@@ -7,11 +7,19 @@
 #include <iostream>
 #include <memory>
 #include <functional>
+#include <vector>
+#include <iterator>
+#include <type_traits>
 #include <pthread.h>
 #include "HLC.hpp"
 #include "PersistException.hpp"
 #include "PersistLog.hpp"
 #include "FilePersistLog.hpp"
+#include "MemLog.hpp"
+#include "SharedLog.hpp"
+#include "Registry.hpp"
+#include "VersionCache.hpp"
+#include "DeltaSupport.hpp"
 #include "SerializationSupport.hpp"
 
 using namespace mutils;
@@ -24,18 +32,38 @@ namespace ns_persistent {
   #define DECLARE_PERSIST_VAR(_t,_n,_s) \
     extern DEFINE_PERSIST_VAR(_t,_n,_s)
 
-  /* deprecated
-  // number of versions in the cache
-  #define MAX_NUM_CACHED_VERSION        (1024)
-  #define VERSION_HASH(v)               ( (int)((v) & (MAX_NUM_CACHED_VERSION-1)) )
+  // The configuration of a Persistent variable: the configuration of its
+  // log, and of the cache of deserialized versions.
+  struct PersistentConfig : public PersistLogConfig {
+    // number of versions in the cache, 0 disables the cache.
+    std::size_t cache_versions = 0;
+    CachePolicy cache_policy = CP_LRU;
+    // Delta mode, for the types with delta support (see DeltaSupport.hpp):
+    // version() appends the delta of the object since the last version. A
+    // full checkpoint is appended every delta_checkpoint_versions versions,
+    // or once the deltas since the last checkpoint reach
+    // delta_checkpoint_bytes, if it is not 0. 0 versions disables delta mode.
+    // The mode is recorded in the log: opening a log with entries in the
+    // other mode throws PERSIST_EXP_ENTRY_FORMAT.
+    uint32_t delta_checkpoint_versions = 0;
+    uint64_t delta_checkpoint_bytes = 0;
+    // Shared log: the name of a shared log, into which the log of the
+    // variable is multiplexed with the other variables of the same shared
+    // log, see SharedLog.hpp. Empty for a log of its own. For the storage
+    // types on files.
+    std::string shared_log;
+    // the registry the variable joins, see Registry.hpp. nullptr for none.
+    PersistentRegistry * registry = nullptr;
+    // the versions kept by the maintenance thread of the registry, see
+    // RetentionPolicy. A variable with a retention policy and without a
+    // registry joins PersistentRegistry::getDefault().
+    RetentionPolicy retention;
 
-  // invalid version:
-  #define INVALID_VERSION (-1ll)
-
-  // read from cache
-  #define VERSION_IS_CACHED(v)  (this->m_aCache[VERSION_HASH(v)].ver == (v))
-  #define GET_CACHED_OBJ_PTR(v) (this->m_aCache[VERSION_HASH(v)].obj)
-  */
+    PersistentConfig() = default;
+    PersistentConfig(const PersistLogConfig & config):
+      PersistLogConfig(config) {
+    }
+  };
 
   // function types to be registered for create version
   // or persist version
@@ -63,35 +91,75 @@ namespace ns_persistent {
   //   - Return value is a pointer to a new created ObjectType deserialized from
   //     'pdata' buffer.
   // - StorageType: storage type is defined in PersistLog. The value could be
-  //   ST_FILE/ST_MEM/ST_3DXP ... I will start with ST_FILE and extend it to
+  //   ST_FILE/ST_MEM/ST_3DXP/ST_DIRECT ... I will start with ST_FILE and extend it to
   //   other persistent Storage.
   // TODO:comments
   template <typename ObjectType,
     StorageType storageType=ST_FILE>
-  class Persistent{
+  class Persistent : public PersistentVariable {
   public:
       /** The constructor
        * @param func_register_cb Call this to register myself to Replicated<T>
        * @param object_name This name is used for persistent data in file.
+       * @param config The configuration of the log, e.g. its capacity, and
+       *        of the version cache.
        */
       Persistent(FuncRegisterCallback func_register_cb=nullptr,
-        const char * object_name = (*Persistent::getNameMaker().make()).c_str())
+        const char * object_name = (*Persistent::getNameMaker().make()).c_str(),
+        const PersistentConfig & config = PersistentConfig())
         noexcept(false) {
          // Initialize log
         this->m_pLog = NULL;
+        this->m_pCache = nullptr;
+        this->m_bDelta = false;
+        this->m_iCheckpointVersions = config.delta_checkpoint_versions;
+        this->m_iCheckpointBytes = config.delta_checkpoint_bytes;
+        this->m_iDeltaVersions = 0;
+        this->m_iDeltaBytes = 0;
+        this->m_bNeedCheckpoint = true;
+        this->m_oRetention = config.retention;
+        if (config.delta_checkpoint_versions > 0) {
+          if (has_delta_support<ObjectType>::value) {
+            this->m_bDelta = true;
+          } else {
+            dbg_warn("{0}:delta mode is ignored by a type without delta support.",object_name);
+          }
+        }
         switch(storageType){
         // file system
         case ST_FILE:
-          this->m_pLog = new FilePersistLog(object_name);
+          this->m_pLog = newFileLog(object_name,config,config.shared_log);
           if(this->m_pLog == NULL){
             throw PERSIST_EXP_NEW_FAILED_UNKNOWN;
           }
           break;
         // volatile
         case ST_MEM:
+          if (!config.shared_log.empty()) {
+            dbg_warn("{0}:shared log is ignored by ST_MEM.",object_name);
+          }
+          this->m_pLog = new MemPersistLog(object_name,config);
+          if(this->m_pLog == NULL){
+            throw PERSIST_EXP_NEW_FAILED_UNKNOWN;
+          }
+          break;
+        // persistent memory
+        case ST_3DXP:
+        {
+          PersistLogConfig pmemConfig = config;
+          pmemConfig.pmem = true;
+          this->m_pLog = newFileLog(object_name,pmemConfig,config.shared_log);
+          if(this->m_pLog == NULL){
+            throw PERSIST_EXP_NEW_FAILED_UNKNOWN;
+          }
+          break;
+        }
+        // file system with direct I/O
+        case ST_DIRECT:
         {
-          const string tmpfsPath = "/dev/shm/volatile_t";
-          this->m_pLog = new FilePersistLog(object_name, tmpfsPath);
+          PersistLogConfig directConfig = config;
+          directConfig.direct_io = true;
+          this->m_pLog = newFileLog(object_name,directConfig,config.shared_log);
           if(this->m_pLog == NULL){
             throw PERSIST_EXP_NEW_FAILED_UNKNOWN;
           }
@@ -101,6 +169,28 @@ namespace ns_persistent {
         default:
           throw PERSIST_EXP_STORAGE_TYPE_UNKNOWN(storageType);
         }
+        // the log is read in the mode it is written. An empty log takes the
+        // mode of the variable.
+        try {
+          const uint32_t format = this->m_bDelta ? ENTRY_FORMAT_DELTA : ENTRY_FORMAT_PLAIN;
+          const uint32_t logFormat = this->m_pLog->getEntryFormat();
+          if (logFormat != format) {
+            if (this->m_pLog->getLength() > 0) {
+              dbg_warn("{0}:the log is written {1} delta mode.",object_name,
+                (logFormat == ENTRY_FORMAT_DELTA)? "in" : "without");
+              throw PERSIST_EXP_ENTRY_FORMAT(logFormat);
+            }
+            this->m_pLog->setEntryFormat(format);
+          }
+        } catch (...) {
+          delete this->m_pLog;
+          this->m_pLog = nullptr;
+          throw;
+        }
+        if (config.cache_versions > 0) {
+          this->m_pCache = new VersionCache<ObjectType>(config.cache_versions,
+            config.cache_policy);
+        }
         //register the version creator and persist callback
         if(func_register_cb != nullptr){
           func_register_cb(
@@ -108,13 +198,23 @@ namespace ns_persistent {
             std::bind(&Persistent<ObjectType,storageType>::persist,this)
         );
         }
+        if (config.registry != nullptr) {
+          config.registry->add(*this);
+        } else if (config.retention.enabled()) {
+          PersistentRegistry::getDefault().add(*this);
+        }
       }
       // destructor: release the resources
       virtual ~Persistent() noexcept(false){
+        // no snapshot reaches the variable from now on.
+        this->leaveRegistry();
         // destroy the in-memory log
         if(this->m_pLog != NULL){
           delete this->m_pLog;
         }
+        if (this->m_pCache != nullptr) {
+          delete this->m_pCache;
+        }
         //TODO:unregister the version creator and persist callback,
         // if the Persistent<T> is added to the pool dynamically.
       };
@@ -129,8 +229,10 @@ namespace ns_persistent {
 
       // get the latest Value of T. The user lambda will be fed with the latest object
       // zerocopy:this object will not live once it returns.
-      // return value is decided by user lambda
-      template <typename Func>
+      // return value is decided by user lambda. A clock is not a lambda: it
+      // goes to get(const HLCStamp &) below.
+      template <typename Func,
+        typename = typename std::enable_if<!std::is_convertible<Func,HLCStamp>::value>::type>
       auto get (
         const Func& fun, 
         DeserializationManager *dm=nullptr)
@@ -153,6 +255,9 @@ namespace ns_persistent {
         const Func& fun, 
         DeserializationManager *dm=nullptr)
         noexcept(false) {
+        if (this->m_bDelta) {
+          return fun(*this->loadByIndex(idx,dm));
+        }
         return deserialize_and_run<ObjectType>(dm,(char *)this->m_pLog->getEntryByIndex(idx),fun);
       };
 
@@ -161,6 +266,9 @@ namespace ns_persistent {
         int64_t idx, 
         DeserializationManager *dm=nullptr)
         noexcept(false) {
+        if (this->m_bDelta) {
+          return this->loadByIndex(idx,dm);
+        }
         return from_bytes<ObjectType>(dm,(char const *)this->m_pLog->getEntryByIndex(idx));      
       };
 
@@ -174,6 +282,13 @@ namespace ns_persistent {
         const Func& fun,
         DeserializationManager *dm=nullptr)
         noexcept(false) {
+        if (this->m_bDelta) {
+          int64_t idx = this->m_pLog->getIndex(ver);
+          if (idx == -1) {
+            throw PERSIST_EXP_INV_VERSION;
+          }
+          return fun(*this->loadByIndex(idx,dm));
+        }
         char * pdat = (char*)this->m_pLog->getEntry(ver);
         if (pdat == nullptr) {
           throw PERSIST_EXP_INV_VERSION;
@@ -187,6 +302,13 @@ namespace ns_persistent {
         const __int128 & ver,
         DeserializationManager *dm=nullptr)
         noexcept(false) {
+        if (this->m_bDelta) {
+          int64_t idx = this->m_pLog->getIndex(ver);
+          if (idx == -1) {
+            throw PERSIST_EXP_INV_VERSION;
+          }
+          return this->loadByIndex(idx,dm);
+        }
         char const * pdat = (char const *)this->m_pLog->getEntry(ver);
         if (pdat == nullptr) {
           throw PERSIST_EXP_INV_VERSION;
@@ -195,10 +317,41 @@ namespace ns_persistent {
         return from_bytes<ObjectType>(dm,pdat);
       }
 
+      // trim the versions till the key, inclusively. The versions pinned by
+      // the snapshots and the versions after them are kept.
       template <typename TKey>
       void trim (const TKey &k) noexcept(false) {
         dbg_trace("trim.");
-        this->m_pLog->trim(k);
+        PV_LOCK;
+        try {
+          if (this->m_bDelta) {
+            // keep the checkpoint of the earliest version kept.
+            const int64_t idx = this->clampTrim(this->toIndex(k));
+            if (idx != -1 && idx < this->m_pLog->getLatestIndex()) {
+              std::vector<const void *> entries;
+              std::vector<char> buffer;
+              const int64_t ckpt = this->findCheckpoint(idx + 1,entries,buffer);
+              if (ckpt > this->m_pLog->getEarliestIndex()) {
+                this->m_pLog->trim((int64_t)(ckpt - 1));
+              }
+            } else if (idx != -1) {
+              // all versions are trimmed: the next one starts a checkpoint.
+              this->m_pLog->trim(idx);
+              this->m_bNeedCheckpoint = true;
+            }
+          } else if (this->m_pins.empty()) {
+            this->m_pLog->trim(k);
+          } else {
+            this->m_pLog->trim(this->clampTrim(this->toIndex(k)));
+          }
+        } catch (...) {
+          PV_UNLOCK;
+          throw;
+        }
+        PV_UNLOCK;
+        if (this->m_pCache != nullptr) {
+          this->m_pCache->trim(this->m_pLog->getEarliestIndex());
+        }
         dbg_trace("trim...done");
       }
 
@@ -208,10 +361,17 @@ namespace ns_persistent {
       // return value is decided by the user lambda.
       template <typename Func>
       auto get (
-        const HLC& hlc,
+        const HLCStamp & hlc,
         const Func& fun,
         DeserializationManager *dm=nullptr)
         noexcept(false) {
+        if (this->m_bDelta) {
+          int64_t idx = this->m_pLog->getIndex(hlc);
+          if (idx == -1) {
+            throw PERSIST_EXP_INV_HLC;
+          }
+          return fun(*this->loadByIndex(idx,dm));
+        }
         char * pdat = (char*)this->m_pLog->getEntry(hlc);
         if (pdat == nullptr) {
           throw PERSIST_EXP_INV_HLC;
@@ -221,9 +381,16 @@ namespace ns_persistent {
 
       // get a version of value T. specified by HLC clock.
       std::unique_ptr<ObjectType> get(
-        const HLC& hlc,
+        const HLCStamp & hlc,
         DeserializationManager *dm=nullptr)
         noexcept(false) {
+        if (this->m_bDelta) {
+          int64_t idx = this->m_pLog->getIndex(hlc);
+          if (idx == -1) {
+            throw PERSIST_EXP_INV_HLC;
+          }
+          return this->loadByIndex(idx,dm);
+        }
         char const * pdat = (char const *)this->m_pLog->getEntry(hlc);
         if (pdat == nullptr) {
           throw PERSIST_EXP_INV_HLC;
@@ -232,6 +399,361 @@ namespace ns_persistent {
         return from_bytes<ObjectType>(dm,pdat);
       }
 
+      // get a version of value T, shared with the other readers. The versions
+      // are cached if the cache is enabled in the configuration.
+      // @param idx the index of the version. A negative index counts back
+      //        from the latest version, which is -1.
+      std::shared_ptr<const ObjectType> getCachedByIndex(
+        int64_t idx,
+        DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        if (idx < 0) {
+          const int64_t ridx = this->m_pLog->getLatestIndex() + 1 + idx;
+          if (ridx < 0) {
+            throw PERSIST_EXP_INV_ENTRY_IDX(idx);
+          }
+          idx = ridx;
+        }
+        std::shared_ptr<const ObjectType> obj;
+        if (this->m_pCache != nullptr) {
+          obj = this->m_pCache->get(idx);
+          if (obj) {
+            return obj;
+          }
+        }
+        obj = this->load(idx,(char const *)this->m_pLog->getEntryByIndex(idx),dm);
+        if (this->m_pCache != nullptr) {
+          this->m_pCache->put(idx,obj);
+        }
+        return obj;
+      }
+
+      // get the latest version of value T, shared with the other readers.
+      std::shared_ptr<const ObjectType> getCached(
+        DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        return this->getCachedByIndex(-1L,dm);
+      }
+
+      // get a version of value T specified by version, shared with the other
+      // readers.
+      std::shared_ptr<const ObjectType> getCached(
+        const __int128 & ver,
+        DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        int64_t idx = this->m_pLog->getIndex(ver);
+        if (idx == -1) {
+          throw PERSIST_EXP_INV_VERSION;
+        }
+        return this->getCachedByIndex(idx,dm);
+      }
+
+      // get a version of value T specified by HLC clock, shared with the
+      // other readers.
+      std::shared_ptr<const ObjectType> getCached(
+        const HLCStamp & hlc,
+        DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        int64_t idx = this->m_pLog->getIndex(hlc);
+        if (idx == -1) {
+          throw PERSIST_EXP_INV_HLC;
+        }
+        return this->getCachedByIndex(idx,dm);
+      }
+
+      // get the version of value T in a snapshot, see PersistentRegistry.
+      // The version is read by its index in the snapshot without searching
+      // the log.
+      std::unique_ptr<ObjectType> get(
+        const Snapshot & snap,
+        DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        const int64_t idx = snap.getIndex(*this);
+        if (idx == -1) {
+          throw PERSIST_EXP_INV_VERSION;
+        }
+        return this->getByIndex(idx,dm);
+      }
+
+      // feed the version of value T in a snapshot to the user lambda.
+      // zerocopy: this object will not live once it returns.
+      // return value is decided by the user lambda.
+      template <typename Func>
+      auto get (
+        const Snapshot & snap,
+        const Func& fun,
+        DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        const int64_t idx = snap.getIndex(*this);
+        if (idx == -1) {
+          throw PERSIST_EXP_INV_VERSION;
+        }
+        return this->getByIndex(idx,fun,dm);
+      }
+
+      // get the version of value T in a snapshot, shared with the other
+      // readers.
+      std::shared_ptr<const ObjectType> getCached(
+        const Snapshot & snap,
+        DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        const int64_t idx = snap.getIndex(*this);
+        if (idx == -1) {
+          throw PERSIST_EXP_INV_VERSION;
+        }
+        return this->getCachedByIndex(idx,dm);
+      }
+
+      // VersionRange is a range of versions read from the log at once: the
+      // log is locked only once to take the range. The iterators walk the
+      // entries in the log without locking, and deserialize a version only
+      // when it is dereferenced. The range pins its first version like a
+      // snapshot, so its versions are not trimmed till it is released or
+      // destroyed. The variable must outlive its ranges. The compressed
+      // versions are decompressed in the buffer of the range, so a range can
+      // be moved but not copied.
+      class VersionRange {
+      public:
+        class iterator {
+        public:
+          typedef std::bidirectional_iterator_tag iterator_category;
+          typedef std::unique_ptr<ObjectType> value_type;
+          typedef std::ptrdiff_t difference_type;
+          typedef void pointer;
+          typedef std::unique_ptr<ObjectType> reference;
+
+          iterator(const VersionRange * range, std::size_t pos):
+            m_pRange(range),
+            m_iPos(pos) {
+          }
+
+          // get a copy of the version
+          std::unique_ptr<ObjectType> operator * () const noexcept(false) {
+            return this->m_pRange->m_pOwner->load(this->getIndex(),
+              (char const *)this->m_pRange->m_entries[this->m_iPos],this->m_pRange->m_pDM);
+          }
+
+          // feed the version to the user lambda.
+          // zerocopy: this object will not live once it returns.
+          template <typename Func>
+          auto get(const Func & fun) const noexcept(false) {
+            if (this->m_pRange->m_pOwner->m_bDelta) {
+              return fun(*(**this));
+            }
+            return deserialize_and_run<ObjectType>(this->m_pRange->m_pDM,
+              (char *)this->m_pRange->m_entries[this->m_iPos],fun);
+          }
+
+          // the index of the version in the log
+          int64_t getIndex() const {
+            return this->m_pRange->m_iFirst + (int64_t)this->m_iPos;
+          }
+
+          iterator & operator ++ () {
+            this->m_iPos ++;
+            return *this;
+          }
+
+          iterator operator ++ (int) {
+            iterator it = *this;
+            this->m_iPos ++;
+            return it;
+          }
+
+          iterator & operator -- () {
+            this->m_iPos --;
+            return *this;
+          }
+
+          iterator operator -- (int) {
+            iterator it = *this;
+            this->m_iPos --;
+            return it;
+          }
+
+          bool operator == (const iterator & other) const {
+            return this->m_iPos == other.m_iPos && this->m_pRange == other.m_pRange;
+          }
+
+          bool operator != (const iterator & other) const {
+            return !(*this == other);
+          }
+
+        private:
+          const VersionRange * m_pRange;
+          std::size_t m_iPos;
+        };
+        typedef std::reverse_iterator<iterator> reverse_iterator;
+
+        VersionRange(Persistent * owner, DeserializationManager * dm):
+          m_iFirst(0),
+          m_iPin(-1),
+          m_pOwner(owner),
+          m_pDM(dm) {
+        }
+
+        VersionRange(VersionRange && other) noexcept(true):
+          m_entries(std::move(other.m_entries)),
+          m_buffer(std::move(other.m_buffer)),
+          m_iFirst(other.m_iFirst),
+          m_iPin(other.m_iPin),
+          m_pOwner(other.m_pOwner),
+          m_pDM(other.m_pDM) {
+          other.m_entries.clear();
+          other.m_iPin = -1;
+        }
+
+        VersionRange & operator = (VersionRange && other) noexcept(false) {
+          if (this != &other) {
+            this->release();
+            this->m_entries = std::move(other.m_entries);
+            this->m_buffer = std::move(other.m_buffer);
+            this->m_iFirst = other.m_iFirst;
+            this->m_iPin = other.m_iPin;
+            this->m_pOwner = other.m_pOwner;
+            this->m_pDM = other.m_pDM;
+            other.m_entries.clear();
+            other.m_iPin = -1;
+          }
+          return *this;
+        }
+
+        VersionRange(const VersionRange &) = delete;
+        VersionRange & operator = (const VersionRange &) = delete;
+
+        virtual ~VersionRange() noexcept(true) {
+          try {
+            this->release();
+          } catch (...) {
+            dbg_warn("failed to release a version range.");
+          }
+        }
+
+        // Unpin the versions. The range is empty afterwards.
+        void release() noexcept(false) {
+          this->m_entries.clear();
+          if (this->m_iPin != -1) {
+            this->m_pOwner->unpin(this->m_iPin);
+            this->m_iPin = -1;
+          }
+        }
+
+        iterator begin() const {
+          return iterator(this,0);
+        }
+
+        iterator end() const {
+          return iterator(this,this->m_entries.size());
+        }
+
+        reverse_iterator rbegin() const {
+          return reverse_iterator(this->end());
+        }
+
+        reverse_iterator rend() const {
+          return reverse_iterator(this->begin());
+        }
+
+        // the number of versions in the range
+        std::size_t size() const {
+          return this->m_entries.size();
+        }
+
+        bool empty() const {
+          return this->m_entries.empty();
+        }
+
+        // the index of the first version in the log
+        int64_t getFirstIndex() const {
+          return this->m_iFirst;
+        }
+
+      private:
+        friend class Persistent;
+        std::vector<const void *> m_entries;
+        std::vector<char> m_buffer;
+        int64_t m_iFirst;
+        // the pinned index, or -1
+        int64_t m_iPin;
+        Persistent * m_pOwner;
+        DeserializationManager * m_pDM;
+      };
+
+      // get the versions with index in [from,to).
+      VersionRange getRangeByIndex(
+        const int64_t & from,
+        const int64_t & to,
+        DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        VersionRange range(this,dm);
+        range.m_iPin = this->pinRange(from);
+        range.m_iFirst = this->m_pLog->getEntriesByIndex(from,to,range.m_entries,&range.m_buffer);
+        return range;
+      }
+
+      // get the versions with version in [from,to].
+      VersionRange getRange(
+        const __int128 & from,
+        const __int128 & to,
+        DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        VersionRange range(this,dm);
+        range.m_iPin = this->pinRange(from);
+        range.m_iFirst = this->m_pLog->getEntries(from,to,range.m_entries,&range.m_buffer);
+        return range;
+      }
+
+      // get the versions with HLC clock in [from,to].
+      VersionRange getRange(
+        const HLCStamp & from,
+        const HLCStamp & to,
+        DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        VersionRange range(this,dm);
+        range.m_iPin = this->pinRange(from);
+        range.m_iFirst = this->m_pLog->getEntries(from,to,range.m_entries,&range.m_buffer);
+        return range;
+      }
+
+      // feed the versions with index in [from,to) to the user lambda in order.
+      // zerocopy: the objects will not live once the lambda returns.
+      template <typename Func>
+      void forEachByIndex(
+        const int64_t & from,
+        const int64_t & to,
+        const Func & fun,
+        DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        const VersionRange range = this->getRangeByIndex(from,to,dm);
+        this->forEachIn(range,fun);
+      }
+
+      // feed the versions with version in [from,to] to the user lambda in order.
+      // zerocopy: the objects will not live once the lambda returns.
+      template <typename Func>
+      void forEachInRange(
+        const __int128 & from,
+        const __int128 & to,
+        const Func & fun,
+        DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        const VersionRange range = this->getRange(from,to,dm);
+        this->forEachIn(range,fun);
+      }
+
+      // feed the versions with HLC clock in [from,to] to the user lambda in order.
+      // zerocopy: the objects will not live once the lambda returns.
+      template <typename Func>
+      void forEachInRange(
+        const HLCStamp & from,
+        const HLCStamp & to,
+        const Func & fun,
+        DeserializationManager *dm=nullptr)
+        noexcept(false) {
+        const VersionRange range = this->getRange(from,to,dm);
+        this->forEachIn(range,fun);
+      }
+
       // syntax sugar: get a specified version of T without DSM
       std::unique_ptr<ObjectType> operator [](int64_t idx)
         noexcept(false) {
@@ -245,7 +767,7 @@ namespace ns_persistent {
       }
 
       // syntax sugar: get a specified version of T without DSM
-      std::unique_ptr<ObjectType> operator [](const HLC & hlc)
+      std::unique_ptr<ObjectType> operator [](const HLCStamp & hlc)
         noexcept(false) {
         return this->get(hlc);
       }
@@ -260,26 +782,53 @@ namespace ns_persistent {
       }
 
       // make a version with version and mhlc clock
-      virtual void set(const ObjectType &v, const __int128 & ver, const HLC &mhlc) 
+      virtual void set(const ObjectType &v, const __int128 & ver, const HLCStamp & mhlc) 
         noexcept(false) {
+        if (this->m_bDelta) {
+          // a checkpoint of v. The deltas of wrapped_obj follow it only if v
+          // is wrapped_obj.
+          this->m_bNeedCheckpoint = true;
+        }
+        const std::size_t hsize = this->m_bDelta ? DELTA_HEADER_SIZE : 0;
         auto size = bytes_size(v);
-        char buf[size];
-        bzero(buf,size);
-        to_bytes(v,buf);
-        this->m_pLog->append((void*)buf,size,ver,mhlc);
+        // serialize in place in the log
+        char * buf = (char *)this->m_pLog->reserve(hsize + size);
+        try {
+          if (this->m_bDelta) {
+            ((DeltaHeader *)buf)->kind = DELTA_KIND_CHECKPOINT;
+          }
+          to_bytes(v,buf + hsize);
+        } catch (...) {
+          this->m_pLog->cancel();
+          throw;
+        }
+        this->m_pLog->commit(ver,mhlc);
+        if (this->m_bDelta && &v == &this->wrapped_obj) {
+          // the changes so far are in the checkpoint.
+          DeltaOps<ObjectType>::since(this->wrapped_obj,nullptr);
+          this->m_iDeltaVersions = 0;
+          this->m_iDeltaBytes = 0;
+          this->m_bNeedCheckpoint = false;
+        }
       };
 
       // make a version with version
       virtual void set(const ObjectType &v, const __int128 & ver)
         noexcept(false) {
-        HLC mhlc; // generate a default timestamp for it.
+        const HLCStamp mhlc = HLCStamp::now(); // stamp it with the rtc clock.
         this->set(v,ver,mhlc);
       }
 
       // make a version
       virtual void version(const __int128 & ver)
         noexcept(false) {
-        this->set(this->wrapped_obj,ver);
+        if (this->m_bDelta && !this->m_bNeedCheckpoint &&
+            this->m_iDeltaVersions + 1 < this->m_iCheckpointVersions &&
+            (this->m_iCheckpointBytes == 0 || this->m_iDeltaBytes < this->m_iCheckpointBytes)) {
+          this->appendDelta(ver);
+        } else {
+          this->set(this->wrapped_obj,ver);
+        }
       }
 
       /** persist till version
@@ -334,12 +883,203 @@ namespace ns_persistent {
       };
 
   private:
+      // append the delta of wrapped_obj since the last version.
+      void appendDelta(const __int128 & ver) noexcept(false) {
+        const HLCStamp mhlc = HLCStamp::now(); // stamp it with the rtc clock.
+        const std::size_t size = DeltaOps<ObjectType>::size(this->wrapped_obj);
+        char * buf = (char *)this->m_pLog->reserve(DELTA_HEADER_SIZE + size);
+        // the delta is lost if it is not committed.
+        this->m_bNeedCheckpoint = true;
+        try {
+          ((DeltaHeader *)buf)->kind = DELTA_KIND_DELTA;
+          DeltaOps<ObjectType>::since(this->wrapped_obj,buf + DELTA_HEADER_SIZE);
+        } catch (...) {
+          this->m_pLog->cancel();
+          throw;
+        }
+        this->m_pLog->commit(ver,mhlc);
+        this->m_bNeedCheckpoint = false;
+        this->m_iDeltaVersions ++;
+        this->m_iDeltaBytes += size;
+      }
+
+      // Get the data of the versions from the checkpoint of version idx to
+      // version idx. The compressed versions are decompressed in buffer.
+      // @return the index of the checkpoint
+      int64_t findCheckpoint(const int64_t & idx, std::vector<const void *> & entries,
+        std::vector<char> & buffer) noexcept(false) {
+        int64_t to = idx + 1;
+        int64_t chunk = 16;
+        std::vector<char> scratch;
+        while (true) {
+          std::vector<const void *> part;
+          const int64_t first = this->m_pLog->getEntriesByIndex(to - chunk,to,part,&scratch);
+          for (std::size_t i = part.size(); i-- > 0;) {
+            if (DELTA_HEADER(part[i])->kind == DELTA_KIND_CHECKPOINT) {
+              // take the versions from the checkpoint at once.
+              entries.clear();
+              return this->m_pLog->getEntriesByIndex(first + (int64_t)i,idx + 1,
+                entries,&buffer);
+            }
+          }
+          if ((int64_t)part.size() < chunk) {
+            // reached the head of the log.
+            throw PERSIST_EXP_NO_CHECKPOINT(idx);
+          }
+          to = first;
+          chunk *= 2;
+        }
+      }
+
+      // deserialize the version at index idx, whose data is pdat. In delta
+      // mode, it is rebuilt from the checkpoint before it.
+      std::unique_ptr<ObjectType> load(const int64_t & idx, char const * pdat,
+        DeserializationManager *dm) noexcept(false) {
+        if (!this->m_bDelta) {
+          return from_bytes<ObjectType>(dm,pdat);
+        }
+        if (DELTA_HEADER(pdat)->kind == DELTA_KIND_CHECKPOINT) {
+          return from_bytes<ObjectType>(dm,DELTA_PAYLOAD(pdat));
+        }
+        std::vector<const void *> entries;
+        std::vector<char> buffer;
+        this->findCheckpoint(idx,entries,buffer);
+        std::unique_ptr<ObjectType> obj = from_bytes<ObjectType>(dm,DELTA_PAYLOAD(entries[0]));
+        for (std::size_t i = 1; i < entries.size(); i++) {
+          DeltaOps<ObjectType>::apply(*obj,DELTA_PAYLOAD(entries[i]));
+        }
+        return obj;
+      }
+
+      // load the version at index idx, which counts back from the latest
+      // version if it is negative.
+      std::unique_ptr<ObjectType> loadByIndex(int64_t idx, DeserializationManager *dm)
+        noexcept(false) {
+        if (idx < 0) {
+          idx += this->m_pLog->getLatestIndex() + 1;
+        }
+        return this->load(idx,(char const *)this->m_pLog->getEntryByIndex(idx),dm);
+      }
+
+      // feed the versions in a range to the user lambda. In delta mode, the
+      // deltas are applied to one object one after another, so the lambda
+      // should not change the object.
+      template <typename Func>
+      void forEachIn(const VersionRange & range, const Func & fun) noexcept(false) {
+        if (!this->m_bDelta) {
+          for (auto it = range.begin(); it != range.end(); ++it) {
+            it.get(fun);
+          }
+          return;
+        }
+        std::unique_ptr<ObjectType> obj;
+        for (std::size_t i = 0; i < range.m_entries.size(); i++) {
+          char const * pdat = (char const *)range.m_entries[i];
+          if (DELTA_HEADER(pdat)->kind == DELTA_KIND_CHECKPOINT) {
+            obj = from_bytes<ObjectType>(range.m_pDM,DELTA_PAYLOAD(pdat));
+          } else if (!obj) {
+            obj = this->load(range.m_iFirst + (int64_t)i,pdat,range.m_pDM);
+          } else {
+            DeltaOps<ObjectType>::apply(*obj,DELTA_PAYLOAD(pdat));
+          }
+          fun(*obj);
+        }
+      }
+
+      // the index of the latest version equal or earlier than the key
+      int64_t toIndex(const int64_t & idx) noexcept(false) {
+        return idx;
+      }
+
+      int64_t toIndex(const __int128 & ver) noexcept(false) {
+        return this->m_pLog->getIndex(ver);
+      }
+
+      int64_t toIndex(const HLCStamp & hlc) noexcept(false) {
+        return this->m_pLog->getIndex(hlc);
+      }
+
+      // Pin the versions of a range starting from the key before they are
+      // read, see VersionRange. A trim either finishes before, or keeps the
+      // versions from the pinned index on.
+      // @return the pinned index, at or before the first version of the range
+      template <typename TKey>
+      int64_t pinRange(const TKey & from) noexcept(false) {
+        PV_LOCK;
+        int64_t idx;
+        try {
+          int64_t earliest, latest;
+          this->lookupIndexes(earliest,latest);
+          // the versions appended to an empty log are pinned from index 0.
+          idx = (latest == -1 || earliest == INVALID_INDEX) ? 0 :
+            MAX(this->toIndex(from),earliest);
+          this->m_pins[idx] ++;
+        } catch (...) {
+          PV_UNLOCK;
+          throw;
+        }
+        PV_UNLOCK;
+        return idx;
+      }
+
+  protected:
+      // Derived from PersistentVariable
+      virtual int64_t lookup(const __int128 & ver) noexcept(false) {
+        return this->m_pLog->getIndex(ver);
+      }
+
+      virtual int64_t lookup(const HLCStamp & hlc) noexcept(false) {
+        return this->m_pLog->getIndex(hlc);
+      }
+
+      virtual void lookupIndexes(int64_t & earliest, int64_t & latest) noexcept(false) {
+        earliest = this->m_pLog->getEarliestIndex();
+        latest = this->m_pLog->getLatestIndex();
+      }
+
+      virtual uint64_t lookupDataSize(const int64_t & idx) noexcept(false) {
+        return this->m_pLog->getDataSize(idx);
+      }
+
+      virtual void trimIndex(const int64_t & idx) noexcept(false) {
+        this->trim(idx);
+      }
+
+      virtual void persistLog() noexcept(false) {
+        this->persist();
+      }
+
+  private:
+      // create the log on files, of its own or in the shared log.
+      static PersistLog * newFileLog(const char * object_name,
+        const PersistLogConfig & config, const std::string & sharedLog) noexcept(false) {
+        if (sharedLog.empty()) {
+          return new FilePersistLog(object_name,config);
+        }
+        return new SharedPersistLog(sharedLog,object_name,config);
+      }
+
       // wrapped objected
       ObjectType wrapped_obj;
       
       // PersistLog
       PersistLog * m_pLog;
 
+      // the cache of deserialized versions, nullptr if it is disabled
+      VersionCache<ObjectType> * m_pCache;
+
+      // delta mode
+      bool m_bDelta;
+      // checkpoint every m_iCheckpointVersions versions or m_iCheckpointBytes
+      // bytes of deltas
+      uint32_t m_iCheckpointVersions;
+      uint64_t m_iCheckpointBytes;
+      // the versions and bytes of deltas since the last checkpoint
+      uint32_t m_iDeltaVersions;
+      uint64_t m_iDeltaBytes;
+      // if the next version must be a checkpoint
+      bool m_bNeedCheckpoint;
+
       // get the static name maker.
       static _NameMaker & getNameMaker();
   };
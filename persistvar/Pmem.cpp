@@ -0,0 +1,110 @@
+#include <errno.h>
+#include <sys/mman.h>
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#include "Pmem.hpp"
+
+namespace ns_persistent {
+
+  // the first cache line of an address
+  #define PMEM_LINE_OF(x)   ((uint64_t)(x) & ~(PMEM_LINE_SIZE - 1))
+
+#if defined(__x86_64__)
+  // the feature bits of cpuid leaf 7, in ebx
+  #define CPUID_CLFLUSHOPT  (1U << 23)
+  #define CPUID_CLWB        (1U << 24)
+
+  __attribute__((target("clwb")))
+  static void pmemFlushClwb(const void * addr, const uint64_t & len) {
+    for (uint64_t p = PMEM_LINE_OF(addr); p < (uint64_t)addr + len; p += PMEM_LINE_SIZE) {
+      _mm_clwb((void *)p);
+    }
+  }
+
+  __attribute__((target("clflushopt")))
+  static void pmemFlushClflushopt(const void * addr, const uint64_t & len) {
+    for (uint64_t p = PMEM_LINE_OF(addr); p < (uint64_t)addr + len; p += PMEM_LINE_SIZE) {
+      _mm_clflushopt((void *)p);
+    }
+  }
+
+  static void pmemFlushClflush(const void * addr, const uint64_t & len) {
+    for (uint64_t p = PMEM_LINE_OF(addr); p < (uint64_t)addr + len; p += PMEM_LINE_SIZE) {
+      _mm_clflush((void *)p);
+    }
+  }
+#else
+  // no cache line flush: only the ordering of pmemDrain() is kept.
+  static void pmemFlushNone(const void * addr, const uint64_t & len) {
+  }
+#endif
+
+  static const char * pmemFlushKernel = "none";
+
+  typedef void (*PmemFlushFunc)(const void *, const uint64_t &);
+
+  static PmemFlushFunc pickPmemFlush() {
+#if defined(__x86_64__)
+    unsigned eax, ebx = 0, ecx, edx;
+    __get_cpuid_count(7,0,&eax,&ebx,&ecx,&edx);
+    if (ebx & CPUID_CLWB) {
+      pmemFlushKernel = "clwb";
+      return pmemFlushClwb;
+    }
+    if (ebx & CPUID_CLFLUSHOPT) {
+      pmemFlushKernel = "clflushopt";
+      return pmemFlushClflushopt;
+    }
+    pmemFlushKernel = "clflush";
+    return pmemFlushClflush;
+#else
+    return pmemFlushNone;
+#endif
+  }
+
+  // The first call picks the instruction, like keyMaskLE4.
+  static void pmemFlushResolve(const void * addr, const uint64_t & len) {
+    PmemFlushFunc func = pickPmemFlush();
+    __atomic_store_n(&pmemFlush,func,__ATOMIC_RELAXED);
+    func(addr,len);
+  }
+
+  PmemFlushFunc pmemFlush = pmemFlushResolve;
+
+  void pmemDrain() noexcept(true) {
+#if defined(__x86_64__)
+    // clwb and clflushopt are ordered by sfence; clflush is ordered anyway.
+    _mm_sfence();
+#else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+  }
+
+  void * pmemMap(void * addr, const uint64_t & len, const int & fd,
+    const off_t & ofst, bool & dax) noexcept(true) {
+    const int fixed = (addr == NULL)? 0 : MAP_FIXED;
+    void * ret = MAP_FAILED;
+#if defined(MAP_SYNC) && defined(MAP_SHARED_VALIDATE)
+    ret = mmap(addr,len,PROT_READ|PROT_WRITE,MAP_SHARED_VALIDATE|MAP_SYNC|fixed,fd,ofst);
+    if (ret != MAP_FAILED) {
+      dax = true;
+      return ret;
+    }
+    // the file system or the kernel does not support MAP_SYNC.
+    if (errno != EOPNOTSUPP && errno != EINVAL) {
+      return MAP_FAILED;
+    }
+#endif
+    dax = false;
+    return mmap(addr,len,PROT_READ|PROT_WRITE,MAP_SHARED|fixed,fd,ofst);
+  }
+
+  const char * getPmemFlushKernel() noexcept(true) {
+    if (__atomic_load_n(&pmemFlush,__ATOMIC_RELAXED) == pmemFlushResolve) {
+      __atomic_store_n(&pmemFlush,pickPmemFlush(),__ATOMIC_RELAXED);
+    }
+    return pmemFlushKernel;
+  }
+}
@@ -0,0 +1,35 @@
+#ifndef PMEM_HPP
+#define PMEM_HPP
+#include <sys/types.h>
+#include <inttypes.h>
+
+namespace ns_persistent {
+
+  // the size of a cache line, which is the unit of flushing
+  #define PMEM_LINE_SIZE    (64UL)
+
+  // Write the cache lines of [addr,addr+len) back to the memory. The lines
+  // are durable after pmemDrain(). The instruction is picked for the CPU
+  // when the library is loaded: clwb, clflushopt or clflush.
+  extern void (*pmemFlush)(const void * addr, const uint64_t & len);
+
+  // wait till the lines written back by pmemFlush() are durable.
+  void pmemDrain() noexcept(true);
+
+  // Map len bytes of fd at ofst to memory. The mapping is synchronous
+  // (MAP_SYNC) if the file is on a DAX file system, so that flushing the
+  // cache lines makes the stores durable without msync(). Otherwise, it falls
+  // back to an ordinary shared mapping, which emulates the persistent memory
+  // with the page cache: the flushed stores survive a crash of the process,
+  // but not of the machine. dax tells which one is used.
+  // @param addr - the address for MAP_FIXED, or NULL
+  // @return the address, or MAP_FAILED with errno set
+  void * pmemMap(void * addr, const uint64_t & len, const int & fd,
+    const off_t & ofst, bool & dax) noexcept(true);
+
+  // @return the name of the flush instruction in use: "clwb",
+  // "clflushopt", "clflush" or "none".
+  const char * getPmemFlushKernel() noexcept(true);
+}
+
+#endif//PMEM_HPP
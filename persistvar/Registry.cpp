@@ -0,0 +1,342 @@
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+#include "Registry.hpp"
+
+using namespace std;
+
+namespace ns_persistent {
+
+  // lock macros of a registry
+  #define REG_LOCK(r) \
+  do { \
+    if (pthread_mutex_lock(&(r)->m_mutex) != 0) { \
+      throw PERSIST_EXP_MUTEX_LOCK(errno); \
+    } \
+  } while (0)
+
+  #define REG_UNLOCK(r) \
+  do { \
+    if (pthread_mutex_unlock(&(r)->m_mutex) != 0) { \
+      throw PERSIST_EXP_MUTEX_UNLOCK(errno); \
+    } \
+  } while (0)
+
+  // lock macros of a maintenance pass
+  #define MT_LOCK(r) \
+  do { \
+    if (pthread_mutex_lock(&(r)->m_mtMutex) != 0) { \
+      throw PERSIST_EXP_MUTEX_LOCK(errno); \
+    } \
+  } while (0)
+
+  #define MT_UNLOCK(r) \
+  do { \
+    if (pthread_mutex_unlock(&(r)->m_mtMutex) != 0) { \
+      throw PERSIST_EXP_MUTEX_UNLOCK(errno); \
+    } \
+  } while (0)
+
+  PersistentVariable::PersistentVariable() noexcept(false):
+    m_pRegistry(nullptr) {
+    if (pthread_mutex_init(&this->m_pinMutex,NULL) != 0) {
+      throw PERSIST_EXP_MUTEX_INIT(errno);
+    }
+  }
+
+  PersistentVariable::~PersistentVariable() noexcept(false) {
+    this->leaveRegistry();
+    if (!this->m_pins.empty()) {
+      dbg_warn("a variable is destroyed with {0} pinned versions.",this->m_pins.size());
+    }
+    pthread_mutex_destroy(&this->m_pinMutex);
+  }
+
+  void PersistentVariable::unpin(const int64_t & idx) noexcept(false) {
+    PV_LOCK;
+    auto it = this->m_pins.find(idx);
+    if (it != this->m_pins.end() && --it->second == 0) {
+      this->m_pins.erase(it);
+    }
+    PV_UNLOCK;
+  }
+
+  bool PersistentVariable::applyRetention() noexcept(false) {
+    int64_t earliest, latest;
+    this->lookupIndexes(earliest,latest);
+    if (latest == -1 || earliest >= latest) {
+      return false;
+    }
+    // trim till idx, which is the latest index beyond any of the bounds.
+    int64_t idx = earliest - 1;
+    if (this->m_oRetention.versions > 0) {
+      idx = std::max(idx,latest - (int64_t)this->m_oRetention.versions);
+    }
+    if (this->m_oRetention.history_us > 0) {
+      const uint64_t now = read_rtc_us();
+      if (now > this->m_oRetention.history_us) {
+        // the latest version stamped before the history.
+        idx = std::max(idx,this->lookup(HLCStamp(now - this->m_oRetention.history_us - 1,UINT64_MAX)));
+      }
+    }
+    if (this->m_oRetention.bytes > 0 &&
+        this->lookupDataSize(idx + 1) > this->m_oRetention.bytes) {
+      // search the earliest version from which the data fits.
+      int64_t low = idx + 1, high = latest;
+      while (low < high) {
+        const int64_t mid = low + (high - low)/2;
+        if (this->lookupDataSize(mid) <= this->m_oRetention.bytes) {
+          high = mid;
+        } else {
+          low = mid + 1;
+        }
+      }
+      idx = low - 1;
+    }
+    idx = std::min(idx,latest - 1);
+    if (idx < earliest) {
+      return false;
+    }
+    this->trimIndex(idx);
+    // the pinned versions may be kept.
+    int64_t head;
+    this->lookupIndexes(head,latest);
+    return head != earliest;
+  }
+
+  void PersistentVariable::leaveRegistry() noexcept(true) {
+    if (this->m_pRegistry == nullptr) {
+      return;
+    }
+    try {
+      this->m_pRegistry->remove(*this);
+    } catch (...) {
+      dbg_warn("failed to leave the registry.");
+    }
+  }
+
+  Snapshot & Snapshot::operator = (Snapshot && other) noexcept(false) {
+    if (this != &other) {
+      this->release();
+      this->m_pins = std::move(other.m_pins);
+      other.m_pins.clear();
+    }
+    return *this;
+  }
+
+  Snapshot::~Snapshot() noexcept(true) {
+    try {
+      this->release();
+    } catch (...) {
+      dbg_warn("failed to release a snapshot.");
+    }
+  }
+
+  void Snapshot::release() noexcept(false) {
+    while (!this->m_pins.empty()) {
+      const auto & pin = this->m_pins.back();
+      if (pin.second != -1) {
+        pin.first->unpin(pin.second);
+      }
+      this->m_pins.pop_back();
+    }
+  }
+
+  int64_t Snapshot::getIndex(const PersistentVariable & var) const noexcept(false) {
+    // a snapshot has tens of variables: a linear search is fast enough.
+    for (const auto & pin : this->m_pins) {
+      if (pin.first == &var) {
+        return pin.second;
+      }
+    }
+    throw PERSIST_EXP_NOT_IN_SNAPSHOT;
+  }
+
+  PersistentRegistry::PersistentRegistry(const uint64_t & maintenance_interval_us)
+  noexcept(false):
+    m_iMaintenanceIntervalUs(MIN(maintenance_interval_us,MAX_MAINTENANCE_INTERVAL_US)),
+    m_bMtThread(false),
+    m_bMtStop(false) {
+    if (pthread_mutex_init(&this->m_mutex,NULL) != 0 ||
+        pthread_mutex_init(&this->m_mtMutex,NULL) != 0) {
+      throw PERSIST_EXP_MUTEX_INIT(errno);
+    }
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+    if (pthread_cond_init(&this->m_mtCond,&attr) != 0) {
+      throw PERSIST_EXP_COND_INIT(errno);
+    }
+    pthread_condattr_destroy(&attr);
+  }
+
+  PersistentRegistry::~PersistentRegistry() noexcept(true) {
+    if (this->m_bMtThread) {
+      pthread_mutex_lock(&this->m_mtMutex);
+      this->m_bMtStop = true;
+      pthread_cond_signal(&this->m_mtCond);
+      pthread_mutex_unlock(&this->m_mtMutex);
+      pthread_join(this->m_mtThread,NULL);
+    }
+    pthread_cond_destroy(&this->m_mtCond);
+    pthread_mutex_destroy(&this->m_mtMutex);
+    pthread_mutex_lock(&this->m_mutex);
+    for (auto var : this->m_vars) {
+      var->m_pRegistry = nullptr;
+    }
+    this->m_vars.clear();
+    pthread_mutex_unlock(&this->m_mutex);
+    pthread_mutex_destroy(&this->m_mutex);
+  }
+
+  void PersistentRegistry::add(PersistentVariable & var) noexcept(false) {
+    REG_LOCK(this);
+    if (var.m_pRegistry == this) {
+      REG_UNLOCK(this);
+      return;
+    }
+    if (var.m_pRegistry != nullptr) {
+      REG_UNLOCK(this);
+      throw PERSIST_EXP_REGISTERED;
+    }
+    if (var.m_oRetention.enabled() && !this->m_bMtThread) {
+      int err = pthread_create(&this->m_mtThread,NULL,maintenanceThread,(void*)this);
+      if (err != 0) {
+        REG_UNLOCK(this);
+        throw PERSIST_EXP_CREATE_THREAD(err);
+      }
+      this->m_bMtThread = true;
+    }
+    this->m_vars.push_back(&var);
+    var.m_pRegistry = this;
+    REG_UNLOCK(this);
+  }
+
+  void PersistentRegistry::remove(PersistentVariable & var) noexcept(false) {
+    // wait for the maintenance pass using the variable.
+    MT_LOCK(this);
+    REG_LOCK(this);
+    auto it = std::find(this->m_vars.begin(),this->m_vars.end(),&var);
+    if (it != this->m_vars.end()) {
+      this->m_vars.erase(it);
+      var.m_pRegistry = nullptr;
+    }
+    REG_UNLOCK(this);
+    MT_UNLOCK(this);
+  }
+
+  PersistentRegistry & PersistentRegistry::getDefault() noexcept(false) {
+    static PersistentRegistry registry;
+    return registry;
+  }
+
+  std::size_t PersistentRegistry::size() noexcept(false) {
+    std::size_t num;
+    REG_LOCK(this);
+    num = this->m_vars.size();
+    REG_UNLOCK(this);
+    return num;
+  }
+
+  template <typename TKey>
+  Snapshot PersistentRegistry::pinAll(const TKey & key) noexcept(false) {
+    Snapshot snap;
+    REG_LOCK(this);
+    try {
+      // the variables stay in the registry till all of them are pinned. A
+      // failure releases the pins taken so far with snap.
+      snap.m_pins.reserve(this->m_vars.size());
+      for (auto var : this->m_vars) {
+        snap.m_pins.emplace_back(var,var->pin(key));
+      }
+    } catch (...) {
+      REG_UNLOCK(this);
+      throw;
+    }
+    REG_UNLOCK(this);
+    return snap;
+  }
+
+  Snapshot PersistentRegistry::snapshot(const __int128 & ver) noexcept(false) {
+    return this->pinAll(ver);
+  }
+
+  Snapshot PersistentRegistry::snapshot(const HLCStamp & hlc) noexcept(false) {
+    return this->pinAll(hlc);
+  }
+
+  std::size_t PersistentRegistry::maintain() noexcept(false) {
+    std::size_t num;
+    MT_LOCK(this);
+    try {
+      num = this->doMaintain();
+    } catch (...) {
+      MT_UNLOCK(this);
+      throw;
+    }
+    MT_UNLOCK(this);
+    return num;
+  }
+
+  std::size_t PersistentRegistry::doMaintain() noexcept(false) {
+    // STEP 1: trim the variables in one pass.
+    std::vector<PersistentVariable *> trimmed;
+    REG_LOCK(this);
+    for (auto var : this->m_vars) {
+      if (!var->m_oRetention.enabled()) {
+        continue;
+      }
+      try {
+        if (var->applyRetention()) {
+          trimmed.push_back(var);
+        }
+      } catch (...) {
+        dbg_warn("failed to apply the retention policy of a variable.");
+      }
+    }
+    REG_UNLOCK(this);
+    // STEP 2: persist the new heads. The variables stay in the registry
+    // with m_mtMutex, and the variables in a shared log are persisted by
+    // the first of them.
+    for (auto var : trimmed) {
+      try {
+        var->persistLog();
+      } catch (...) {
+        dbg_warn("failed to persist a trimmed variable.");
+      }
+    }
+    return trimmed.size();
+  }
+
+  void * PersistentRegistry::maintenanceThread(void * arg) noexcept(true) {
+    PersistentRegistry * reg = (PersistentRegistry *)arg;
+    const uint64_t interval_ns = reg->m_iMaintenanceIntervalUs * 1000;
+    pthread_mutex_lock(&reg->m_mtMutex);
+    while (true) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC,&deadline);
+      deadline.tv_sec += (deadline.tv_nsec + interval_ns) / 1000000000;
+      deadline.tv_nsec = (deadline.tv_nsec + interval_ns) % 1000000000;
+      int ret = 0;
+      while (!reg->m_bMtStop && (ret == 0 || ret == EINTR)) {
+        ret = pthread_cond_timedwait(&reg->m_mtCond,&reg->m_mtMutex,&deadline);
+      }
+      if (ret != 0 && ret != ETIMEDOUT && ret != EINTR) {
+        dbg_warn("maintenance thread failed to wait with error {0}.",ret);
+      }
+      if (reg->m_bMtStop) {
+        break;
+      }
+      try {
+        const std::size_t num = reg->doMaintain();
+        if (num > 0) {
+          dbg_trace("maintenance trimmed {0} variables.",num);
+        }
+      } catch (...) {
+        dbg_warn("maintenance pass failed.");
+      }
+    }
+    pthread_mutex_unlock(&reg->m_mtMutex);
+    return nullptr;
+  }
+}
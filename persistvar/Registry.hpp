@@ -0,0 +1,270 @@
+#ifndef REGISTRY_HPP
+#define REGISTRY_HPP
+
+#include <pthread.h>
+#include <map>
+#include <vector>
+#include "util.hpp"
+#include "HLC.hpp"
+#include "PersistException.hpp"
+
+namespace ns_persistent {
+
+  class PersistentRegistry;
+  class Snapshot;
+
+  // how often the maintenance thread of a registry applies the retention
+  // policies by default
+  #define DEFAULT_MAINTENANCE_INTERVAL_US   (1000000)
+  // the longest interval, a day. A longer one is clamped to it.
+  #define MAX_MAINTENANCE_INTERVAL_US       (86400000000ULL)
+
+  // Retention policy of a variable: the maintenance thread of its registry
+  // trims the versions beyond any of the bounds. 0 disables a bound. The
+  // latest version is always kept.
+  struct RetentionPolicy {
+    // keep this many latest versions
+    uint64_t versions = 0;
+    // keep the versions stamped in the last history_us microseconds of the
+    // real-time clock
+    uint64_t history_us = 0;
+    // keep the latest versions whose data takes up to this many bytes in
+    // the log
+    uint64_t bytes = 0;
+
+    bool enabled() const noexcept(true) {
+      return this->versions > 0 || this->history_us > 0 || this->bytes > 0;
+    }
+  };
+
+  // PersistentVariable is the part of Persistent<T> independent of T, through
+  // which a registry reaches its variables. A snapshot pins a version of the
+  // variable: the pinned version and the versions after it are not trimmed
+  // till the snapshot is released.
+  class PersistentVariable {
+    friend class PersistentRegistry;
+    friend class Snapshot;
+  protected:
+    // the pinned indexes, with the number of snapshots and version ranges
+    // pinning each
+    std::map<int64_t,uint32_t> m_pins;
+    // the lock of the pins, which is held by trim() in the derived class: a
+    // version is either trimmed before a snapshot looks it up, or pinned
+    // before it is trimmed.
+    pthread_mutex_t m_pinMutex;
+    // the registry of the variable, or nullptr
+    PersistentRegistry * m_pRegistry;
+    // the retention policy, applied by the registry
+    RetentionPolicy m_oRetention;
+
+    // lock macros of the pins
+    #define PV_LOCK \
+    do { \
+      if (pthread_mutex_lock(&this->m_pinMutex) != 0) { \
+        throw PERSIST_EXP_MUTEX_LOCK(errno); \
+      } \
+    } while (0)
+
+    #define PV_UNLOCK \
+    do { \
+      if (pthread_mutex_unlock(&this->m_pinMutex) != 0) { \
+        throw PERSIST_EXP_MUTEX_UNLOCK(errno); \
+      } \
+    } while (0)
+
+    // Get the index of the latest version equal or earlier than ver, or -1.
+    virtual int64_t lookup(const __int128 & ver) noexcept(false) = 0;
+
+    // Get the index of the latest version with HLC equal or earlier than
+    // hlc, or -1.
+    virtual int64_t lookup(const HLCStamp & hlc) noexcept(false) = 0;
+
+    // Get the indexes of the earliest and the latest versions. latest is -1
+    // if there is no version.
+    virtual void lookupIndexes(int64_t & earliest, int64_t & latest) noexcept(false) = 0;
+
+    // Get the bytes of the data of the versions from index idx to the latest
+    // one in the log.
+    virtual uint64_t lookupDataSize(const int64_t & idx) noexcept(false) = 0;
+
+    // Trim the versions till index idx, inclusively, like trim() of the
+    // derived class.
+    virtual void trimIndex(const int64_t & idx) noexcept(false) = 0;
+
+    // Persist the log of the variable.
+    virtual void persistLog() noexcept(false) = 0;
+
+    // Trim the versions beyond the retention policy.
+    // @return if any version is trimmed.
+    bool applyRetention() noexcept(false);
+
+    // Pin the latest version equal or earlier than the key.
+    // @return the index of the version, or -1 if there is no such version,
+    //         when nothing is pinned.
+    template <typename TKey>
+    int64_t pin(const TKey & key) noexcept(false) {
+      PV_LOCK;
+      int64_t idx;
+      try {
+        idx = this->lookup(key);
+        if (idx != -1) {
+          this->m_pins[idx] ++;
+        }
+      } catch (...) {
+        PV_UNLOCK;
+        throw;
+      }
+      PV_UNLOCK;
+      return idx;
+    }
+
+    // Release a pin of pin().
+    void unpin(const int64_t & idx) noexcept(false);
+
+    // Clamp the index trim() trims till before the earliest pinned version.
+    // We assume m_pinMutex is acquired.
+    int64_t clampTrim(const int64_t & idx) noexcept(true) {
+      if (this->m_pins.empty() || idx < this->m_pins.begin()->first) {
+        return idx;
+      }
+      return this->m_pins.begin()->first - 1;
+    }
+
+    // Leave the registry, if any. The derived class calls it first in its
+    // destructor so that no snapshot reaches a variable being destroyed.
+    void leaveRegistry() noexcept(true);
+
+  public:
+    PersistentVariable() noexcept(false);
+    virtual ~PersistentVariable() noexcept(false);
+  };
+
+  // Snapshot is a consistent view of the variables of a registry as of a
+  // version or an HLC clock, see PersistentRegistry::snapshot(). It keeps the
+  // index of the version of each variable, which is read by index without
+  // searching the log again, and pins it till the snapshot is released or
+  // destroyed. The variables must outlive their snapshots. A snapshot can be
+  // moved but not copied.
+  class Snapshot {
+    friend class PersistentRegistry;
+  protected:
+    // the pinned index of each variable in the order of the variables, -1
+    // if the variable has no version in the snapshot
+    std::vector<std::pair<PersistentVariable *,int64_t>> m_pins;
+
+  public:
+    Snapshot() noexcept(true) {
+    }
+
+    Snapshot(Snapshot && other) noexcept(true):
+      m_pins(std::move(other.m_pins)) {
+      other.m_pins.clear();
+    }
+
+    Snapshot & operator = (Snapshot && other) noexcept(false);
+    Snapshot(const Snapshot &) = delete;
+    Snapshot & operator = (const Snapshot &) = delete;
+
+    virtual ~Snapshot() noexcept(true);
+
+    // Unpin the versions. The snapshot is empty afterwards.
+    void release() noexcept(false);
+
+    // Get the index of the version of a variable in the snapshot, or -1 if
+    // the variable has no such version.
+    // @throw PERSIST_EXP_NOT_IN_SNAPSHOT if the variable is not in the
+    //        snapshot.
+    int64_t getIndex(const PersistentVariable & var) const noexcept(false);
+
+    // the number of variables in the snapshot
+    std::size_t size() const noexcept(true) {
+      return this->m_pins.size();
+    }
+
+    bool empty() const noexcept(true) {
+      return this->m_pins.empty();
+    }
+  };
+
+  // PersistentRegistry is a set of variables read together, e.g. the
+  // Persistent<T> members of a replicated object. A variable joins a
+  // registry by PersistentConfig::registry or add(), and leaves it when it is
+  // destroyed. The variables with a retention policy and without a registry
+  // join the default registry.
+  //
+  // A maintenance thread is started when the first variable with a
+  // retention policy joins. It applies the policies of all the variables in
+  // one pass every interval: the trims are done first, and the new heads are
+  // persisted after them, once per trimmed variable. The appenders are not
+  // involved, and the snapshots wait only for the trims.
+  class PersistentRegistry {
+    friend class PersistentVariable;
+  protected:
+    // the variables, in the order they joined
+    std::vector<PersistentVariable *> m_vars;
+    // the lock of m_vars
+    pthread_mutex_t m_mutex;
+    // the maintenance thread
+    const uint64_t m_iMaintenanceIntervalUs;
+    pthread_t m_mtThread;
+    bool m_bMtThread;
+    bool m_bMtStop;
+    // the lock of a maintenance pass, which is acquired before m_mutex. A
+    // variable leaves the registry only between the passes.
+    pthread_mutex_t m_mtMutex;
+    // signals the maintenance thread to stop
+    pthread_cond_t m_mtCond;
+
+    // Pin the versions of all the variables as of the key.
+    template <typename TKey>
+    Snapshot pinAll(const TKey & key) noexcept(false);
+
+    // Apply the retention policies of the variables.
+    // @return the number of variables trimmed
+    // We assume m_mtMutex is acquired.
+    std::size_t doMaintain() noexcept(false);
+
+    // the maintenance thread
+    static void * maintenanceThread(void * arg) noexcept(true);
+
+  public:
+    // @param maintenance_interval_us how often the maintenance thread applies
+    //        the retention policies, up to MAX_MAINTENANCE_INTERVAL_US
+    PersistentRegistry(const uint64_t & maintenance_interval_us =
+      DEFAULT_MAINTENANCE_INTERVAL_US) noexcept(false);
+    // The maintenance thread is stopped, and the variables left in the
+    // registry leave it.
+    virtual ~PersistentRegistry() noexcept(true);
+
+    // the registry of the variables with a retention policy and without a
+    // registry of their own
+    static PersistentRegistry & getDefault() noexcept(false);
+
+    // Add a variable to the registry.
+    // @throw PERSIST_EXP_REGISTERED if it is in another registry.
+    void add(PersistentVariable & var) noexcept(false);
+
+    // Remove a variable from the registry. The snapshots taken before keep
+    // its pins.
+    void remove(PersistentVariable & var) noexcept(false);
+
+    // the number of variables in the registry
+    std::size_t size() noexcept(false);
+
+    // Take a snapshot of the latest version equal or earlier than ver of
+    // every variable. The variables are versioned together, so the
+    // versions in the snapshot are consistent.
+    Snapshot snapshot(const __int128 & ver) noexcept(false);
+
+    // Take a snapshot of the latest version with HLC equal or earlier than
+    // hlc of every variable.
+    Snapshot snapshot(const HLCStamp & hlc) noexcept(false);
+
+    // Apply the retention policies of the variables now, in the calling
+    // thread, without waiting for the maintenance thread.
+    // @return the number of variables trimmed
+    std::size_t maintain() noexcept(false);
+  };
+}
+
+#endif//REGISTRY_HPP
@@ -0,0 +1,751 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include "SharedLog.hpp"
+
+using namespace std;
+
+namespace ns_persistent {
+
+  /////////////////////////
+  // internal structures //
+  /////////////////////////
+
+  // the length of the name of a variable in the tags file, padded to 8 bytes
+  #define TAG_NAME_LEN(len) (((uint64_t)(len) + 7) & ~7UL)
+
+  // the number of records read at a time when the shared log is scanned
+  #define SHARED_LOAD_CHUNK (1024)
+
+  // the buffer of a thread for the records of appendBatch(), and for the data
+  // of the entries returned to the thread by getEntries().
+  static thread_local std::vector<char> t_batchBuffer;
+  static thread_local std::vector<char> t_bulkReadBuffer;
+
+  // the shared logs opened in the process
+  static std::map<std::string,std::weak_ptr<SharedLog>> sharedLogs;
+  static pthread_mutex_t sharedLogsMutex = PTHREAD_MUTEX_INITIALIZER;
+
+  ////////////////////////
+  // visible to outside //
+  ////////////////////////
+
+  SharedLog::SharedLog(const string & name, const PersistLogConfig & config)
+  noexcept(false) : m_sName(name),
+    m_oConfig(config),
+    m_sTagsFile(string(DEFAULT_FILE_PERSIST_LOG_DATA_PATH) + "/" + name + "." + TAGS_FILE_SUFFIX),
+    m_iTagsFileDesc(-1),
+    m_iTagsFileSize(0),
+    m_bTagsDirty(false),
+    m_pLog(nullptr),
+    m_iSeq(0),
+    m_iPersistedSeq(0),
+    m_pReservedVar(nullptr),
+    m_iReservedSize(0),
+    m_pReserved(nullptr) {
+    if (pthread_mutex_init(&this->m_mutex,NULL) != 0 ||
+        pthread_mutex_init(&this->m_persistMutex,NULL) != 0) {
+      throw PERSIST_EXP_MUTEX_INIT(errno);
+    }
+    // the log creates the data path.
+    this->m_pLog = new FilePersistLog(name,config);
+    try {
+      loadTags();
+      loadRecords();
+    } catch (uint64_t e) {
+      delete this->m_pLog;
+      if (this->m_iTagsFileDesc != -1) {
+        close(this->m_iTagsFileDesc);
+      }
+      for (auto var : this->m_vars) {
+        pthread_rwlock_destroy(&var->rwlock);
+        delete var;
+      }
+      throw e;
+    }
+    // the records after the latest one are versioned after it.
+    this->m_iSeq = this->m_pLog->getLatestIndex() + 1;
+    this->m_iPersistedSeq = this->m_iSeq;
+    dbg_trace("{0}:shared log loaded: {1} variables, {2} records.",name,
+      this->m_vars.size(),this->m_pLog->getLength());
+  }
+
+  SharedLog::~SharedLog() noexcept(true) {
+    delete this->m_pLog;
+    if (this->m_iTagsFileDesc != -1) {
+      close(this->m_iTagsFileDesc);
+    }
+    for (auto var : this->m_vars) {
+      pthread_rwlock_destroy(&var->rwlock);
+      delete var;
+    }
+    pthread_mutex_destroy(&this->m_mutex);
+    pthread_mutex_destroy(&this->m_persistMutex);
+  }
+
+  std::shared_ptr<SharedLog> SharedLog::open(const string & name,
+    const PersistLogConfig & config) noexcept(false) {
+    SHL_LOCK(sharedLogsMutex);
+    std::shared_ptr<SharedLog> log = sharedLogs[name].lock();
+    if (!log) {
+      try {
+        log.reset(new SharedLog(name,config));
+      } catch (uint64_t e) {
+        sharedLogs.erase(name);
+        SHL_UNLOCK(sharedLogsMutex);
+        throw e;
+      }
+      sharedLogs[name] = log;
+    }
+    SHL_UNLOCK(sharedLogsMutex);
+    return log;
+  }
+
+  uint64_t SharedLog::getNumVars() noexcept(false) {
+    uint64_t num;
+    SHL_LOCK(this->m_mutex);
+    num = this->m_vars.size();
+    SHL_UNLOCK(this->m_mutex);
+    return num;
+  }
+
+  SharedPersistLog::SharedPersistLog(const string & sharedName, const string & name,
+    const PersistLogConfig & config) noexcept(false) : PersistLog(name),
+    m_pShared(SharedLog::open(sharedName,config)),
+    m_pVar(nullptr) {
+    SHL_LOCK(this->m_pShared->m_mutex);
+    try {
+      this->m_pVar = this->m_pShared->getOrAddVar(name);
+    } catch (uint64_t e) {
+      SHL_UNLOCK(this->m_pShared->m_mutex);
+      throw e;
+    }
+    SHL_UNLOCK(this->m_pShared->m_mutex);
+    dbg_trace("{0}:shared log {1} opened with tag {2}.",name,sharedName,this->m_pVar->tag);
+  }
+
+  SharedPersistLog::~SharedPersistLog() noexcept(true) {
+    // the variable is kept in the shared log till it is closed.
+  }
+
+  void SharedPersistLog::append(const void * pdata, const uint64_t & size,
+    const __int128 & ver, const HLCStamp & mhlc) noexcept(false) {
+    void * pdst = this->reserve(size);
+    memcpy(pdst,pdata,size);
+    this->commit(ver,mhlc);
+  }
+
+  void * SharedPersistLog::reserve(const uint64_t & size) noexcept(false) {
+    SharedLog * shared = this->m_pShared.get();
+    // hold the lock of the shared log till commit() or cancel().
+    SHL_LOCK(shared->m_mutex);
+    if (shared->m_pReservedVar != nullptr) {
+      SHL_UNLOCK(shared->m_mutex);
+      throw PERSIST_EXP_INV_RESERVATION;
+    }
+    try {
+      shared->m_pReserved = shared->m_pLog->reserve(sizeof(SharedLog::SharedRecord) + size);
+    } catch (uint64_t e) {
+      SHL_UNLOCK(shared->m_mutex);
+      throw e;
+    }
+    shared->m_pReservedVar = this->m_pVar;
+    shared->m_iReservedSize = size;
+    return (uint8_t *)shared->m_pReserved + sizeof(SharedLog::SharedRecord);
+  }
+
+  void SharedPersistLog::commit(const __int128 & ver, const HLCStamp & mhlc) noexcept(false) {
+    SharedLog * shared = this->m_pShared.get();
+    if (shared->m_pReservedVar != this->m_pVar) {
+      throw PERSIST_EXP_INV_RESERVATION;
+    }
+    // the entries are only changed with the lock of the shared log.
+    if (!this->m_pVar->refs.empty() && this->m_pVar->refs.back().ver >= ver) {
+      this->cancel();
+      throw PERSIST_EXP_INV_VERSION;
+    }
+    SharedLog::SharedRecord rec = {ver,tail(),shared->m_iReservedSize,
+      mhlc,this->m_pVar->tag,0};
+    // the record may be unaligned in the log.
+    memcpy(shared->m_pReserved,&rec,sizeof(rec));
+    shared->m_pReservedVar = nullptr;
+    try {
+      shared->m_pLog->commit(shared->m_iSeq,mhlc);
+      __atomic_store_n(&shared->m_iSeq,shared->m_iSeq + 1,__ATOMIC_RELEASE);
+      shared->indexRecord(this->m_pVar,rec,shared->m_pLog->getLatestIndex());
+    } catch (uint64_t e) {
+      SHL_UNLOCK(shared->m_mutex);
+      throw e;
+    }
+    SHL_UNLOCK(shared->m_mutex);
+  }
+
+  void SharedPersistLog::cancel() noexcept(false) {
+    SharedLog * shared = this->m_pShared.get();
+    if (shared->m_pReservedVar != this->m_pVar) {
+      return;
+    }
+    shared->m_pReservedVar = nullptr;
+    try {
+      shared->m_pLog->cancel();
+    } catch (uint64_t e) {
+      SHL_UNLOCK(shared->m_mutex);
+      throw e;
+    }
+    SHL_UNLOCK(shared->m_mutex);
+  }
+
+  void SharedPersistLog::appendBatch(const std::vector<PersistLogEntry> & entries)
+  noexcept(false) {
+    if (entries.empty()) {
+      return;
+    }
+    SharedLog * shared = this->m_pShared.get();
+    SHL_LOCK(shared->m_mutex);
+    if (shared->m_pReservedVar != nullptr) {
+      SHL_UNLOCK(shared->m_mutex);
+      throw PERSIST_EXP_INV_RESERVATION;
+    }
+    // validate the whole batch before writing any of it.
+    uint64_t total = 0;
+    __int128 ver = this->m_pVar->refs.empty() ? INVALID_VERSION : this->m_pVar->refs.back().ver;
+    for (const auto & e : entries) {
+      if (ver != INVALID_VERSION && ver >= e.ver) {
+        SHL_UNLOCK(shared->m_mutex);
+        throw PERSIST_EXP_INV_VERSION;
+      }
+      ver = e.ver;
+      total += sizeof(SharedLog::SharedRecord) + e.size;
+    }
+    // the records are built in the buffer of the thread, and appended in
+    // one batch of the shared log.
+    std::vector<SharedLog::SharedRecord> recs;
+    std::vector<PersistLogEntry> batch;
+    t_batchBuffer.resize(total);
+    uint8_t * pbuf = (uint8_t *)t_batchBuffer.data();
+    int64_t idx = tail();
+    int64_t seq = shared->m_iSeq;
+    for (const auto & e : entries) {
+      recs.push_back({e.ver,idx++,e.size,e.mhlc,this->m_pVar->tag,0});
+      memcpy(pbuf,&recs.back(),sizeof(SharedLog::SharedRecord));
+      memcpy(pbuf + sizeof(SharedLog::SharedRecord),e.pdata,e.size);
+      batch.push_back({pbuf,sizeof(SharedLog::SharedRecord) + e.size,seq++,e.mhlc});
+      pbuf += sizeof(SharedLog::SharedRecord) + e.size;
+    }
+    try {
+      shared->m_pLog->appendBatch(batch);
+      __atomic_store_n(&shared->m_iSeq,seq,__ATOMIC_RELEASE);
+      int64_t sidx = shared->m_pLog->getLatestIndex() - (int64_t)recs.size() + 1;
+      for (const auto & rec : recs) {
+        shared->indexRecord(this->m_pVar,rec,sidx++);
+      }
+    } catch (uint64_t e) {
+      SHL_UNLOCK(shared->m_mutex);
+      throw e;
+    }
+    SHL_UNLOCK(shared->m_mutex);
+  }
+
+  int64_t SharedPersistLog::getLength() noexcept(false) {
+    int64_t len;
+    SPL_RDLOCK;
+    len = (int64_t)this->m_pVar->refs.size();
+    SPL_UNLOCK;
+    return len;
+  }
+
+  int64_t SharedPersistLog::getEarliestIndex() noexcept(false) {
+    int64_t idx;
+    SPL_RDLOCK;
+    idx = this->m_pVar->refs.empty() ? INVALID_INDEX : this->m_pVar->head;
+    SPL_UNLOCK;
+    return idx;
+  }
+
+  const void * SharedPersistLog::getEntryByIndex(const int64_t & eidx) noexcept(false) {
+    const void * pdat;
+    SPL_RDLOCK;
+    const int64_t ridx = (eidx < 0) ? (tail() + eidx) : eidx;
+    if (tail() <= ridx || ridx < this->m_pVar->head) {
+      SPL_UNLOCK;
+      throw PERSIST_EXP_INV_ENTRY_IDX(eidx);
+    }
+    try {
+      pdat = readEntry(ridx);
+    } catch (uint64_t e) {
+      SPL_UNLOCK;
+      throw e;
+    }
+    SPL_UNLOCK;
+    return pdat;
+  }
+
+  const void * SharedPersistLog::getEntry(const __int128 & ver) noexcept(false) {
+    const void * pdat;
+    SPL_RDLOCK;
+    try {
+      const int64_t idx = searchVersion(ver);
+      pdat = (idx == -1) ? nullptr : readEntry(idx);
+    } catch (uint64_t e) {
+      SPL_UNLOCK;
+      throw e;
+    }
+    SPL_UNLOCK;
+    return pdat;
+  }
+
+  const void * SharedPersistLog::getEntry(const HLCStamp & hlc) noexcept(false) {
+    const void * pdat;
+    SPL_RDLOCK;
+    try {
+      const int64_t idx = searchHlc(hlc.key());
+      pdat = (idx == -1) ? nullptr : readEntry(idx);
+    } catch (uint64_t e) {
+      SPL_UNLOCK;
+      throw e;
+    }
+    SPL_UNLOCK;
+    return pdat;
+  }
+
+  int64_t SharedPersistLog::getLatestIndex() noexcept(false) {
+    int64_t idx;
+    SPL_RDLOCK;
+    idx = this->m_pVar->refs.empty() ? -1 : tail() - 1;
+    SPL_UNLOCK;
+    return idx;
+  }
+
+  int64_t SharedPersistLog::getIndex(const __int128 & ver) noexcept(false) {
+    int64_t idx;
+    SPL_RDLOCK;
+    idx = searchVersion(ver);
+    SPL_UNLOCK;
+    return idx;
+  }
+
+  int64_t SharedPersistLog::getIndex(const HLCStamp & hlc) noexcept(false) {
+    int64_t idx;
+    SPL_RDLOCK;
+    idx = searchHlc(hlc.key());
+    SPL_UNLOCK;
+    return idx;
+  }
+
+  void SharedPersistLog::getIndexRange(const HLCStamp & from, const HLCStamp & to,
+    int64_t & first, int64_t & last) noexcept(false) {
+    SPL_RDLOCK;
+    searchHlcRange(from.key(),to.key(),
+      first,last);
+    SPL_UNLOCK;
+  }
+
+  int64_t SharedPersistLog::getIndexNotBefore(const HLCStamp & hlc) noexcept(false) {
+    const unsigned __int128 key = hlc.key();
+    int64_t idx;
+    SPL_RDLOCK;
+    idx = searchNotBefore<unsigned __int128>(
+      [&](const unsigned __int128 & k) {
+        return searchHlc(k);
+      },
+      key,0,this->m_pVar->head);
+    if (idx >= tail()) {
+      idx = -1;
+    }
+    SPL_UNLOCK;
+    return idx;
+  }
+
+  int64_t SharedPersistLog::getEntries(const HLCStamp & from, const HLCStamp & to,
+    std::vector<const void *> & entries, std::vector<char> * buffer) noexcept(false) {
+    int64_t first, last;
+    SPL_RDLOCK;
+    searchHlcRange(from.key(),to.key(),
+      first,last);
+    try {
+      readEntries(first,last,entries,buffer);
+    } catch (uint64_t e) {
+      SPL_UNLOCK;
+      throw e;
+    }
+    SPL_UNLOCK;
+    return first;
+  }
+
+  int64_t SharedPersistLog::getEntries(const __int128 & from, const __int128 & to,
+    std::vector<const void *> & entries, std::vector<char> * buffer) noexcept(false) {
+    int64_t first, last;
+    SPL_RDLOCK;
+    searchRange<__int128>(
+      [&](const __int128 & ver) {
+        return searchVersion(ver);
+      },
+      from,to,INVALID_VERSION,this->m_pVar->head,first,last);
+    try {
+      readEntries(first,last,entries,buffer);
+    } catch (uint64_t e) {
+      SPL_UNLOCK;
+      throw e;
+    }
+    SPL_UNLOCK;
+    return first;
+  }
+
+  int64_t SharedPersistLog::getEntriesByIndex(const int64_t & from, const int64_t & to,
+    std::vector<const void *> & entries, std::vector<char> * buffer) noexcept(false) {
+    int64_t first, last;
+    SPL_RDLOCK;
+    first = MAX(from,this->m_pVar->head);
+    last = MAX(first,MIN(to,tail()));
+    try {
+      readEntries(first,last,entries,buffer);
+    } catch (uint64_t e) {
+      SPL_UNLOCK;
+      throw e;
+    }
+    SPL_UNLOCK;
+    return first;
+  }
+
+  uint64_t SharedPersistLog::getDataSize(const int64_t & idx) noexcept(false) {
+    uint64_t size = 0;
+    SPL_RDLOCK;
+    const int64_t first = MAX(idx,this->m_pVar->head);
+    if (first < tail()) {
+      size = this->m_pVar->dataTail - refAt(first).dofst;
+    }
+    SPL_UNLOCK;
+    return size;
+  }
+
+  uint32_t SharedPersistLog::getEntryFormat() noexcept(false) {
+    return __atomic_load_n(&this->m_pVar->format,__ATOMIC_ACQUIRE);
+  }
+
+  void SharedPersistLog::setEntryFormat(const uint32_t & format) noexcept(false) {
+    SharedLog * shared = this->m_pShared.get();
+    SHL_LOCK(shared->m_mutex);
+    const uint32_t old = this->m_pVar->format;
+    __atomic_store_n(&this->m_pVar->format,format,__ATOMIC_RELEASE);
+    try {
+      shared->writeFormat(this->m_pVar);
+    } catch (...) {
+      this->m_pVar->format = old;
+      SHL_UNLOCK(shared->m_mutex);
+      throw;
+    }
+    SHL_UNLOCK(shared->m_mutex);
+  }
+
+  const __int128 SharedPersistLog::persist() noexcept(false) {
+    // the latest entry is persisted with all the records before it.
+    __int128 ver = INVALID_VERSION;
+    SPL_RDLOCK;
+    if (!this->m_pVar->refs.empty()) {
+      ver = this->m_pVar->refs.back().ver;
+    }
+    SPL_UNLOCK;
+    this->m_pShared->persist();
+    return ver;
+  }
+
+  void SharedPersistLog::trim(const int64_t & idx) noexcept(false) {
+    SharedLog * shared = this->m_pShared.get();
+    SHL_LOCK(shared->m_mutex);
+    if (idx < this->m_pVar->head || idx >= tail()) {
+      SHL_UNLOCK(shared->m_mutex);
+      return;
+    }
+    try {
+      SPL_WRLOCK;
+      shared->m_fronts.erase({this->m_pVar->refs.front().idx,this->m_pVar->tag});
+      this->m_pVar->refs.erase(this->m_pVar->refs.begin(),
+        this->m_pVar->refs.begin() + (idx + 1 - this->m_pVar->head));
+      this->m_pVar->head = idx + 1;
+      if (!this->m_pVar->refs.empty()) {
+        shared->m_fronts.insert({this->m_pVar->refs.front().idx,this->m_pVar->tag});
+      }
+      SPL_UNLOCK;
+      shared->writeHead(this->m_pVar);
+      shared->trimShared();
+    } catch (uint64_t e) {
+      SHL_UNLOCK(shared->m_mutex);
+      throw e;
+    }
+    SHL_UNLOCK(shared->m_mutex);
+    dbg_trace("{0} trim at index: {1}...done",this->m_sName,idx);
+  }
+
+  void SharedPersistLog::trim(const __int128 & ver) noexcept(false) {
+    int64_t idx;
+    SPL_RDLOCK;
+    idx = searchVersion(ver);
+    SPL_UNLOCK;
+    if (idx != -1) {
+      trim(idx);
+    }
+  }
+
+  void SharedPersistLog::trim(const HLCStamp & hlc) noexcept(false) {
+    int64_t idx;
+    SPL_RDLOCK;
+    idx = searchHlc(hlc.key());
+    SPL_UNLOCK;
+    if (idx != -1) {
+      trim(idx);
+    }
+  }
+
+  //////////////////////////
+  // invisible to outside //
+  //////////////////////////
+
+  void SharedLog::loadTags() noexcept(false) {
+    this->m_iTagsFileDesc = ::open(this->m_sTagsFile.c_str(),O_RDWR|O_CREAT,S_IWUSR|S_IRUSR);
+    if (this->m_iTagsFileDesc == -1) {
+      throw PERSIST_EXP_OPEN_FILE(errno);
+    }
+    struct stat sb;
+    if (fstat(this->m_iTagsFileDesc,&sb) != 0) {
+      throw PERSIST_EXP_READ_FILE(errno);
+    }
+    std::vector<char> buf(sb.st_size);
+    if (sb.st_size > 0 && pread(this->m_iTagsFileDesc,buf.data(),sb.st_size,0) != sb.st_size) {
+      throw PERSIST_EXP_READ_FILE(errno);
+    }
+    off_t ofst = 0;
+    while (ofst + (off_t)sizeof(SharedTag) <= sb.st_size) {
+      SharedTag tag;
+      memcpy(&tag,buf.data() + ofst,sizeof(tag));
+      const off_t next = ofst + sizeof(SharedTag) + TAG_NAME_LEN(tag.len);
+      // a variable added by a crashed process may be torn.
+      if (next > sb.st_size) {
+        break;
+      }
+      if (tag.tag != this->m_vars.size()) {
+        throw PERSIST_EXP_CORRUPTED_META;
+      }
+      SharedVar * var = new SharedVar();
+      var->name.assign(buf.data() + ofst + sizeof(SharedTag),tag.len);
+      var->tag = tag.tag;
+      var->tagOfst = ofst;
+      var->head = tag.head;
+      var->dataTail = 0;
+      var->format = tag.format;
+      if (pthread_rwlock_init(&var->rwlock,NULL) != 0) {
+        delete var;
+        throw PERSIST_EXP_RWLOCK_INIT(errno);
+      }
+      this->m_vars.push_back(var);
+      this->m_tags[var->name] = var->tag;
+      ofst = next;
+    }
+    if (ofst < sb.st_size) {
+      dbg_warn("{0}:drop the torn variable at {1} of the tags file.",this->m_sName,ofst);
+      if (ftruncate(this->m_iTagsFileDesc,ofst) != 0) {
+        throw PERSIST_EXP_TRUNCATE_FILE(errno);
+      }
+    }
+    this->m_iTagsFileSize = ofst;
+  }
+
+  void SharedLog::loadRecords() noexcept(false) {
+    const int64_t earliest = this->m_pLog->getEarliestIndex();
+    if (earliest == INVALID_INDEX) {
+      return;
+    }
+    const int64_t latest = this->m_pLog->getLatestIndex();
+    std::vector<const void *> entries;
+    std::vector<char> buffer;
+    for (int64_t from = earliest; from <= latest; from += SHARED_LOAD_CHUNK) {
+      entries.clear();
+      const int64_t first = this->m_pLog->getEntriesByIndex(from,
+        MIN(from + SHARED_LOAD_CHUNK,latest + 1),entries,&buffer);
+      for (std::size_t i = 0; i < entries.size(); i++) {
+        SharedRecord rec;
+        memcpy(&rec,entries[i],sizeof(rec));
+        if (rec.tag >= this->m_vars.size()) {
+          dbg_warn("{0}:drop record {1} of unknown tag {2}.",this->m_sName,first + i,rec.tag);
+          continue;
+        }
+        SharedVar * var = this->m_vars[rec.tag];
+        const int64_t tail = var->head + (int64_t)var->refs.size();
+        // the entries before the head are trimmed.
+        if (rec.idx < tail) {
+          continue;
+        }
+        if (rec.idx > tail) {
+          dbg_warn("{0}:entries [{1},{2}) of {3} are missing.",this->m_sName,tail,rec.idx,var->name);
+          if (!var->refs.empty()) {
+            this->m_fronts.erase({var->refs.front().idx,var->tag});
+          }
+          var->refs.clear();
+          var->head = rec.idx;
+        }
+        indexRecord(var,rec,first + i);
+      }
+    }
+  }
+
+  SharedLog::SharedVar * SharedLog::getOrAddVar(const string & name) noexcept(false) {
+    auto it = this->m_tags.find(name);
+    if (it != this->m_tags.end()) {
+      return this->m_vars[it->second];
+    }
+    // the variable is durable with the next persist().
+    SharedTag tag = {(uint32_t)this->m_vars.size(),(uint32_t)name.size(),0,0,0};
+    std::vector<char> buf(sizeof(SharedTag) + TAG_NAME_LEN(name.size()),0);
+    memcpy(buf.data(),&tag,sizeof(tag));
+    memcpy(buf.data() + sizeof(tag),name.data(),name.size());
+    if (pwrite(this->m_iTagsFileDesc,buf.data(),buf.size(),this->m_iTagsFileSize) != (ssize_t)buf.size()) {
+      throw PERSIST_EXP_WRITE_FILE(errno);
+    }
+    SharedVar * var = new SharedVar();
+    var->name = name;
+    var->tag = tag.tag;
+    var->tagOfst = this->m_iTagsFileSize;
+    var->head = 0;
+    var->dataTail = 0;
+    var->format = 0;
+    if (pthread_rwlock_init(&var->rwlock,NULL) != 0) {
+      delete var;
+      throw PERSIST_EXP_RWLOCK_INIT(errno);
+    }
+    this->m_vars.push_back(var);
+    this->m_tags[name] = var->tag;
+    this->m_iTagsFileSize += buf.size();
+    this->m_bTagsDirty = true;
+    dbg_trace("{0}:add variable {1} with tag {2}.",this->m_sName,name,var->tag);
+    return var;
+  }
+
+  void SharedLog::writeHead(SharedVar * var) noexcept(false) {
+    if (pwrite(this->m_iTagsFileDesc,&var->head,sizeof(var->head),
+        var->tagOfst + offsetof(SharedTag,head)) != sizeof(var->head)) {
+      throw PERSIST_EXP_WRITE_FILE(errno);
+    }
+    this->m_bTagsDirty = true;
+  }
+
+  void SharedLog::writeFormat(SharedVar * var) noexcept(false) {
+    if (pwrite(this->m_iTagsFileDesc,&var->format,sizeof(var->format),
+        var->tagOfst + offsetof(SharedTag,format)) != sizeof(var->format)) {
+      throw PERSIST_EXP_WRITE_FILE(errno);
+    }
+    if (fdatasync(this->m_iTagsFileDesc) != 0) {
+      throw PERSIST_EXP_WRITE_FILE(errno);
+    }
+  }
+
+  void SharedLog::trimShared() noexcept(false) {
+    // without any entry, the whole log is trimmed.
+    const int64_t idx = this->m_fronts.empty() ? this->m_pLog->getLatestIndex() :
+      this->m_fronts.begin()->first - 1;
+    if (idx >= 0) {
+      this->m_pLog->trim(idx);
+    }
+  }
+
+  void SharedLog::indexRecord(SharedVar * var, const SharedRecord & rec,
+    const int64_t & idx) noexcept(false) {
+    if (pthread_rwlock_wrlock(&var->rwlock) != 0) {
+      throw PERSIST_EXP_RWLOCK_WRLOCK(errno);
+    }
+    if (var->refs.empty()) {
+      this->m_fronts.insert({idx,var->tag});
+    }
+    var->refs.push_back({rec.ver,idx,rec.hlc,var->dataTail});
+    var->dataTail += rec.size;
+    if (pthread_rwlock_unlock(&var->rwlock) != 0) {
+      throw PERSIST_EXP_RWLOCK_UNLOCK(errno);
+    }
+  }
+
+  void SharedLog::persist() noexcept(false) {
+    // the variables persisted after the first one of a version find nothing
+    // new to persist.
+    if (__atomic_load_n(&this->m_iPersistedSeq,__ATOMIC_ACQUIRE) ==
+          __atomic_load_n(&this->m_iSeq,__ATOMIC_ACQUIRE) &&
+        !__atomic_load_n(&this->m_bTagsDirty,__ATOMIC_ACQUIRE)) {
+      return;
+    }
+    SHL_LOCK(this->m_persistMutex);
+    // STEP 1: the tags are persisted before the records of the new variables.
+    SHL_LOCK(this->m_mutex);
+    const int64_t seq = this->m_iSeq;
+    const bool dirty = this->m_bTagsDirty;
+    this->m_bTagsDirty = false;
+    SHL_UNLOCK(this->m_mutex);
+    if (dirty && fdatasync(this->m_iTagsFileDesc) != 0) {
+      __atomic_store_n(&this->m_bTagsDirty,true,__ATOMIC_RELEASE);
+      SHL_UNLOCK(this->m_persistMutex);
+      throw PERSIST_EXP_WRITE_FILE(errno);
+    }
+    // STEP 2: persist the records till seq, and the trimmed head.
+    try {
+      this->m_pLog->persist();
+    } catch (uint64_t e) {
+      SHL_UNLOCK(this->m_persistMutex);
+      throw e;
+    }
+    __atomic_store_n(&this->m_iPersistedSeq,seq,__ATOMIC_RELEASE);
+    SHL_UNLOCK(this->m_persistMutex);
+  }
+
+  const void * SharedPersistLog::readEntry(const int64_t & idx) noexcept(false) {
+    return (const uint8_t *)this->m_pShared->m_pLog->getEntryByIndex(refAt(idx).idx) +
+      sizeof(SharedLog::SharedRecord);
+  }
+
+  void SharedPersistLog::readEntries(const int64_t & first, const int64_t & last,
+    std::vector<const void *> & entries, std::vector<char> * buffer) noexcept(false) {
+    if (this->m_pShared->m_oConfig.compression == CT_NONE) {
+      for (int64_t idx = first; idx < last; idx++) {
+        entries.push_back(readEntry(idx));
+      }
+      return;
+    }
+    // the data decompressed in the buffer of the thread is copied to the
+    // buffer, whose address is settled after all of them are copied.
+    std::vector<char> & buf = (buffer == nullptr) ? t_bulkReadBuffer : *buffer;
+    const std::size_t base = entries.size();
+    buf.clear();
+    for (int64_t idx = first; idx < last; idx++) {
+      const uint8_t * prec = (const uint8_t *)this->m_pShared->m_pLog->getEntryByIndex(refAt(idx).idx);
+      SharedLog::SharedRecord rec;
+      memcpy(&rec,prec,sizeof(rec));
+      entries.push_back((const void *)buf.size());
+      buf.insert(buf.end(),prec + sizeof(rec),prec + sizeof(rec) + rec.size);
+    }
+    for (std::size_t i = base; i < entries.size(); i++) {
+      entries[i] = buf.data() + (uint64_t)entries[i];
+    }
+  }
+
+  int64_t SharedPersistLog::searchVersion(const __int128 & ver) noexcept(true) {
+    return searchLast<__int128>(
+      [&](int64_t idx) {
+        return refAt(idx).ver;
+      },
+      ver,this->m_pVar->head,tail());
+  }
+
+  int64_t SharedPersistLog::searchHlc(const unsigned __int128 & key) noexcept(true) {
+    return searchLast<unsigned __int128>(
+      [&](int64_t idx) {
+        return refAt(idx).hlc.key();
+      },
+      key,this->m_pVar->head,tail());
+  }
+
+  void SharedPersistLog::searchHlcRange(const unsigned __int128 & from,
+    const unsigned __int128 & to, int64_t & first, int64_t & last) noexcept(true) {
+    searchRange<unsigned __int128>(
+      [&](const unsigned __int128 & key) {
+        return searchHlc(key);
+      },
+      from,to,0,this->m_pVar->head,first,last);
+  }
+}
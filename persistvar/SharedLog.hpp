@@ -0,0 +1,291 @@
+#ifndef SHARED_LOG_HPP
+#define SHARED_LOG_HPP
+
+#include <pthread.h>
+#include <deque>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "util.hpp"
+#include "PersistLog.hpp"
+#include "FilePersistLog.hpp"
+
+namespace ns_persistent {
+
+  #define TAGS_FILE_SUFFIX ("tags")
+
+  class SharedPersistLog;
+
+  // SharedLog multiplexes the logs of many variables into one FilePersistLog.
+  // Every entry of a variable is a tagged record in the shared log. The
+  // variables are viewed by SharedPersistLog, which keeps the index of the
+  // records of its variable in memory. The index is rebuilt by scanning the
+  // shared log when it is loaded.
+  //
+  // The tags of the variables are kept in a tags file, which has a record of
+  // the name, tag, head and entry format of each variable. The head is the
+  // index of the first entry of the variable, which is updated in place by
+  // trim(), like the format by setEntryFormat(). The
+  // shared log is trimmed till the earliest entry of all the variables.
+  //
+  // A shared log is opened once in a process, by the first SharedPersistLog
+  // with its name, and closed with the last one. Its configuration is taken
+  // from the first SharedPersistLog.
+  class SharedLog {
+    friend class SharedPersistLog;
+  protected:
+    // the header of a record in the shared log, which precedes the data of
+    // the entry of the variable.
+    typedef struct shared_record {
+      __int128 ver;     // version of the entry
+      int64_t idx;      // index of the entry in the log of the variable
+      uint64_t size;    // length of the data of the entry
+      HLCStamp hlc;     // hlc clock of the entry
+      uint32_t tag;     // tag of the variable
+      uint32_t rsvd;
+    } SharedRecord;
+
+    // the header of a variable in the tags file, which is followed by the
+    // name, padded to 8 bytes.
+    typedef struct shared_tag {
+      uint32_t tag;     // tag of the variable
+      uint32_t len;     // length of the name
+      int64_t head;     // index of the first entry of the variable
+      uint32_t format;  // the format of the entries of the variable, see
+                        // PersistLog::getEntryFormat()
+      uint32_t rsvd;
+    } SharedTag;
+
+    // the reference to an entry of a variable in the shared log
+    typedef struct shared_ref {
+      __int128 ver;     // version of the entry
+      int64_t idx;      // index of the record in the shared log
+      HLCStamp hlc;     // hlc clock of the entry
+      uint64_t dofst;   // the bytes of the data of the variable before it
+    } SharedRef;
+
+    // a variable in the shared log
+    typedef struct shared_var {
+      std::string name;
+      uint32_t tag;
+      // the offset of the SharedTag of the variable in the tags file
+      off_t tagOfst;
+      // the entries of the variable in [head,head+refs.size())
+      int64_t head;
+      std::deque<SharedRef> refs;
+      // the bytes of the data of the variable, counting the trimmed entries
+      uint64_t dataTail;
+      // the format of the entries of the variable
+      uint32_t format;
+      // read/write lock of head and refs
+      pthread_rwlock_t rwlock;
+    } SharedVar;
+
+    // the name of the shared log
+    const std::string m_sName;
+    // the configuration of the shared log, from the first variable
+    const PersistLogConfig m_oConfig;
+    // the file of the tags
+    const std::string m_sTagsFile;
+    int m_iTagsFileDesc;
+    // the end of the tags file
+    off_t m_iTagsFileSize;
+    // if the tags file is changed since the last persist()
+    bool m_bTagsDirty;
+    // the multiplexed log
+    FilePersistLog * m_pLog;
+    // the variables by tag, and the tags by name
+    std::vector<SharedVar *> m_vars;
+    std::unordered_map<std::string,uint32_t> m_tags;
+    // the first record of each variable with entries, which is the shared log
+    // trimmed before: (index in the shared log, tag)
+    std::set<std::pair<int64_t,uint32_t>> m_fronts;
+    // the version of the next record in the shared log, and of the last
+    // record persisted
+    int64_t m_iSeq;
+    int64_t m_iPersistedSeq;
+    // the reservation of reserve(): the variable and the size of its data
+    SharedVar * m_pReservedVar;
+    uint64_t m_iReservedSize;
+    void * m_pReserved;
+    // the lock of the appends, trims and the tags, which is held from
+    // reserve() till commit() or cancel()
+    pthread_mutex_t m_mutex;
+    // the lock of persist()
+    pthread_mutex_t m_persistMutex;
+
+    // lock macros
+    #define SHL_LOCK(m) \
+    do { \
+      if (pthread_mutex_lock(&(m)) != 0) { \
+        throw PERSIST_EXP_MUTEX_LOCK(errno); \
+      } \
+    } while (0)
+
+    #define SHL_UNLOCK(m) \
+    do { \
+      if (pthread_mutex_unlock(&(m)) != 0) { \
+        throw PERSIST_EXP_MUTEX_UNLOCK(errno); \
+      } \
+    } while (0)
+
+    // Load the tags file, or create it.
+    void loadTags() noexcept(false);
+
+    // Scan the shared log for the entries of the variables.
+    void loadRecords() noexcept(false);
+
+    // Get the variable of a name, or add it to the tags file. We assume
+    // m_mutex is acquired.
+    SharedVar * getOrAddVar(const std::string & name) noexcept(false);
+
+    // Write the head of a variable to the tags file. We assume m_mutex is
+    // acquired.
+    void writeHead(SharedVar * var) noexcept(false);
+
+    // Write the format of a variable to the tags file. We assume m_mutex is
+    // acquired.
+    void writeFormat(SharedVar * var) noexcept(false);
+
+    // Trim the shared log till the earliest entry of the variables. We
+    // assume m_mutex is acquired.
+    void trimShared() noexcept(false);
+
+    // Index the record appended at idx. We assume m_mutex is acquired.
+    void indexRecord(SharedVar * var, const SharedRecord & rec,
+      const int64_t & idx) noexcept(false);
+
+    // Persist the shared log and the tags file.
+    void persist() noexcept(false);
+
+    SharedLog(const std::string & name, const PersistLogConfig & config) noexcept(false);
+
+  public:
+    virtual ~SharedLog() noexcept(true);
+
+    // Open a shared log, which is loaded from the files or created by the
+    // first call with its name in the process.
+    static std::shared_ptr<SharedLog> open(const std::string & name,
+      const PersistLogConfig & config) noexcept(false);
+
+    // the number of variables in the shared log
+    uint64_t getNumVars() noexcept(false);
+  };
+
+  // SharedPersistLog is the log of a variable in a SharedLog. It has the
+  // same interface as the log of its own, and persist() persists the entries
+  // of all the variables in the shared log: after the first variable, it
+  // returns without I/O if nothing is appended since.
+  class SharedPersistLog : public PersistLog {
+  protected:
+    std::shared_ptr<SharedLog> m_pShared;
+    SharedLog::SharedVar * m_pVar;
+
+    // lock macros of the variable
+    #define SPL_WRLOCK \
+    do { \
+      if (pthread_rwlock_wrlock(&this->m_pVar->rwlock) != 0) { \
+        throw PERSIST_EXP_RWLOCK_WRLOCK(errno); \
+      } \
+    } while (0)
+
+    #define SPL_RDLOCK \
+    do { \
+      if (pthread_rwlock_rdlock(&this->m_pVar->rwlock) != 0) { \
+        throw PERSIST_EXP_RWLOCK_RDLOCK(errno); \
+      } \
+    } while (0)
+
+    #define SPL_UNLOCK \
+    do { \
+      if (pthread_rwlock_unlock(&this->m_pVar->rwlock) != 0) { \
+        throw PERSIST_EXP_RWLOCK_UNLOCK(errno); \
+      } \
+    } while (0)
+
+    // the index after the last entry of the variable. We assume SPL_RDLOCK
+    // or SPL_WRLOCK is acquired.
+    int64_t tail() noexcept(true) {
+      return this->m_pVar->head + (int64_t)this->m_pVar->refs.size();
+    }
+
+    // get the reference to an entry. We assume SPL_RDLOCK or SPL_WRLOCK is
+    // acquired.
+    SharedLog::SharedRef & refAt(const int64_t & idx) noexcept(true) {
+      return this->m_pVar->refs[idx - this->m_pVar->head];
+    }
+
+    // Read the data of an entry. The data of a compressed log is in the
+    // buffer of the thread, see PersistLog::getEntryByIndex(). We assume
+    // SPL_RDLOCK or SPL_WRLOCK is acquired.
+    const void * readEntry(const int64_t & idx) noexcept(false);
+
+    // Collect the data of the entries in [first,last). We assume SPL_RDLOCK
+    // or SPL_WRLOCK is acquired.
+    void readEntries(const int64_t & first, const int64_t & last,
+      std::vector<const void *> & entries, std::vector<char> * buffer) noexcept(false);
+
+    // Search the latest entry with version equal or earlier than ver, or -1.
+    // We assume SPL_RDLOCK or SPL_WRLOCK is acquired.
+    int64_t searchVersion(const __int128 & ver) noexcept(true);
+
+    // Search the latest entry with HLC equal or earlier than key, which is
+    // HLCStamp::key(), or -1. We assume SPL_RDLOCK or SPL_WRLOCK is
+    // acquired.
+    int64_t searchHlc(const unsigned __int128 & key) noexcept(true);
+
+    // Search the entries with HLC in [from,to] and return them as
+    // [first,last). We assume SPL_RDLOCK or SPL_WRLOCK is acquired.
+    void searchHlcRange(const unsigned __int128 & from, const unsigned __int128 & to,
+      int64_t & first, int64_t & last) noexcept(true);
+
+  public:
+    //Constructor
+    // @param sharedName - the name of the shared log
+    // @param name - the name of the variable in the shared log
+    SharedPersistLog(const string & sharedName, const string & name,
+      const PersistLogConfig & config = PersistLogConfig()) noexcept(false);
+    //Destructor
+    virtual ~SharedPersistLog() noexcept(true);
+
+    //Derived from PersistLog
+    virtual void append(const void * pdata,
+      const uint64_t & size, const __int128 & ver,
+      const HLCStamp & mhlc) noexcept(false);
+    virtual void * reserve(const uint64_t & size) noexcept(false);
+    virtual void commit(const __int128 & ver, const HLCStamp & mhlc) noexcept(false);
+    virtual void cancel() noexcept(false);
+    virtual void appendBatch(const std::vector<PersistLogEntry> & entries) noexcept(false);
+    virtual int64_t getLength() noexcept(false);
+    virtual int64_t getEarliestIndex() noexcept(false);
+    virtual const void* getEntryByIndex(const int64_t & eno) noexcept(false);
+    virtual const void* getEntry(const __int128 & ver) noexcept(false);
+    virtual const void* getEntry(const HLCStamp & hlc) noexcept(false);
+    virtual int64_t getLatestIndex() noexcept(false);
+    virtual int64_t getIndex(const __int128 & ver) noexcept(false);
+    virtual int64_t getIndex(const HLCStamp & hlc) noexcept(false);
+    virtual void getIndexRange(const HLCStamp & from, const HLCStamp & to,
+      int64_t & first, int64_t & last) noexcept(false);
+    virtual int64_t getIndexNotBefore(const HLCStamp & hlc) noexcept(false);
+    virtual int64_t getEntries(const HLCStamp & from, const HLCStamp & to,
+      std::vector<const void *> & entries,
+      std::vector<char> * buffer = nullptr) noexcept(false);
+    virtual int64_t getEntries(const __int128 & from, const __int128 & to,
+      std::vector<const void *> & entries,
+      std::vector<char> * buffer = nullptr) noexcept(false);
+    virtual int64_t getEntriesByIndex(const int64_t & from, const int64_t & to,
+      std::vector<const void *> & entries,
+      std::vector<char> * buffer = nullptr) noexcept(false);
+    virtual uint64_t getDataSize(const int64_t & idx) noexcept(false);
+    virtual uint32_t getEntryFormat() noexcept(false);
+    virtual void setEntryFormat(const uint32_t & format) noexcept(false);
+    virtual const __int128 persist() noexcept(false);
+    virtual void trim(const int64_t & idx) noexcept(false);
+    virtual void trim(const __int128 & ver) noexcept(false);
+    virtual void trim(const HLCStamp & hlc) noexcept(false);
+  };
+}
+
+#endif//SHARED_LOG_HPP
@@ -0,0 +1,108 @@
+#ifndef VERSION_CACHE_HPP
+#define VERSION_CACHE_HPP
+#include <sys/types.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include "PersistException.hpp"
+
+namespace ns_persistent {
+
+  // eviction policy of the version cache
+  enum CachePolicy {
+    CP_LRU = 0, // evict the least recently used version
+    CP_FIFO,    // evict the earliest cached version
+  };
+
+  // VersionCache keeps a bounded number of deserialized versions, keyed by
+  // their index in the log. An entry in the log never changes once it is
+  // appended, so a cached version is valid till the entry is trimmed.
+  template <typename T>
+  class VersionCache {
+  protected:
+    typedef std::list<std::pair<int64_t,std::shared_ptr<const T>>> CacheList;
+    // the number of versions to keep
+    const std::size_t m_iCapacity;
+    const CachePolicy m_policy;
+    // the versions in the order of eviction: the front goes first.
+    CacheList m_list;
+    std::unordered_map<int64_t,typename CacheList::iterator> m_map;
+    pthread_mutex_t m_lock;
+
+    #define VC_LOCK \
+    do { \
+      if (pthread_mutex_lock(&this->m_lock) != 0) { \
+        throw PERSIST_EXP_MUTEX_LOCK(errno); \
+      } \
+    } while (0)
+
+    #define VC_UNLOCK \
+    do { \
+      if (pthread_mutex_unlock(&this->m_lock) != 0) { \
+        throw PERSIST_EXP_MUTEX_UNLOCK(errno); \
+      } \
+    } while (0)
+
+  public:
+    VersionCache(const std::size_t & capacity, const CachePolicy & policy)
+      noexcept(false):
+      m_iCapacity(capacity),
+      m_policy(policy) {
+      if (pthread_mutex_init(&this->m_lock,NULL) != 0) {
+        throw PERSIST_EXP_MUTEX_INIT(errno);
+      }
+      this->m_map.reserve(capacity);
+    }
+
+    virtual ~VersionCache() noexcept(true) {
+      pthread_mutex_destroy(&this->m_lock);
+    }
+
+    // @return the version at index idx, or nullptr if it is not cached.
+    std::shared_ptr<const T> get(const int64_t & idx) noexcept(false) {
+      std::shared_ptr<const T> obj;
+      VC_LOCK;
+      auto it = this->m_map.find(idx);
+      if (it != this->m_map.end()) {
+        if (this->m_policy == CP_LRU) {
+          this->m_list.splice(this->m_list.end(),this->m_list,it->second);
+        }
+        obj = it->second->second;
+      }
+      VC_UNLOCK;
+      return obj;
+    }
+
+    // cache the version at index idx, evicting one if the cache is full.
+    void put(const int64_t & idx, const std::shared_ptr<const T> & obj) noexcept(false) {
+      VC_LOCK;
+      if (this->m_map.find(idx) == this->m_map.end()) {
+        if (this->m_list.size() >= this->m_iCapacity) {
+          this->m_map.erase(this->m_list.front().first);
+          this->m_list.pop_front();
+        }
+        this->m_map[idx] = this->m_list.emplace(this->m_list.end(),idx,obj);
+      }
+      VC_UNLOCK;
+    }
+
+    // drop the versions before index head, which are trimmed from the log.
+    void trim(const int64_t & head) noexcept(false) {
+      VC_LOCK;
+      for (auto it = this->m_list.begin(); it != this->m_list.end();) {
+        if (it->first < head) {
+          this->m_map.erase(it->first);
+          it = this->m_list.erase(it);
+        } else {
+          it ++;
+        }
+      }
+      VC_UNLOCK;
+    }
+  };
+}
+
+#endif//VERSION_CACHE_HPP
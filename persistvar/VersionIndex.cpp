@@ -0,0 +1,108 @@
+#include "VersionIndex.hpp"
+
+namespace ns_persistent {
+
+  // initial number of runs
+  #define INITIAL_RUN_CAPACITY (64)
+
+  VersionIndex::VersionIndex() noexcept(false):
+    m_iHead(0),
+    m_iTail(0) {
+    this->m_pRuns = new RunArray{new VersionRun[INITIAL_RUN_CAPACITY],INITIAL_RUN_CAPACITY};
+  }
+
+  VersionIndex::~VersionIndex() noexcept(true) {
+    this->m_retiredRuns.push_back(this->m_pRuns);
+    for (auto arr : this->m_retiredRuns) {
+      delete[] arr->runs;
+      delete arr;
+    }
+  }
+
+  void VersionIndex::append(const int64_t & idx, const __int128 & ver) noexcept(false) {
+    RunArray * arr = this->m_pRuns;
+    // trim() may move the head concurrently, which only leaves more room.
+    const int64_t head = __atomic_load_n(&this->m_iHead,__ATOMIC_ACQUIRE);
+    if (this->m_iTail > head) {
+      VersionRun * run = runAt(arr,this->m_iTail - 1);
+      if (run->idx + run->len == idx) {
+        if (run->len == 1) {
+          // the second entry decides the stride.
+          run->stride = ver - run->ver;
+          __atomic_store_n(&run->len,2,__ATOMIC_RELEASE);
+          return;
+        } else if (ver == run->ver + run->stride * run->len) {
+          __atomic_store_n(&run->len,run->len + 1,__ATOMIC_RELEASE);
+          return;
+        }
+      }
+    }
+    // start a new run
+    if ((uint64_t)(this->m_iTail - head) == arr->capacity) {
+      RunArray * narr = new RunArray{new VersionRun[arr->capacity << 1],arr->capacity << 1};
+      for (int64_t rno = head; rno < this->m_iTail; rno ++) {
+        *runAt(narr,rno) = *runAt(arr,rno);
+      }
+      this->m_retiredRuns.push_back(arr);
+      __atomic_store_n(&this->m_pRuns,narr,__ATOMIC_RELEASE);
+      arr = narr;
+    }
+    VersionRun * run = runAt(arr,this->m_iTail);
+    run->ver = ver;
+    run->stride = 0;
+    run->idx = idx;
+    run->len = 1;
+    __atomic_store_n(&this->m_iTail,this->m_iTail + 1,__ATOMIC_RELEASE);
+  }
+
+  void VersionIndex::trim(const int64_t & head) noexcept(true) {
+    const int64_t tail = __atomic_load_n(&this->m_iTail,__ATOMIC_ACQUIRE);
+    const RunArray * arr = __atomic_load_n(&this->m_pRuns,__ATOMIC_ACQUIRE);
+    int64_t rno = this->m_iHead;
+    // the last run is kept: append() may be extending it.
+    while (rno < tail - 1 &&
+           runAt(arr,rno)->idx + runAt(arr,rno)->len <= head) {
+      rno ++;
+    }
+    __atomic_store_n(&this->m_iHead,rno,__ATOMIC_RELEASE);
+  }
+
+  int64_t VersionIndex::lookup(const __int128 & ver) const noexcept(true) {
+    // load the tail before the array: a run in the tail is in the array.
+    const int64_t tail = __atomic_load_n(&this->m_iTail,__ATOMIC_ACQUIRE);
+    const int64_t head = __atomic_load_n(&this->m_iHead,__ATOMIC_ACQUIRE);
+    const RunArray * arr = __atomic_load_n(&this->m_pRuns,__ATOMIC_ACQUIRE);
+    if (tail <= head || runAt(arr,head)->ver > ver) {
+      return -1;
+    }
+    // the latest run starting at or before ver. Recent versions are in the
+    // last run mostly.
+    int64_t lo = head, hi = tail - 1;
+    while (lo < hi) {
+      int64_t mid = hi - (hi - lo) / 2;
+      if (runAt(arr,mid)->ver <= ver) {
+        lo = mid;
+      } else {
+        hi = mid - 1;
+      }
+    }
+    const VersionRun * run = runAt(arr,lo);
+    const int64_t len = __atomic_load_n(&run->len,__ATOMIC_ACQUIRE);
+    // a stale run is possible, be careful with its fields.
+    if (len <= 1 || run->stride <= 0) {
+      return run->idx;
+    }
+    __int128 k = (ver - run->ver) / run->stride;
+    if (k >= len) {
+      k = len - 1;
+    } else if (k < 0) {
+      k = 0;
+    }
+    return run->idx + (int64_t)k;
+  }
+
+  int64_t VersionIndex::getNumOfRuns() const noexcept(true) {
+    return __atomic_load_n(&this->m_iTail,__ATOMIC_ACQUIRE) -
+      __atomic_load_n(&this->m_iHead,__ATOMIC_ACQUIRE);
+  }
+}
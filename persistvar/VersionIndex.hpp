@@ -0,0 +1,62 @@
+#ifndef VERSION_INDEX_HPP
+#define VERSION_INDEX_HPP
+#include <sys/types.h>
+#include <inttypes.h>
+#include <vector>
+
+namespace ns_persistent {
+
+  // VersionIndex maps versions to log indexes. The versions are kept as runs:
+  // a run tells that the entries [idx,idx+len) have versions ver, ver+stride,
+  // ver+2*stride, ... A dense or strided version stream takes one run, and a
+  // gap in the stream starts a new run.
+  // append() is called by one writer, and trim() by one trimmer, which may
+  // run concurrently. The readers do not lock. A concurrent reader may see a
+  // stale run, so lookup() gives a hint, which must be checked against the
+  // log.
+  class VersionIndex {
+  protected:
+    typedef struct version_run {
+      __int128 ver;     // version of the first entry
+      __int128 stride;  // version increment, 0 for a single entry run
+      int64_t idx;      // index of the first entry
+      int64_t len;      // number of entries
+    } VersionRun;
+    // the runs are kept in a ring buffer of capacity runs, which is replaced
+    // by a larger one when it is full.
+    typedef struct run_array {
+      VersionRun * runs;
+      uint64_t capacity;
+    } RunArray;
+    RunArray * m_pRuns;
+    // the replaced ring buffers, kept for the readers till destruction.
+    std::vector<RunArray *> m_retiredRuns;
+    // the live runs are [m_iHead,m_iTail)
+    int64_t m_iHead;
+    int64_t m_iTail;
+
+    // get a run by its number
+    static inline VersionRun * runAt(const RunArray * arr, const int64_t & rno) {
+      return arr->runs + (uint64_t)rno % arr->capacity;
+    }
+
+  public:
+    VersionIndex() noexcept(false);
+    virtual ~VersionIndex() noexcept(true);
+
+    // index a new entry, whose version is larger than all the others.
+    void append(const int64_t & idx, const __int128 & ver) noexcept(false);
+
+    // drop the runs before the log head.
+    void trim(const int64_t & head) noexcept(true);
+
+    // get the index of the latest entry with version equal or earlier than
+    // ver, or -1 if ver is earlier than all of them. This is a hint.
+    int64_t lookup(const __int128 & ver) const noexcept(true);
+
+    // get the number of runs
+    int64_t getNumOfRuns() const noexcept(true);
+  };
+}
+
+#endif//VERSION_INDEX_HPP
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <thread>
+#include <vector>
 #include <spdlog/spdlog.h>
 #include <SerializationSupport.hpp>
 #include "Persistent.hpp"
@@ -20,14 +22,17 @@ public:
   }
 };
 
+// the maximum length of VariableBytes
+#define MAX_VB_SIZE (1UL<<20)
+
 // A variable that can change the length of its value
 class VariableBytes : public ByteRepresentable{
 public:
   std::size_t data_len;
-  char buf[MAX_DATA_SIZE];
+  char buf[MAX_VB_SIZE];
 
   VariableBytes () {
-    data_len = MAX_DATA_SIZE;
+    data_len = MAX_VB_SIZE;
   }
 
   virtual std::size_t to_bytes(char *v) const {
@@ -72,11 +77,12 @@ static void printhelp(){
   cout << "\tlist" << endl;
   cout << "\tvolatile" << endl;
   cout << "\thlc" << endl;
+  cout << "\thlcbench <threads> <ticks>" << endl;
   cout << "\teval <file|mem> <datasize> <num>" << endl;
-  cout << "NOTICE: test can crash if <datasize> is too large(>8MB).\n"
-       << "This is probably due to the stack size is limited. Try \n"
-       << "  \"ulimit -s unlimited\"\n"
-       << "to remove this limitation."<<endl;
+  cout << "\tshared <num>" << endl;
+  cout << "\troundtrip <file|direct|mem|3dxp> <num>" << endl;
+  cout << "\ttrimcrash" << endl;
+  cout << "NOTICE: <datasize> should not exceed " << MAX_VB_SIZE << " bytes." << endl;
 }
 
 Persistent<X> px1;
@@ -87,24 +93,139 @@ Persistent<X> pxarr[3]; //unused
 
 template <typename OT, StorageType st=ST_FILE>
 void listvar(Persistent<OT,st> &var){
-  int64_t nv = var.getNumOfVersions();
-  int64_t idx = var.getEarliestIndex();
-  cout<<"Number of Versions:\t"<<nv<<endl;
-  while (nv--) {
+  auto range = var.getRangeByIndex(var.getEarliestIndex(),INT64_MAX);
+  cout<<"Number of Versions:\t"<<range.size()<<endl;
+  for (auto it = range.begin(); it != range.end(); ++it) {
 /*
     // by lambda
-    var.getByIndex(nv,
+    it.get(
       [&](OT& x) {
-        cout<<"["<<nv<<"]\t"<<x.to_string()<<"\t//by lambda"<<endl;
+        cout<<"["<<it.getIndex()<<"]\t"<<x.to_string()<<"\t//by lambda"<<endl;
       });
 */
     // by copy
-    cout<<"["<<idx<<"]\t"<<var.getByIndex(idx)->to_string()<<"\t//by copy"<<endl;
-    idx++;
+    cout<<"["<<it.getIndex()<<"]\t"<<(*it)->to_string()<<"\t//by copy"<<endl;
   }
 }
 
 static void test_hlc();
+
+// append nvers versions to a variable after the versions in its log. The
+// value of a version is the version.
+template <StorageType st=ST_FILE>
+static void append_versions(Persistent<X,st> &var, int nvers){
+  int ver = (var.getNumOfVersions() > 0)? var.get()->x + 1 : 0;
+  for (int i = 0; i < nvers; i++, ver++) {
+    X x;
+    x.x = ver;
+    var.set(x,(__int128)ver);
+  }
+}
+
+// the variables in the shared log of the shared command
+#define SHARED_LOG_NAME "ptst_shared"
+static const char * shared_vars[] = {"sharedx0","sharedx1","sharedx2"};
+
+// append nvers versions to each of the variables in a shared log, trim the
+// first one but its latest version, and list them after reopening the log.
+static void test_shared(int nvers){
+  PersistentConfig config;
+  config.shared_log = SHARED_LOG_NAME;
+  {
+    Persistent<X> x0(nullptr,shared_vars[0],config);
+    Persistent<X> x1(nullptr,shared_vars[1],config);
+    Persistent<X> x2(nullptr,shared_vars[2],config);
+    append_versions<ST_FILE>(x0,nvers);
+    append_versions<ST_FILE>(x1,nvers);
+    append_versions<ST_FILE>(x2,nvers);
+    x0.trim((int64_t)(x0.getEarliestIndex() + x0.getNumOfVersions() - 2));
+    // persists all the variables in the shared log.
+    x0.persist();
+    cout << "appended " << nvers << " versions to each variable, and trimmed "
+         << shared_vars[0] << endl;
+  }
+  // the shared log is closed with its last variable.
+  Persistent<X> x0(nullptr,shared_vars[0],config);
+  Persistent<X> x1(nullptr,shared_vars[1],config);
+  Persistent<X> x2(nullptr,shared_vars[2],config);
+  cout << "reopened shared log " << SHARED_LOG_NAME << endl;
+  cout << shared_vars[0] << ":" << endl;
+  listvar<X>(x0);
+  cout << shared_vars[1] << ":" << endl;
+  listvar<X>(x1);
+  cout << shared_vars[2] << ":" << endl;
+  listvar<X>(x2);
+}
+
+// append nvers versions to a variable, and list it after reopening its log.
+// An ST_MEM variable has no versions after reopening.
+template <StorageType st>
+static void test_roundtrip(const char * name, int nvers){
+  {
+    Persistent<X,st> var(nullptr,name);
+    append_versions<st>(var,nvers);
+    var.persist();
+    cout << "appended " << nvers << " versions to " << name << endl;
+  }
+  Persistent<X,st> var(nullptr,name);
+  cout << "reopened " << name << ":" << endl;
+  listvar<X,st>(var);
+}
+
+// the log of the trimcrash command, which holds 64 entries at most.
+#define TRIMCRASH_NAME "ptst_trimcrash"
+#define TRIMCRASH_LOG_ENTRIES (64)
+
+// append 50 versions to a variable, persist them, trim all but the last 4 of
+// them, and append 40 more versions, which reuse the trimmed entries. The
+// log is reopened without another persist(), as after a crash, and lists
+// the last 44 versions recovered.
+static void test_trimcrash(){
+  PersistentConfig config;
+  config.log_entries = TRIMCRASH_LOG_ENTRIES;
+  config.log_entries_limit = TRIMCRASH_LOG_ENTRIES;
+  {
+    Persistent<X> var(nullptr,TRIMCRASH_NAME,config);
+    // keep the latest version of a previous run.
+    if (var.getNumOfVersions() > 1) {
+      var.trim((int64_t)(var.getEarliestIndex() + var.getNumOfVersions() - 2));
+      var.persist();
+    }
+    append_versions<ST_FILE>(var,50);
+    var.persist();
+    var.trim((int64_t)(var.getEarliestIndex() + var.getNumOfVersions() - 5));
+    append_versions<ST_FILE>(var,40);
+    cout << "appended 50 versions to " << TRIMCRASH_NAME
+         << ", persisted and trimmed them, and appended 40 more" << endl;
+  }
+  Persistent<X> var(nullptr,TRIMCRASH_NAME,config);
+  cout << "reopened " << TRIMCRASH_NAME << ":" << endl;
+  listvar<X>(var);
+}
+
+// tick a clock shared by nthreads threads, nticks times in each thread.
+template <typename ClockType>
+static void eval_hlc (const char * name, int nthreads, int nticks) {
+  ClockType clk;
+  std::vector<std::thread> threads;
+  struct timespec ts,te;
+  clock_gettime(CLOCK_REALTIME,&ts);
+  for (int t = 0; t < nthreads; t++) {
+    threads.emplace_back([&clk,nticks](){
+      for (int i = 0; i < nticks; i++) {
+        clk.tick();
+      }
+    });
+  }
+  for (auto & th : threads) {
+    th.join();
+  }
+  clock_gettime(CLOCK_REALTIME,&te);
+  long nsec = (te.tv_sec - ts.tv_sec)*1000000000 + te.tv_nsec - ts.tv_nsec;
+  cout << "HLC TEST(clock=" << name << ", threads=" << nthreads << ", ticks=" << nticks << ")" << endl;
+  cout << "throughput:\t" << (double)nthreads*nticks/nsec*1000 << " Mticks/s" << endl;
+  cout << "latency:\t" << (double)nsec/nticks << " nanoseconds" << endl;
+}
 template <StorageType st=ST_FILE>
 static void eval_write (std::size_t osize, int nops) {
   VariableBytes writeMe;
@@ -232,6 +353,13 @@ int main(int argc,char ** argv){
     else if (strcmp(argv[1],"hlc") == 0) {
       test_hlc();
     }
+    else if (strcmp(argv[1],"hlcbench") == 0) {
+      // hlcbench nthreads nticks
+      int nthreads = atoi(argv[2]);
+      int nticks = atoi(argv[3]);
+      eval_hlc<HLC>("HLC",nthreads,nticks);
+      eval_hlc<AtomicHLC>("AtomicHLC",nthreads,nticks);
+    }
     else if (strcmp(argv[1],"eval") == 0) {
       // eval file|mem osize nops
       int osize = atoi(argv[3]);
@@ -245,6 +373,29 @@ int main(int argc,char ** argv){
         cout << "unknown storage type:" << argv[2] << endl;
       }
     }
+    else if (strcmp(argv[1],"shared") == 0) {
+      // shared nvers
+      test_shared(atoi(argv[2]));
+    }
+    else if (strcmp(argv[1],"roundtrip") == 0) {
+      // roundtrip file|direct|mem|3dxp nvers
+      int nvers = atoi(argv[3]);
+
+      if(strcmp(argv[2],"file") == 0) {
+        test_roundtrip<ST_FILE>("roundtrip_file",nvers);
+      } else if(strcmp(argv[2],"direct") == 0) {
+        test_roundtrip<ST_DIRECT>("roundtrip_direct",nvers);
+      } else if(strcmp(argv[2],"mem") == 0) {
+        test_roundtrip<ST_MEM>("roundtrip_mem",nvers);
+      } else if(strcmp(argv[2],"3dxp") == 0) {
+        test_roundtrip<ST_3DXP>("roundtrip_3dxp",nvers);
+      } else {
+        cout << "unknown storage type:" << argv[2] << endl;
+      }
+    }
+    else if (strcmp(argv[1],"trimcrash") == 0) {
+      test_trimcrash();
+    }
     else {
       cout << "unknown command: " << argv[1] << endl;
       printhelp();